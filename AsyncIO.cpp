@@ -0,0 +1,486 @@
+#include "AsyncIO.h"
+
+#include "Metrics.h"
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+#include <libavutil/mem.h>
+}
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <string>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A file mapped read-only as a whole.
+class MappedInput
+{
+public:
+    ~MappedInput()
+    {
+#ifdef _WIN32
+        if (m_data)
+            UnmapViewOfFile(m_data);
+        if (m_mapping)
+            CloseHandle(m_mapping);
+        if (m_handle != INVALID_HANDLE_VALUE)
+            CloseHandle(m_handle);
+#else
+        if (m_data)
+            munmap(const_cast<uint8_t*>(m_data), size_t(m_size));
+#endif
+    }
+
+    // False for an empty file, which can't be mapped.
+    bool Open(const char* path)
+    {
+#ifdef _WIN32
+        m_handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        LARGE_INTEGER size;
+        if (m_handle == INVALID_HANDLE_VALUE || !GetFileSizeEx(m_handle, &size) || size.QuadPart == 0)
+            return false;
+        m_size = int64_t(size.QuadPart);
+        m_mapping = CreateFileMappingA(m_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (m_mapping == nullptr)
+            return false;
+        m_data = static_cast<const uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+        const int fd = open(path, O_RDONLY);
+        struct stat status;
+        if (fd < 0 || fstat(fd, &status) != 0 || status.st_size == 0) {
+            if (fd >= 0)
+                close(fd);
+            return false;
+        }
+        m_size = int64_t(status.st_size);
+        void* data = mmap(nullptr, size_t(m_size), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd); // the mapping keeps the file
+        if (data == MAP_FAILED)
+            return false;
+        m_data = static_cast<const uint8_t*>(data);
+        // the demuxer reads mostly forward, let the kernel read ahead aggressively
+        madvise(data, size_t(m_size), MADV_SEQUENTIAL);
+#endif
+        return m_data != nullptr;
+    }
+
+    const uint8_t* Data() const { return m_data; }
+    int64_t Size() const { return m_size; }
+
+private:
+#ifdef _WIN32
+    HANDLE m_handle = INVALID_HANDLE_VALUE;
+    HANDLE m_mapping = nullptr;
+#endif
+    const uint8_t* m_data = nullptr;
+    int64_t m_size = 0;
+};
+
+namespace {
+
+// size of the AVIOContext buffers, the demuxer and the muxer read and write in pieces of this size
+const int IO_BUFFER_SIZE = 1 << 16;
+// the read-ahead thread reads at most this much at once, and waits for at least this much room (or a quarter of
+// the ring buffer) so that it doesn't issue a read for every packet consumed
+const size_t READ_CHUNK = 1 << 20;
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+typedef const uint8_t* WriteBuffer;
+#else
+typedef uint8_t* WriteBuffer;
+#endif
+
+// with 64-bit offsets, videos are often larger than 2 GiB
+int FileSeek(FILE* file, int64_t offset, int origin)
+{
+#ifdef _WIN32
+    return _fseeki64(file, offset, origin);
+#else
+    return fseeko(file, off_t(offset), origin);
+#endif
+}
+
+int64_t FileTell(FILE* file)
+{
+#ifdef _WIN32
+    return _ftelli64(file);
+#else
+    return int64_t(ftello(file));
+#endif
+}
+
+// absolute position of an AVIOContext seek, -1 if whence isn't supported
+int64_t SeekTarget(int64_t offset, int whence, int64_t current, int64_t size)
+{
+    switch (whence & ~AVSEEK_FORCE) {
+    case SEEK_SET: return offset;
+    case SEEK_CUR: return current + offset;
+    case SEEK_END: return size >= 0 ? size + offset : -1;
+    }
+    return -1;
+}
+
+AVIOContext* AllocateIOContext(void* opaque, int writeFlag, int (*read)(void*, uint8_t*, int),
+    int (*write)(void*, WriteBuffer, int), int64_t (*seek)(void*, int64_t, int))
+{
+    auto* buffer = static_cast<unsigned char*>(av_malloc(IO_BUFFER_SIZE));
+    if (buffer == nullptr)
+        return nullptr;
+    AVIOContext* context = avio_alloc_context(buffer, IO_BUFFER_SIZE, writeFlag, opaque, read, write, seek);
+    if (context == nullptr)
+        av_free(buffer);
+    return context;
+}
+
+void FreeIOContext(AVIOContext*& context)
+{
+    if (context == nullptr)
+        return;
+    av_freep(&context->buffer);
+    avio_context_free(&context);
+}
+
+}
+
+const char* LocalPath(const char* path)
+{
+    if (strncmp(path, "file:", 5) == 0)
+        return path + 5;
+    if (strcmp(path, "-") == 0 || strncmp(path, "pipe:", 5) == 0 || strstr(path, "://") != nullptr)
+        return nullptr;
+    return path;
+}
+
+std::unique_ptr<AsyncInput> AsyncInput::Open(const char* path, size_t bufferSize, bool map, Metrics* metrics)
+{
+    const char* local = LocalPath(path);
+    if (local == nullptr)
+        return nullptr;
+#ifndef _WIN32
+    struct stat status;
+    if (stat(local, &status) != 0 || !S_ISREG(status.st_mode))
+        return nullptr;
+#endif
+
+    std::unique_ptr<AsyncInput> input(new AsyncInput(metrics));
+    if (map) {
+        std::unique_ptr<MappedInput> mapping(new MappedInput);
+        if (mapping->Open(local)) {
+            input->m_fileSize = mapping->Size();
+            input->m_mapping = std::move(mapping);
+            return input->AllocateContext() ? std::move(input) : nullptr;
+        }
+        // e.g. an empty file, read it the other way
+    }
+
+    input->m_file = fopen(local, "rb");
+    if (input->m_file == nullptr)
+        return nullptr;
+    if (FileSeek(input->m_file, 0, SEEK_END) == 0)
+        input->m_fileSize = FileTell(input->m_file);
+    FileSeek(input->m_file, 0, SEEK_SET);
+    input->m_ring.resize(std::max<size_t>(bufferSize, IO_BUFFER_SIZE));
+    if (!input->AllocateContext())
+        return nullptr;
+    input->m_thread = std::thread(&AsyncInput::ReadAhead, input.get());
+    return input;
+}
+
+AsyncInput::AsyncInput(Metrics* metrics) : m_metrics(metrics)
+{
+}
+
+bool AsyncInput::AllocateContext()
+{
+    m_context = AllocateIOContext(this, 0,
+        [](void* opaque, uint8_t* buf, int size) { return static_cast<AsyncInput*>(opaque)->Read(buf, size); },
+        nullptr,
+        [](void* opaque, int64_t offset, int whence) { return static_cast<AsyncInput*>(opaque)->SeekTo(offset, whence); });
+    return m_context != nullptr;
+}
+
+AsyncInput::~AsyncInput()
+{
+    if (m_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_spaceReady.notify_one();
+        m_thread.join();
+    }
+    FreeIOContext(m_context);
+    if (m_file)
+        fclose(m_file);
+}
+
+size_t AsyncInput::Buffered() const
+{
+    if (m_mapping)
+        return size_t(m_mapping->Size());
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_size;
+}
+
+size_t AsyncInput::Capacity() const
+{
+    return m_mapping ? size_t(m_mapping->Size()) : m_ring.size();
+}
+
+int AsyncInput::Read(uint8_t* buf, int size)
+{
+    if (m_mapping) {
+        const int64_t position = m_position;
+        const int n = int(std::min<int64_t>(size, m_fileSize - position));
+        if (n <= 0)
+            return AVERROR_EOF;
+        memcpy(buf, m_mapping->Data() + position, size_t(n));
+        m_position += n;
+        if (m_metrics)
+            m_metrics->Add(Counter::BytesRead, n);
+        return n;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_size == 0 && !m_eof && !m_error) {
+        // the read-ahead fell behind, this is what it is there to avoid
+        ScopedTimer timer(m_metrics, Stage::ReadStall);
+        m_dataReady.wait(lock, [this] { return m_size > 0 || m_eof || m_error; });
+    }
+    if (m_size == 0)
+        return m_error ? AVERROR(EIO) : AVERROR_EOF;
+
+    const size_t n = std::min({ size_t(size), m_size, m_ring.size() - m_head });
+    memcpy(buf, m_ring.data() + m_head, n);
+    m_head = (m_head + n) % m_ring.size();
+    m_size -= n;
+    m_position += int64_t(n);
+    lock.unlock();
+    m_spaceReady.notify_one();
+    return int(n);
+}
+
+int64_t AsyncInput::SeekTo(int64_t offset, int whence)
+{
+    if (whence == AVSEEK_SIZE)
+        return m_fileSize;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    const int64_t target = SeekTarget(offset, whence, m_position, m_fileSize);
+    if (target < 0)
+        return AVERROR(EINVAL);
+    if (m_mapping) {
+        m_position = target;
+        return target;
+    }
+
+    if (target >= m_position && target <= m_position + int64_t(m_size)) {
+        // skip over what is already read ahead
+        const size_t skipped = size_t(target - m_position);
+        m_head = (m_head + skipped) % m_ring.size();
+        m_size -= skipped;
+    }
+    else {
+        // start over from the target, the read in flight is dropped
+        ++m_generation;
+        m_head = 0;
+        m_size = 0;
+        m_eof = false;
+        m_error = false;
+    }
+    m_position = target;
+    lock.unlock();
+    m_spaceReady.notify_one();
+    return target;
+}
+
+void AsyncInput::ReadAhead()
+{
+    const size_t capacity = m_ring.size();
+    const size_t minRead = std::min(READ_CHUNK, capacity / 4);
+    int64_t filePosition = 0; // only this thread touches the file
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        m_spaceReady.wait(lock, [&] { return m_stop || (!m_eof && !m_error && capacity - m_size >= minRead); });
+        if (m_stop)
+            break;
+
+        // the region after the buffered data is only touched by this thread, it is read into without the lock
+        const uint64_t generation = m_generation;
+        const int64_t offset = m_position + int64_t(m_size);
+        const size_t tail = (m_head + m_size) % capacity;
+        const size_t n = std::min({ capacity - m_size, capacity - tail, READ_CHUNK });
+        lock.unlock();
+
+        bool ok = true;
+        if (offset != filePosition)
+            ok = FileSeek(m_file, offset, SEEK_SET) == 0;
+        const size_t read = ok ? fread(m_ring.data() + tail, 1, n, m_file) : 0;
+        const bool failed = !ok || (read < n && ferror(m_file));
+        clearerr(m_file);
+        filePosition = ok ? offset + int64_t(read) : -1;
+        if (m_metrics && read > 0)
+            m_metrics->Add(Counter::BytesRead, int64_t(read));
+
+        lock.lock();
+        // a seek came in meanwhile, what was read is not where the demuxer is
+        if (generation != m_generation)
+            continue;
+        m_size += read;
+        if (read < n) {
+            m_error = failed;
+            m_eof = !failed;
+        }
+        m_dataReady.notify_one();
+    }
+}
+
+
+std::unique_ptr<AsyncOutput> AsyncOutput::Open(const char* path, size_t bufferSize, Metrics* metrics)
+{
+    const char* local = LocalPath(path);
+    if (local == nullptr)
+        return nullptr;
+    FILE* file = fopen(local, "wb");
+    if (file == nullptr)
+        return nullptr;
+
+    std::unique_ptr<AsyncOutput> output(new AsyncOutput(file, bufferSize, metrics));
+    output->m_context = AllocateIOContext(output.get(), 1, nullptr,
+        [](void* opaque, WriteBuffer buf, int size) { return static_cast<AsyncOutput*>(opaque)->Write(buf, size); },
+        [](void* opaque, int64_t offset, int whence) { return static_cast<AsyncOutput*>(opaque)->SeekTo(offset, whence); });
+    if (output->m_context == nullptr)
+        return nullptr;
+    output->m_thread = std::thread(&AsyncOutput::WriteBehind, output.get());
+    return output;
+}
+
+AsyncOutput::AsyncOutput(FILE* file, size_t bufferSize, Metrics* metrics)
+    : m_file(file), m_metrics(metrics), m_ring(std::max<size_t>(bufferSize, IO_BUFFER_SIZE))
+{
+}
+
+AsyncOutput::~AsyncOutput()
+{
+    Close();
+    FreeIOContext(m_context);
+}
+
+bool AsyncOutput::Close()
+{
+    if (m_context)
+        avio_flush(m_context);
+    if (m_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_dataReady.notify_one();
+        m_thread.join();
+    }
+    if (m_file) {
+        m_error = fclose(m_file) != 0 || m_error;
+        m_file = nullptr;
+    }
+    return !m_error;
+}
+
+size_t AsyncOutput::Buffered() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_size;
+}
+
+int AsyncOutput::Write(const uint8_t* buf, int size)
+{
+    const size_t capacity = m_ring.size();
+    size_t written = 0;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (written < size_t(size)) {
+        if (m_size == capacity && !m_error) {
+            // the writer fell behind
+            ScopedTimer timer(m_metrics, Stage::WriteStall);
+            m_spaceReady.wait(lock, [&] { return m_size < capacity || m_error; });
+        }
+        if (m_error)
+            return AVERROR(EIO);
+
+        const size_t tail = (m_head + m_size) % capacity;
+        const size_t n = std::min({ size_t(size) - written, capacity - m_size, capacity - tail });
+        memcpy(m_ring.data() + tail, buf + written, n);
+        m_size += n;
+        written += n;
+        m_dataReady.notify_one();
+    }
+    return size;
+}
+
+int64_t AsyncOutput::SeekTo(int64_t offset, int whence)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    // the writer is idle once the buffer is drained, the file is then only touched here
+    m_spaceReady.wait(lock, [this] { return m_size == 0 || m_error; });
+    if (m_error)
+        return AVERROR(EIO);
+
+    const int64_t current = FileTell(m_file);
+    if (whence == AVSEEK_SIZE) {
+        const bool ok = FileSeek(m_file, 0, SEEK_END) == 0;
+        const int64_t size = ok ? FileTell(m_file) : -1;
+        FileSeek(m_file, current, SEEK_SET);
+        return size >= 0 ? size : AVERROR(EIO);
+    }
+    int64_t size = -1;
+    if ((whence & ~AVSEEK_FORCE) == SEEK_END && FileSeek(m_file, 0, SEEK_END) == 0)
+        size = FileTell(m_file);
+    const int64_t target = SeekTarget(offset, whence, current, size);
+    if (target < 0 || FileSeek(m_file, target, SEEK_SET) != 0)
+        return AVERROR(EINVAL);
+    return target;
+}
+
+void AsyncOutput::WriteBehind()
+{
+    const size_t capacity = m_ring.size();
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        m_dataReady.wait(lock, [this] { return m_stop || m_size > 0; });
+        if (m_size == 0 || m_error) {
+            if (m_stop)
+                break;
+            // after an error the data is dropped, the muxer gets EIO
+            m_size = 0;
+            m_spaceReady.notify_all();
+            continue;
+        }
+
+        // the buffered region is only appended to by the muxer, it is written out without the lock
+        const size_t n = std::min(m_size, capacity - m_head);
+        const uint8_t* data = m_ring.data() + m_head;
+        lock.unlock();
+        const bool ok = fwrite(data, 1, n, m_file) == n;
+        if (m_metrics && ok)
+            m_metrics->Add(Counter::BytesWritten, int64_t(n));
+        lock.lock();
+
+        m_error = m_error || !ok;
+        m_head = (m_head + n) % capacity;
+        m_size -= n;
+        m_spaceReady.notify_all();
+    }
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct AVIOContext;
+class Metrics;
+class MappedInput;
+
+// The plain file path names, without a "file:" prefix; null for URLs and pipes.
+const char* LocalPath(const char* path);
+
+// Input of a demuxer through a custom AVIOContext, so that a read that misses doesn't stall the pipeline: a thread
+// of its own reads the file ahead into a ring buffer, or the file is memory mapped and read from the mapping. A seek
+// within the buffered data only skips, others restart the read-ahead from there. The bytes read and the time the
+// demuxer waited are recorded into metrics (Counter::BytesRead, Stage::ReadStall).
+class AsyncInput
+{
+public:
+    // Null if path isn't a regular file, which is then left to FFmpeg's own I/O; bufferSize is the ring buffer size,
+    // unused when the file is mapped.
+    static std::unique_ptr<AsyncInput> Open(const char* path, size_t bufferSize, bool map, Metrics* metrics);
+    ~AsyncInput();
+
+    AsyncInput(const AsyncInput&) = delete;
+    AsyncInput& operator=(const AsyncInput&) = delete;
+
+    // Set as the pb of the format context before avformat_open_input; owned by this object, which has to outlive it.
+    AVIOContext* Context() const { return m_context; }
+
+    // Bytes read ahead and not consumed yet, for the queue stats; the whole file when it is mapped.
+    size_t Buffered() const;
+    size_t Capacity() const;
+
+private:
+    explicit AsyncInput(Metrics* metrics);
+    bool AllocateContext();
+
+    int Read(uint8_t* buf, int size);
+    int64_t SeekTo(int64_t offset, int whence);
+    void ReadAhead();
+
+    FILE* m_file = nullptr;
+    std::unique_ptr<MappedInput> m_mapping;
+    int64_t m_fileSize = 0;
+    Metrics* const m_metrics;
+    AVIOContext* m_context = nullptr;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_dataReady;
+    std::condition_variable m_spaceReady;
+    std::vector<uint8_t> m_ring;
+    size_t m_head = 0;     // of the next byte the demuxer gets
+    size_t m_size = 0;     // bytes read ahead from m_position on
+    int64_t m_position = 0; // file offset of the byte at m_head
+    uint64_t m_generation = 0; // bumped by a seek, the read in flight is dropped
+    bool m_eof = false;
+    bool m_error = false;
+    bool m_stop = false;
+    std::thread m_thread;
+};
+
+// Output of a muxer through a custom AVIOContext whose writes are copied into a ring buffer and written to the file
+// by a thread of its own, so that a slow disk or network share doesn't stall the encoding. A seek, e.g. to patch an
+// MP4 header, waits for the buffer to drain. The bytes written and the time the muxer waited for room are recorded
+// into metrics (Counter::BytesWritten, Stage::WriteStall).
+class AsyncOutput
+{
+public:
+    // Null if path names a URL or a pipe, which are left to FFmpeg's own I/O, or can't be created.
+    static std::unique_ptr<AsyncOutput> Open(const char* path, size_t bufferSize, Metrics* metrics);
+    ~AsyncOutput();
+
+    AsyncOutput(const AsyncOutput&) = delete;
+    AsyncOutput& operator=(const AsyncOutput&) = delete;
+
+    // Set as the pb of the format context before avformat_write_header; owned by this object.
+    AVIOContext* Context() const { return m_context; }
+
+    // Flushes the context, writes out the buffer and closes the file; false if anything failed to be written.
+    bool Close();
+
+    size_t Buffered() const;
+    size_t Capacity() const { return m_ring.size(); }
+
+private:
+    AsyncOutput(FILE* file, size_t bufferSize, Metrics* metrics);
+
+    int Write(const uint8_t* buf, int size);
+    int64_t SeekTo(int64_t offset, int whence);
+    void WriteBehind();
+
+    FILE* m_file;
+    Metrics* const m_metrics;
+    AVIOContext* m_context = nullptr;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_dataReady;
+    std::condition_variable m_spaceReady;
+    std::vector<uint8_t> m_ring;
+    size_t m_head = 0; // of the next byte to write to the file
+    size_t m_size = 0; // bytes waiting, counted until written so that a drained buffer means an idle writer
+    bool m_error = false;
+    bool m_stop = false;
+    std::thread m_thread;
+};
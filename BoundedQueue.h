@@ -0,0 +1,106 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+// Blocking FIFO with a fixed capacity, used to connect pipeline stages.
+// push() blocks while the queue is full, pop() blocks while it is empty.
+// close() lets consumers drain the remaining items; abort() wakes everybody up
+// and makes both ends fail immediately.
+// The time spent blocked on either end is accumulated, so that the owner of a stage can tell
+// its working time from its waiting time; the clock is only read when a call actually blocks.
+template<typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : m_capacity(capacity ? capacity : 1) {}
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        Wait(lock, m_notFull, m_pushWait, [this] { return m_aborted || m_closed || m_items.size() < m_capacity; });
+        if (m_aborted || m_closed)
+            return false;
+        m_items.push_back(std::move(item));
+        m_notEmpty.notify_one();
+        return true;
+    }
+
+    bool pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        Wait(lock, m_notEmpty, m_popWait, [this] { return m_aborted || m_closed || !m_items.empty(); });
+        if (m_aborted || m_items.empty())
+            return false;
+        item = std::move(m_items.front());
+        m_items.pop_front();
+        m_notFull.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_notEmpty.notify_all();
+        m_notFull.notify_all();
+    }
+
+    void abort()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_aborted = true;
+        m_items.clear();
+        m_notEmpty.notify_all();
+        m_notFull.notify_all();
+    }
+
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_items.size();
+    }
+
+    size_t capacity() const { return m_capacity; }
+
+    // Total time push() and pop() were blocked so far.
+    std::chrono::nanoseconds pushWaitTime() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_pushWait;
+    }
+
+    std::chrono::nanoseconds popWaitTime() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_popWait;
+    }
+
+private:
+    template<typename Predicate>
+    static void Wait(std::unique_lock<std::mutex>& lock, std::condition_variable& condition,
+        std::chrono::nanoseconds& waited, Predicate ready)
+    {
+        if (ready())
+            return;
+        const auto start = std::chrono::steady_clock::now();
+        condition.wait(lock, ready);
+        waited += std::chrono::steady_clock::now() - start;
+    }
+
+    const size_t m_capacity;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_notEmpty;
+    std::condition_variable m_notFull;
+    std::deque<T> m_items;
+    bool m_closed = false;
+    bool m_aborted = false;
+    std::chrono::nanoseconds m_pushWait{ 0 };
+    std::chrono::nanoseconds m_popWait{ 0 };
+};
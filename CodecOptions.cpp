@@ -0,0 +1,54 @@
+#include "CodecOptions.h"
+
+extern "C"
+{
+#include <libavutil/dict.h>
+#include <libavutil/opt.h>
+}
+
+#include <cstdio>
+#include <string>
+
+AVDictionary* MakeDictionary(const CodecOptionList& options)
+{
+    AVDictionary* dictionary = nullptr;
+    for (const auto& option : options)
+        av_dict_set(&dictionary, option.first.c_str(), option.second.c_str(), 0);
+    return dictionary;
+}
+
+bool SetDefaultOption(AVDictionary** dictionary, const AVClass* const* objectClass, const char* key, const char* value)
+{
+    if (av_dict_get(*dictionary, key, nullptr, 0) != nullptr)
+        return true;
+    if (*objectClass == nullptr)
+        return false;
+
+    // the class stands in for an object
+    void* object = const_cast<const AVClass**>(objectClass);
+    const AVOption* option = av_opt_find(object, key, nullptr, 0, AV_OPT_SEARCH_FAKE_OBJ);
+    if (option == nullptr)
+        return false;
+    if (option->unit != nullptr) {
+        const std::string values(value);
+        size_t begin = 0;
+        while (begin < values.size()) {
+            size_t end = values.find('+', begin);
+            if (end == std::string::npos)
+                end = values.size();
+            const std::string name = values.substr(begin, end - begin);
+            if (!name.empty() && av_opt_find(object, name.c_str(), option->unit, 0, AV_OPT_SEARCH_FAKE_OBJ) == nullptr)
+                return false;
+            begin = end + 1;
+        }
+    }
+    av_dict_set(dictionary, key, value, 0);
+    return true;
+}
+
+void ReportUnusedOptions(const AVDictionary* dictionary, const char* user)
+{
+    const AVDictionaryEntry* entry = nullptr;
+    while ((entry = av_dict_get(dictionary, "", entry, AV_DICT_IGNORE_SUFFIX)) != nullptr)
+        fprintf(stderr, "Option %s=%s not recognized by %s\n", entry->key, entry->value, user);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "TransformVideo.h"
+
+struct AVClass;
+struct AVDictionary;
+
+// Dictionary with the options, to be passed to avcodec_open2 or avformat_write_header and freed with av_dict_free.
+AVDictionary* MakeDictionary(const CodecOptionList& options);
+
+// Sets key to value unless the dictionary has it already, if objects of the given class (e.g. the private class of
+// an encoder or a muxer) have such an option and, for an option with named values, know every one of value's
+// ('+' separated). Returns whether the dictionary has the option afterwards.
+bool SetDefaultOption(AVDictionary** dictionary, const AVClass* const* objectClass, const char* key, const char* value);
+
+// Reports the entries that are left in the dictionary after it was passed to user, which didn't recognize them.
+void ReportUnusedOptions(const AVDictionary* dictionary, const char* user);
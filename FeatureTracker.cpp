@@ -0,0 +1,264 @@
+#include "FeatureTracker.h"
+
+#include "Metrics.h"
+
+#include <algorithm>
+
+namespace {
+
+// calcOpticalFlowPyrLK defaults, the pyramids have to be built with the same parameters
+const cv::Size LK_WINDOW(21, 21);
+const int LK_MAX_LEVEL = 3;
+
+// smoothing of the inlier shares of the tiles, per frame
+const double TILE_INLIER_SMOOTHING = 0.3;
+
+int CellOf(const cv::Point2f& p, int cell_w, int cell_h, int cols, int rows)
+{
+    const int col = std::min(std::max(int(p.x) / cell_w, 0), cols - 1);
+    const int row = std::min(std::max(int(p.y) / cell_h, 0), rows - 1);
+    return row * cols + col;
+}
+
+}
+
+FeatureTracker::FeatureTracker(const FeatureTrackerOptions& options)
+    : m_options(options)
+{
+}
+
+void FeatureTracker::Reset()
+{
+    m_prevPyramid.clear();
+    m_curPyramid.clear();
+    m_pyramidSource = nullptr;
+    m_points.clear();
+}
+
+void FeatureTracker::Restart()
+{
+    m_pyramidSource = nullptr;
+    m_points.clear();
+}
+
+void FeatureTracker::Track(const cv::Mat& prev_grey, const cv::Mat& grey,
+    std::vector<cv::Point2f>& prev_points, std::vector<cv::Point2f>& cur_points)
+{
+    prev_points.clear();
+    cur_points.clear();
+    m_tiles.clear();
+
+    if (m_options.tiled)
+    {
+        // every tile is tracked on the same pyramids, built once
+        {
+            ScopedTimer timer(m_options.metrics, Stage::Track);
+            if (m_curPyramid.empty() || m_pyramidSource != prev_grey.data)
+            {
+                m_points.clear();
+                buildOpticalFlowPyramid(prev_grey, m_curPyramid, LK_WINDOW, LK_MAX_LEVEL);
+            }
+            std::swap(m_prevPyramid, m_curPyramid);
+            buildOpticalFlowPyramid(grey, m_curPyramid, LK_WINDOW, LK_MAX_LEVEL);
+            m_pyramidSource = grey.data;
+        }
+        if (!m_options.persistent)
+            m_points.clear();
+        TrackTiles(prev_grey, !m_options.persistent || int(m_points.size()) < m_options.minTracked);
+        if (m_points.empty())
+            return;
+    }
+    else if (!m_options.persistent)
+    {
+        {
+            ScopedTimer timer(m_options.metrics, Stage::Detect);
+            goodFeaturesToTrack(prev_grey, m_points, m_options.maxCorners, m_options.qualityLevel, m_options.minDistance);
+        }
+        if (m_points.empty())
+            return;
+        ScopedTimer timer(m_options.metrics, Stage::Track);
+        calcOpticalFlowPyrLK(prev_grey, grey, m_points, m_tracked, m_status, m_err);
+    }
+    else
+    {
+        // the pyramid built for the last grey frame describes prev_grey, unless the sequence was broken
+        if (m_curPyramid.empty() || m_pyramidSource != prev_grey.data)
+        {
+            ScopedTimer timer(m_options.metrics, Stage::Track);
+            m_points.clear();
+            buildOpticalFlowPyramid(prev_grey, m_curPyramid, LK_WINDOW, LK_MAX_LEVEL);
+        }
+        std::swap(m_prevPyramid, m_curPyramid);
+
+        if (int(m_points.size()) < m_options.minTracked)
+        {
+            ScopedTimer timer(m_options.metrics, Stage::Detect);
+            DetectCorners(prev_grey);
+        }
+
+        ScopedTimer timer(m_options.metrics, Stage::Track);
+        buildOpticalFlowPyramid(grey, m_curPyramid, LK_WINDOW, LK_MAX_LEVEL);
+        m_pyramidSource = grey.data;
+
+        if (m_points.empty())
+            return;
+        calcOpticalFlowPyrLK(m_prevPyramid, m_curPyramid, m_points, m_tracked, m_status, m_err, LK_WINDOW, LK_MAX_LEVEL);
+    }
+
+    // weed out bad matches
+    const int cols = std::max(1, m_options.gridCols);
+    const int rows = std::max(1, m_options.gridRows);
+    const int cell_w = (grey.cols + cols - 1) / cols;
+    const int cell_h = (grey.rows + rows - 1) / rows;
+    for (size_t i = 0; i < m_status.size(); i++) {
+        const auto& p = m_tracked[i];
+        if (m_status[i] != 0 && p.x >= 0 && p.y >= 0 && p.x <= grey.cols - 1 && p.y <= grey.rows - 1) {
+            prev_points.push_back(m_points[i]);
+            cur_points.push_back(p);
+            if (m_options.tiled)
+                m_tiles.push_back(CellOf(p, cell_w, cell_h, cols, rows));
+        }
+    }
+
+    // the survivors are the features of the next pair
+    if (m_options.persistent)
+        m_points.assign(cur_points.begin(), cur_points.end());
+}
+
+void FeatureTracker::DetectCorners(const cv::Mat& prev_grey)
+{
+    const int cells = m_options.gridCols * m_options.gridRows;
+    if (m_points.empty() || cells <= 1)
+    {
+        goodFeaturesToTrack(prev_grey, m_points, m_options.maxCorners, m_options.qualityLevel, m_options.minDistance);
+        return;
+    }
+
+    const int wanted = m_options.maxCorners - int(m_points.size());
+    if (wanted <= 0)
+        return;
+
+    const int cell_w = (prev_grey.cols + m_options.gridCols - 1) / m_options.gridCols;
+    const int cell_h = (prev_grey.rows + m_options.gridRows - 1) / m_options.gridRows;
+
+    m_cellCounts.assign(cells, 0);
+    for (const auto& p : m_points) {
+        const int col = std::min(int(p.x) / cell_w, m_options.gridCols - 1);
+        const int row = std::min(int(p.y) / cell_h, m_options.gridRows - 1);
+        ++m_cellCounts[row * m_options.gridCols + col];
+    }
+
+    // a cell has lost its points when less than half of its share is left
+    const int share = std::max(2, m_options.maxCorners / cells);
+
+    m_mask.create(prev_grey.size(), CV_8UC1);
+    m_mask.setTo(cv::Scalar::all(0));
+    bool refill = false;
+    for (int row = 0; row < m_options.gridRows; ++row) {
+        for (int col = 0; col < m_options.gridCols; ++col) {
+            if (m_cellCounts[row * m_options.gridCols + col] >= share / 2)
+                continue;
+            const int x = col * cell_w;
+            const int y = row * cell_h;
+            if (x >= prev_grey.cols || y >= prev_grey.rows)
+                continue;
+            m_mask(cv::Rect(x, y, std::min(cell_w, prev_grey.cols - x), std::min(cell_h, prev_grey.rows - y))).setTo(cv::Scalar::all(255));
+            refill = true;
+        }
+    }
+    if (!refill)
+        return;
+
+    goodFeaturesToTrack(prev_grey, m_corners, wanted, m_options.qualityLevel, m_options.minDistance, m_mask);
+    m_points.insert(m_points.end(), m_corners.begin(), m_corners.end());
+}
+
+void FeatureTracker::TrackTiles(const cv::Mat& prev_grey, bool detect)
+{
+    const int cols = std::max(1, m_options.gridCols);
+    const int rows = std::max(1, m_options.gridRows);
+    const int cells = cols * rows;
+    const int cell_w = (prev_grey.cols + cols - 1) / cols;
+    const int cell_h = (prev_grey.rows + rows - 1) / rows;
+    const int share = std::max(2, (m_options.maxCorners + cells - 1) / cells);
+
+    m_tileWork.resize(cells);
+    for (auto& tile : m_tileWork)
+        tile.points.clear();
+    for (const auto& p : m_points)
+        m_tileWork[CellOf(p, cell_w, cell_h, cols, rows)].points.push_back(p);
+
+    // detection and tracking of the tiles are timed together, as tracking
+    ScopedTimer timer(m_options.metrics, Stage::Track);
+    cv::parallel_for_(cv::Range(0, cells), [&](const cv::Range& range) {
+        for (int i = range.start; i < range.end; ++i) {
+            auto& tile = m_tileWork[i];
+            const cv::Rect cell = cv::Rect((i % cols) * cell_w, (i / cols) * cell_h, cell_w, cell_h)
+                & cv::Rect(0, 0, prev_grey.cols, prev_grey.rows);
+
+            // a tile that has lost its points, as in DetectCorners()
+            if (detect && !cell.empty() && int(tile.points.size()) < share / 2) {
+                goodFeaturesToTrack(prev_grey(cell), tile.corners, share - int(tile.points.size()),
+                    m_options.qualityLevel, m_options.minDistance);
+                for (const auto& corner : tile.corners)
+                    tile.points.push_back(corner + cv::Point2f(float(cell.x), float(cell.y)));
+            }
+
+            tile.tracked.clear();
+            tile.status.clear();
+            if (!tile.points.empty())
+                calcOpticalFlowPyrLK(m_prevPyramid, m_curPyramid, tile.points, tile.tracked, tile.status, tile.err,
+                    LK_WINDOW, LK_MAX_LEVEL);
+        }
+    });
+
+    m_points.clear();
+    m_tracked.clear();
+    m_status.clear();
+    for (const auto& tile : m_tileWork) {
+        m_points.insert(m_points.end(), tile.points.begin(), tile.points.end());
+        m_tracked.insert(m_tracked.end(), tile.tracked.begin(), tile.tracked.end());
+        m_status.insert(m_status.end(), tile.status.begin(), tile.status.end());
+    }
+}
+
+TileInlierMap::TileInlierMap(const FeatureTrackerOptions& options)
+    : m_minRatio(options.minTileInlierRatio)
+    , m_ratios(std::max(1, options.gridCols) * std::max(1, options.gridRows), 1.)
+{
+}
+
+void TileInlierMap::Usable(std::vector<bool>& usable) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    usable.resize(m_ratios.size());
+    for (size_t tile = 0; tile < m_ratios.size(); ++tile)
+        usable[tile] = m_ratios[tile] >= m_minRatio;
+}
+
+void TileInlierMap::Update(const std::vector<int>& tiles, const std::vector<uchar>& inliers)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_counts.assign(m_ratios.size(), 0);
+    m_inlierCounts.assign(m_ratios.size(), 0);
+    for (size_t i = 0; i < tiles.size() && i < inliers.size(); ++i) {
+        if (tiles[i] < 0 || tiles[i] >= int(m_counts.size()))
+            continue;
+        ++m_counts[tiles[i]];
+        m_inlierCounts[tiles[i]] += inliers[i] ? 1 : 0;
+    }
+
+    // a tile without points this time keeps its share
+    for (size_t tile = 0; tile < m_ratios.size(); ++tile) {
+        if (m_counts[tile] == 0)
+            continue;
+        const double ratio = double(m_inlierCounts[tile]) / m_counts[tile];
+        m_ratios[tile] += TILE_INLIER_SMOOTHING * (ratio - m_ratios[tile]);
+    }
+}
+
+int TileInlierMap::Dropped() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return int(std::count_if(m_ratios.begin(), m_ratios.end(), [this](double ratio) { return ratio < m_minRatio; }));
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <mutex>
+#include <vector>
+
+class Metrics;
+
+struct FeatureTrackerOptions
+{
+    int maxCorners = 200;
+    double qualityLevel = 0.01;
+    double minDistance = 30;
+
+    // Keep the points tracked into the current frame as the features of the next pair,
+    // instead of detecting corners from scratch on every frame.
+    bool persistent = true;
+    // New corners are detected only when fewer points than this survive...
+    int minTracked = 100;
+    // ...and only in the cells of this grid that have lost their points.
+    int gridCols = 4;
+    int gridRows = 4;
+
+    // Detect and track every cell of the grid on its own, in parallel, with at most its share of maxCorners,
+    // so that the points cover the frame instead of clustering where the texture is strongest.
+    bool tiled = false;
+    // With tiles, the cells where fewer of the points than this were inliers of the motion, smoothed over the
+    // frames, are left out of the fit, see TileInlierMap; 0 keeps them all. The map follows the frames in order,
+    // so the pairwise estimation, whose pairs finish in any order, keeps them all too.
+    double minTileInlierRatio = 0.3;
+
+    // If set, corner detection and tracking are timed into it.
+    Metrics* metrics = nullptr;
+};
+
+// Finds corresponding points between consecutive grey frames with pyramidal Lucas-Kanade.
+class FeatureTracker
+{
+public:
+    explicit FeatureTracker(const FeatureTrackerOptions& options = {});
+
+    // Tracks features of prev_grey into grey; prev_points/cur_points receive the matched pairs.
+    void Track(const cv::Mat& prev_grey, const cv::Mat& grey,
+        std::vector<cv::Point2f>& prev_points, std::vector<cv::Point2f>& cur_points);
+
+    void Reset();
+    // Forgets the last frame, keeping the buffers: the next Track() starts over, as after Reset(), e.g. for a pair
+    // that doesn't follow the last one.
+    void Restart();
+
+    // With tiles, the cell of the grid each pair of the last Track() call is in, by its current point.
+    const std::vector<int>& PointTiles() const { return m_tiles; }
+
+private:
+    void DetectCorners(const cv::Mat& prev_grey);
+    // Detects (if detect) and tracks the cells in parallel on the pyramids, into m_points, m_tracked and m_status.
+    void TrackTiles(const cv::Mat& prev_grey, bool detect);
+
+    FeatureTrackerOptions m_options;
+
+    // pyramid of the frame passed as grey on the last call, reused when that frame becomes prev_grey
+    std::vector<cv::Mat> m_prevPyramid;
+    std::vector<cv::Mat> m_curPyramid;
+    const uchar* m_pyramidSource = nullptr;
+
+    std::vector<cv::Point2f> m_points; // features of the frame the pyramid was built for
+    std::vector<cv::Point2f> m_corners;
+    std::vector<cv::Point2f> m_tracked;
+    std::vector<uchar> m_status;
+    std::vector<float> m_err;
+    std::vector<int> m_cellCounts;
+    cv::Mat m_mask;
+
+    struct Tile
+    {
+        std::vector<cv::Point2f> points;
+        std::vector<cv::Point2f> corners;
+        std::vector<cv::Point2f> tracked;
+        std::vector<uchar> status;
+        std::vector<float> err;
+    };
+    std::vector<Tile> m_tileWork;
+    std::vector<int> m_tiles;
+};
+
+// Share of the points of every cell of the tracking grid that were inliers of the rigid motion, smoothed over the
+// frames. A cell whose share drops is dominated by something moving on its own, e.g. a passer-by or waves, and
+// is left out of the fit until the share recovers; the inliers are still counted against the motion found with
+// the other cells. Thread safe, for pairs estimated in parallel.
+class TileInlierMap
+{
+public:
+    explicit TileInlierMap(const FeatureTrackerOptions& options = {});
+
+    // Whether the points of every cell take part in the fit, into usable, which keeps its capacity.
+    void Usable(std::vector<bool>& usable) const;
+    // tiles and inliers per pair, as from FeatureTracker::PointTiles() and RigidInliers().
+    void Update(const std::vector<int>& tiles, const std::vector<uchar>& inliers);
+
+    // Cells left out of the fit at the moment.
+    int Dropped() const;
+
+private:
+    double m_minRatio;
+    mutable std::mutex m_mutex;
+    std::vector<double> m_ratios; // per cell, 1 until it has points
+    std::vector<int> m_counts, m_inlierCounts; // of Update(), kept from frame to frame
+};
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <vector>
+
+// Set of cv::Mat buffers that are handed out again once nobody else references them, so that
+// the frame loop doesn't allocate in the steady state. Acquire() has to be called from a single
+// thread; the headers it returns may be released on any thread.
+class MatPool
+{
+public:
+    cv::Mat Acquire(int rows, int cols, int type)
+    {
+        ++m_acquisitions;
+        for (const auto& buffer : m_buffers)
+        {
+            // the other holders release the buffer with CV_XADD, reading it the same way orders their last use
+            // of the data before its reuse
+            if (CV_XADD(&buffer.u->refcount, 0) == 1 && buffer.rows == rows && buffer.cols == cols && buffer.type() == type)
+                return buffer;
+        }
+        m_buffers.emplace_back(rows, cols, type);
+        ++m_allocations;
+        return m_buffers.back();
+    }
+
+    size_t acquisitions() const { return m_acquisitions; }
+    size_t allocations() const { return m_allocations; }
+
+private:
+    std::vector<cv::Mat> m_buffers;
+    size_t m_acquisitions = 0;
+    size_t m_allocations = 0;
+};
@@ -0,0 +1,267 @@
+#include "Metrics.h"
+
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <memory>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace {
+
+const char* const STAGE_NAMES[] = {
+    "read_frame", "decode", "convert", "stabilize", "convert_back", "encode", "mux",
+    "analysis_grey", "detect", "track", "estimate_rigid", "warp", "end_to_end",
+    "read_stall", "write_stall",
+};
+static_assert(sizeof(STAGE_NAMES) / sizeof(STAGE_NAMES[0]) == int(Stage::Count), "a stage has no name");
+
+const char* const COUNTER_NAMES[] = {
+    "frames_decoded", "frames_encoded", "frames_stabilized", "estimation_failures", "tracked_points",
+    "motion_cache_hits", "estimations_skipped", "tiles_dropped", "bytes_read", "bytes_written",
+};
+static_assert(sizeof(COUNTER_NAMES) / sizeof(COUNTER_NAMES[0]) == int(Counter::Count), "a counter has no name");
+
+const double QUANTILES[] = { 0.5, 0.95, 0.99 };
+
+// set by the SIGUSR1 handler, picked up by the reporters
+std::atomic<bool> g_reportRequested{ false };
+
+extern "C" void RequestReport(int)
+{
+    g_reportRequested = true;
+}
+
+int HighestBit(uint64_t value)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return int(index);
+#else
+    return 63 - __builtin_clzll(value);
+#endif
+}
+
+int BucketIndex(uint64_t ns, int subBucketBits)
+{
+    const uint64_t subBuckets = uint64_t(1) << subBucketBits;
+    if (ns < subBuckets)
+        return int(ns);
+    const int exponent = HighestBit(ns);
+    const int sub = int((ns >> (exponent - subBucketBits)) & (subBuckets - 1));
+    return ((exponent - subBucketBits + 1) << subBucketBits) + sub;
+}
+
+// [lower, upper) of a bucket
+void BucketBounds(int index, int subBucketBits, double& lower, double& upper)
+{
+    const int subBuckets = 1 << subBucketBits;
+    if (index < subBuckets) {
+        lower = index;
+        upper = index + 1;
+        return;
+    }
+    const int shift = (index >> subBucketBits) - 1;
+    lower = double(subBuckets + (index & (subBuckets - 1))) * double(uint64_t(1) << shift);
+    upper = lower + double(uint64_t(1) << shift);
+}
+
+// Replaces path with text through a temporary file.
+bool WriteFileAtomically(const std::string& path, const std::string& text)
+{
+    const std::string temporary = path + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (file == nullptr) {
+        fprintf(stderr, "Could not open metrics file '%s'\n", temporary.c_str());
+        return false;
+    }
+    bool ok = fwrite(text.data(), 1, text.size(), file) == text.size();
+    ok = (fclose(file) == 0) && ok;
+#ifdef _WIN32
+    // rename() doesn't replace an existing file there
+    if (ok)
+        remove(path.c_str());
+#endif
+    ok = ok && rename(temporary.c_str(), path.c_str()) == 0;
+    if (!ok)
+        fprintf(stderr, "Error writing metrics file '%s'\n", path.c_str());
+    return ok;
+}
+
+std::string Format(const char* format, double value)
+{
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), format, value);
+    return buffer;
+}
+
+}
+
+const char* StageName(Stage stage)
+{
+    return STAGE_NAMES[int(stage)];
+}
+
+const char* CounterName(Counter counter)
+{
+    return COUNTER_NAMES[int(counter)];
+}
+
+void LatencyHistogram::Record(int64_t ns)
+{
+    ns = std::max<int64_t>(ns, 0);
+    m_buckets[BucketIndex(uint64_t(ns), SUB_BUCKET_BITS)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(ns, std::memory_order_relaxed);
+    int64_t max = m_max.load(std::memory_order_relaxed);
+    while (ns > max && !m_max.compare_exchange_weak(max, ns, std::memory_order_relaxed))
+        ;
+}
+
+double LatencyHistogram::QuantileNs(double q) const
+{
+    const int64_t count = Count();
+    if (count == 0)
+        return 0;
+    // rank of the sample, 1-based
+    const int64_t rank = std::max<int64_t>(1, int64_t(q * count + 0.5));
+    int64_t seen = 0;
+    for (int i = 0; i < BUCKETS; ++i) {
+        seen += m_buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            double lower, upper;
+            BucketBounds(i, SUB_BUCKET_BITS, lower, upper);
+            return std::min((lower + upper) / 2, double(MaxNs()));
+        }
+    }
+    return double(MaxNs());
+}
+
+Metrics::Metrics()
+    : m_start(std::chrono::steady_clock::now())
+{
+}
+
+double Metrics::TimerOverheadNs() const
+{
+    std::call_once(m_overheadOnce, [this] {
+        const int iterations = 100000;
+        std::unique_ptr<Metrics> scratch(new Metrics);
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i)
+            ScopedTimer timer(scratch.get(), Stage::Decode);
+        const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        m_timerOverheadNs = elapsed.count() / iterations;
+    });
+    return m_timerOverheadNs;
+}
+
+std::string Metrics::Json() const
+{
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+    int64_t timers = 0;
+    for (const auto& histogram : m_histograms)
+        timers += histogram.Count();
+    const double overhead = timers * TimerOverheadNs() * 1e-9;
+
+    std::string json = "{\n  \"elapsed_seconds\": " + Format("%.6f", elapsed) + ",\n  \"stages\": {\n";
+    for (int i = 0; i < int(Stage::Count); ++i) {
+        const auto& histogram = m_histograms[i];
+        json += std::string("    \"") + STAGE_NAMES[i] + "\": { \"count\": " + std::to_string(histogram.Count())
+            + ", \"sum_ms\": " + Format("%.3f", histogram.SumNs() * 1e-6);
+        for (const double q : QUANTILES)
+            json += ", \"p" + std::to_string(int(q * 100)) + "_ms\": " + Format("%.4f", histogram.QuantileNs(q) * 1e-6);
+        json += ", \"max_ms\": " + Format("%.4f", histogram.MaxNs() * 1e-6) + " }";
+        json += (i + 1 < int(Stage::Count)) ? ",\n" : "\n";
+    }
+    json += "  },\n  \"counters\": {\n";
+    for (int i = 0; i < int(Counter::Count); ++i) {
+        json += std::string("    \"") + COUNTER_NAMES[i] + "\": " + std::to_string(m_counters[i].load());
+        json += (i + 1 < int(Counter::Count)) ? ",\n" : "\n";
+    }
+    json += "  },\n  \"instrumentation\": { \"timers\": " + std::to_string(timers)
+        + ", \"timer_overhead_ns\": " + Format("%.1f", TimerOverheadNs())
+        + ", \"overhead_seconds\": " + Format("%.6f", overhead)
+        + ", \"overhead_fraction\": " + Format("%.6f", elapsed > 0 ? overhead / elapsed : 0) + " }\n}\n";
+    return json;
+}
+
+std::string Metrics::Prometheus() const
+{
+    std::string text =
+        "# HELP videostab_stage_latency_seconds Time of one call of a pipeline or stabilizer stage.\n"
+        "# TYPE videostab_stage_latency_seconds summary\n";
+    int64_t timers = 0;
+    for (int i = 0; i < int(Stage::Count); ++i) {
+        const auto& histogram = m_histograms[i];
+        const std::string stage = std::string("stage=\"") + STAGE_NAMES[i] + "\"";
+        for (const double q : QUANTILES) {
+            text += "videostab_stage_latency_seconds{" + stage + ",quantile=\"" + Format("%g", q) + "\"} "
+                + Format("%.9f", histogram.QuantileNs(q) * 1e-9) + "\n";
+        }
+        text += "videostab_stage_latency_seconds_sum{" + stage + "} " + Format("%.9f", histogram.SumNs() * 1e-9) + "\n";
+        text += "videostab_stage_latency_seconds_count{" + stage + "} " + std::to_string(histogram.Count()) + "\n";
+        timers += histogram.Count();
+    }
+    for (int i = 0; i < int(Counter::Count); ++i) {
+        const std::string name = std::string("videostab_") + COUNTER_NAMES[i] + "_total";
+        text += "# TYPE " + name + " counter\n" + name + " " + std::to_string(m_counters[i].load()) + "\n";
+    }
+    text += "# HELP videostab_instrumentation_overhead_seconds Estimated time spent in the timers themselves.\n"
+        "# TYPE videostab_instrumentation_overhead_seconds gauge\n"
+        "videostab_instrumentation_overhead_seconds " + Format("%.9f", timers * TimerOverheadNs() * 1e-9) + "\n";
+    return text;
+}
+
+bool Metrics::WriteJson(const std::string& path) const
+{
+    return WriteFileAtomically(path, Json());
+}
+
+bool Metrics::WritePrometheus(const std::string& path) const
+{
+    return WriteFileAtomically(path, Prometheus());
+}
+
+MetricsReporter::MetricsReporter(const Metrics& metrics, std::string prometheusPath, int intervalMs)
+    : m_metrics(metrics), m_path(std::move(prometheusPath)), m_intervalMs(intervalMs)
+{
+#ifdef SIGUSR1
+    signal(SIGUSR1, RequestReport);
+#endif
+    m_thread = std::thread(&MetricsReporter::Run, this);
+}
+
+MetricsReporter::~MetricsReporter()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_one();
+    m_thread.join();
+    m_metrics.WritePrometheus(m_path);
+}
+
+void MetricsReporter::Run()
+{
+    // the signal flag is polled, a handler can't notify a condition variable
+    const auto poll = std::chrono::milliseconds(100);
+    auto next = std::chrono::steady_clock::now() + std::chrono::milliseconds(m_intervalMs);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_wake.wait_for(lock, poll, [this] { return m_stop; })) {
+        const auto now = std::chrono::steady_clock::now();
+        const bool due = m_intervalMs > 0 && now >= next;
+        if (!g_reportRequested.exchange(false) && !due)
+            continue;
+        if (due)
+            next = now + std::chrono::milliseconds(m_intervalMs);
+        lock.unlock();
+        m_metrics.WritePrometheus(m_path);
+        lock.lock();
+    }
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Timed steps of the pipeline (TransformVideo) and of the stabilizer.
+enum class Stage
+{
+    ReadFrame,     // av_read_frame
+    Decode,        // avcodec_send_packet + avcodec_receive_frame
+    Convert,       // sws_scale to BGR24 and to the grey proxy
+    Stabilize,     // the frame callback, e.g. Stabilizer::operator()
+    ConvertBack,   // sws_scale back to the encoder format
+    Encode,        // avcodec_send_frame + avcodec_receive_packet
+    Mux,           // writing a packet to the output
+    AnalysisGrey,  // grey conversion and downscaling of the analysis proxy
+    Detect,        // goodFeaturesToTrack
+    Track,         // pyramids + calcOpticalFlowPyrLK
+    EstimateRigid, // EstimateRigidRansac
+    Warp,          // RigidWarp of the frame or of every plane
+    EndToEnd,      // from reading a video packet to writing the encoded frame with the same pts
+    ReadStall,     // the demuxer waiting for the read-ahead of AsyncInput
+    WriteStall,    // the muxer waiting for room in the write-behind buffer of AsyncOutput
+    Count
+};
+
+enum class Counter
+{
+    FramesDecoded,
+    FramesEncoded,
+    FramesStabilized,   // frames passed to the stabilizer
+    EstimationFailures, // no transformation found, the last one was reused
+    TrackedPoints,      // point pairs that survived tracking, summed over the frames
+    MotionCacheHits,    // frames whose motion was read from the motion cache instead of being estimated
+    EstimationsSkipped, // frames whose motion was extrapolated by the temporal decimation
+    TilesDropped,       // tiles left out of the fit by the tile inlier map, summed over the frames
+    BytesRead,          // by AsyncInput from the input file
+    BytesWritten,       // by AsyncOutput to the output file
+    Count
+};
+
+const char* StageName(Stage stage);
+const char* CounterName(Counter counter);
+
+// Latency histogram that can be recorded into from any thread without locking. The buckets are
+// logarithmic with 16 linear steps per power of two, so a quantile is off by at most 1/32.
+class LatencyHistogram
+{
+public:
+    void Record(int64_t ns);
+
+    int64_t Count() const { return m_count.load(std::memory_order_relaxed); }
+    int64_t SumNs() const { return m_sum.load(std::memory_order_relaxed); }
+    int64_t MaxNs() const { return m_max.load(std::memory_order_relaxed); }
+    // q in [0, 1]; the middle of the bucket the quantile falls into
+    double QuantileNs(double q) const;
+
+private:
+    static const int SUB_BUCKET_BITS = 4;
+    static const int BUCKETS = (64 - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS;
+
+    std::atomic<int64_t> m_buckets[BUCKETS]{};
+    std::atomic<int64_t> m_count{ 0 };
+    std::atomic<int64_t> m_sum{ 0 };
+    std::atomic<int64_t> m_max{ 0 };
+};
+
+// Per-stage latency histograms and counters of a run, shared by the pipeline and the stabilizer,
+// which take it as an optional pointer: without one nothing is timed.
+class Metrics
+{
+public:
+    Metrics();
+
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+    void Record(Stage stage, std::chrono::nanoseconds duration) { m_histograms[int(stage)].Record(duration.count()); }
+    void Add(Counter counter, int64_t value = 1) { m_counters[int(counter)].fetch_add(value, std::memory_order_relaxed); }
+
+    const LatencyHistogram& Histogram(Stage stage) const { return m_histograms[int(stage)]; }
+    int64_t Value(Counter counter) const { return m_counters[int(counter)].load(std::memory_order_relaxed); }
+
+    // Cost of one ScopedTimer (two clock reads and a histogram update) in ns, measured on first use.
+    double TimerOverheadNs() const;
+
+    // The files are replaced atomically, so a scraper never reads half of one.
+    bool WriteJson(const std::string& path) const;
+    bool WritePrometheus(const std::string& path) const;
+
+private:
+    std::string Json() const;
+    std::string Prometheus() const;
+
+    LatencyHistogram m_histograms[int(Stage::Count)];
+    std::atomic<int64_t> m_counters[int(Counter::Count)]{};
+    const std::chrono::steady_clock::time_point m_start;
+
+    mutable std::once_flag m_overheadOnce;
+    mutable double m_timerOverheadNs = 0;
+};
+
+// Records the lifetime of the scope into the stage's histogram; does nothing if metrics is null.
+class ScopedTimer
+{
+public:
+    ScopedTimer(Metrics* metrics, Stage stage) : m_metrics(metrics), m_stage(stage)
+    {
+        if (m_metrics)
+            m_start = std::chrono::steady_clock::now();
+    }
+    ~ScopedTimer()
+    {
+        if (m_metrics)
+            m_metrics->Record(m_stage, std::chrono::steady_clock::now() - m_start);
+    }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    Metrics* m_metrics;
+    Stage m_stage;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+// Writes the Prometheus text file every intervalMs (0 for never) and whenever the process gets SIGUSR1,
+// from a background thread; the destructor writes it a last time.
+class MetricsReporter
+{
+public:
+    MetricsReporter(const Metrics& metrics, std::string prometheusPath, int intervalMs);
+    ~MetricsReporter();
+
+    MetricsReporter(const MetricsReporter&) = delete;
+    MetricsReporter& operator=(const MetricsReporter&) = delete;
+
+private:
+    void Run();
+
+    const Metrics& m_metrics;
+    const std::string m_path;
+    const int m_intervalMs;
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    bool m_stop = false;
+    std::thread m_thread;
+};
@@ -0,0 +1,287 @@
+#include "MotionCache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A file opened for reading and writing and mapped as a whole; resizing it maps it again.
+class MappedFile
+{
+public:
+    ~MappedFile()
+    {
+        Unmap();
+#ifdef _WIN32
+        if (m_handle != INVALID_HANDLE_VALUE)
+            CloseHandle(m_handle);
+#else
+        if (m_fd >= 0)
+            close(m_fd);
+#endif
+    }
+
+    // Created if missing.
+    bool Open(const std::string& path)
+    {
+#ifdef _WIN32
+        m_handle = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL, nullptr);
+        LARGE_INTEGER size;
+        if (m_handle == INVALID_HANDLE_VALUE || !GetFileSizeEx(m_handle, &size))
+            return false;
+        m_size = uint64_t(size.QuadPart);
+#else
+        m_fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        struct stat status;
+        if (m_fd < 0 || fstat(m_fd, &status) != 0)
+            return false;
+        m_size = uint64_t(status.st_size);
+#endif
+        return Map();
+    }
+
+    uint8_t* Data() const { return m_data; }
+    uint64_t Size() const { return m_size; }
+
+    // The content up to the smaller size is kept, the rest is zero.
+    bool Resize(uint64_t size)
+    {
+        // a mapped file can't be resized on Windows
+        Unmap();
+#ifdef _WIN32
+        LARGE_INTEGER end;
+        end.QuadPart = LONGLONG(size);
+        if (!SetFilePointerEx(m_handle, end, nullptr, FILE_BEGIN) || !SetEndOfFile(m_handle))
+            return false;
+#else
+        if (ftruncate(m_fd, off_t(size)) != 0)
+            return false;
+#endif
+        m_size = size;
+        return Map();
+    }
+
+private:
+    bool Map()
+    {
+        if (m_size == 0)
+            return true;
+#ifdef _WIN32
+        m_mapping = CreateFileMappingA(m_handle, nullptr, PAGE_READWRITE, DWORD(m_size >> 32), DWORD(m_size), nullptr);
+        if (m_mapping == nullptr)
+            return false;
+        m_data = static_cast<uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_WRITE, 0, 0, 0));
+#else
+        void* data = mmap(nullptr, size_t(m_size), PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+        m_data = (data == MAP_FAILED) ? nullptr : static_cast<uint8_t*>(data);
+#endif
+        return m_data != nullptr;
+    }
+
+    void Unmap()
+    {
+#ifdef _WIN32
+        if (m_data)
+            UnmapViewOfFile(m_data);
+        if (m_mapping)
+            CloseHandle(m_mapping);
+        m_mapping = nullptr;
+#else
+        if (m_data)
+            munmap(m_data, size_t(m_size));
+#endif
+        m_data = nullptr;
+    }
+
+#ifdef _WIN32
+    HANDLE m_handle = INVALID_HANDLE_VALUE;
+    HANDLE m_mapping = nullptr;
+#else
+    int m_fd = -1;
+#endif
+    uint8_t* m_data = nullptr;
+    uint64_t m_size = 0;
+};
+
+namespace {
+
+const char MOTION_CACHE_MAGIC[4] = { 'V', 'S', 'M', 'C' };
+const uint32_t MOTION_CACHE_VERSION = 2;
+
+// the file grows by at least this many records at a time
+const uint64_t MOTION_CACHE_GROWTH = 4096;
+
+const uint64_t FINGERPRINT_CHUNK = 1 << 20;
+
+// with 64-bit offsets, videos are often larger than 2 GiB
+int Seek(FILE* file, long long offset, int origin)
+{
+#ifdef _WIN32
+    return _fseeki64(file, offset, origin);
+#else
+    return fseeko(file, off_t(offset), origin);
+#endif
+}
+
+long long Tell(FILE* file)
+{
+#ifdef _WIN32
+    return _ftelli64(file);
+#else
+    return (long long)ftello(file);
+#endif
+}
+
+}
+
+void Fingerprint::Add(const void* data, size_t size)
+{
+    const auto* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        m_hash ^= bytes[i];
+        m_hash *= 0x100000001b3ull;
+    }
+}
+
+bool FingerprintFile(const char* path, Fingerprint& fingerprint)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr)
+        return false;
+
+    bool ok = Seek(file, 0, SEEK_END) == 0;
+    const long long size = ok ? Tell(file) : -1;
+    ok = ok && size >= 0;
+    if (ok) {
+        fingerprint.Add(size);
+        std::vector<unsigned char> chunk(size_t(std::min<long long>(size, FINGERPRINT_CHUNK)));
+        const long long offsets[] = { 0, (size - (long long)chunk.size()) / 2, size - (long long)chunk.size() };
+        for (long long offset : offsets) {
+            ok = ok && Seek(file, offset, SEEK_SET) == 0
+                && fread(chunk.data(), 1, chunk.size(), file) == chunk.size();
+            if (ok)
+                fingerprint.Add(chunk.data(), chunk.size());
+        }
+    }
+    fclose(file);
+    return ok;
+}
+
+MotionCache::MotionCache() = default;
+
+MotionCache::~MotionCache() = default;
+
+bool MotionCache::Open(const std::string& path, uint64_t key)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_file.reset(new MappedFile);
+    m_reused = 0;
+    if (!m_file->Open(path)) {
+        fprintf(stderr, "Could not open motion cache '%s'\n", path.c_str());
+        m_file.reset();
+        return false;
+    }
+
+    MotionCacheHeader header{};
+    if (m_file->Size() >= sizeof(header))
+        memcpy(&header, m_file->Data(), sizeof(header));
+    const bool isCache = m_file->Size() >= sizeof(header)
+        && memcmp(header.magic, MOTION_CACHE_MAGIC, sizeof(header.magic)) == 0;
+    if (m_file->Size() > 0 && !isCache) {
+        // not ours to overwrite
+        fprintf(stderr, "'%s' is not a motion cache\n", path.c_str());
+        m_file.reset();
+        return false;
+    }
+
+    const bool valid = isCache && header.version == MOTION_CACHE_VERSION
+        && header.record_size == sizeof(MotionCacheRecord) && header.key == key;
+    if (!valid) {
+        // a new cache, or one made from another input or with other settings: start over
+        header = MotionCacheHeader{};
+        memcpy(header.magic, MOTION_CACHE_MAGIC, sizeof(header.magic));
+        header.version = MOTION_CACHE_VERSION;
+        header.record_size = sizeof(MotionCacheRecord);
+        header.key = key;
+        if (!m_file->Resize(0) || !m_file->Resize(sizeof(header) + MOTION_CACHE_GROWTH * sizeof(MotionCacheRecord))) {
+            fprintf(stderr, "Error writing motion cache '%s'\n", path.c_str());
+            m_file.reset();
+            return false;
+        }
+        memcpy(m_file->Data(), &header, sizeof(header));
+    }
+
+    const auto* records = reinterpret_cast<const MotionCacheRecord*>(m_file->Data() + sizeof(header));
+    const uint64_t capacity = (m_file->Size() - sizeof(header)) / sizeof(MotionCacheRecord);
+    for (uint64_t i = 0; i < capacity; ++i)
+        m_reused += records[i].present ? 1 : 0;
+    return true;
+}
+
+bool MotionCache::IsOpen() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_file != nullptr;
+}
+
+const MotionCacheRecord* MotionCache::Record(int64_t index) const
+{
+    if (m_file == nullptr || index < 0)
+        return nullptr;
+    const uint64_t offset = sizeof(MotionCacheHeader) + uint64_t(index) * sizeof(MotionCacheRecord);
+    if (offset + sizeof(MotionCacheRecord) > m_file->Size())
+        return nullptr;
+    const auto* record = reinterpret_cast<const MotionCacheRecord*>(m_file->Data() + offset);
+    return record->present ? record : nullptr;
+}
+
+bool MotionCache::Lookup(int64_t index, MotionSample& sample) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto* record = Record(index);
+    if (record == nullptr)
+        return false;
+    sample = record->sample;
+    return true;
+}
+
+bool MotionCache::Contains(int64_t index) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return Record(index) != nullptr;
+}
+
+void MotionCache::Store(int64_t index, const MotionSample& sample)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_file == nullptr || index < 0)
+        return;
+
+    const uint64_t capacity = (m_file->Size() - sizeof(MotionCacheHeader)) / sizeof(MotionCacheRecord);
+    if (uint64_t(index) >= capacity) {
+        // doubles, so that the file is mapped again a logarithmic number of times
+        const uint64_t records = std::max(uint64_t(index) + 1, capacity + std::max(capacity, MOTION_CACHE_GROWTH));
+        if (!m_file->Resize(sizeof(MotionCacheHeader) + records * sizeof(MotionCacheRecord))) {
+            fprintf(stderr, "Error writing motion cache, it is no longer updated\n");
+            m_file.reset();
+            return;
+        }
+    }
+
+    auto* record = reinterpret_cast<MotionCacheRecord*>(
+        m_file->Data() + sizeof(MotionCacheHeader) + uint64_t(index) * sizeof(MotionCacheRecord));
+    record->sample = sample;
+    record->present = 1;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "MotionFile.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// 64-bit FNV-1a hash, for the key of a motion cache.
+class Fingerprint
+{
+public:
+    void Add(const void* data, size_t size);
+    template<typename T>
+    void Add(const T& value) { Add(&value, sizeof(value)); }
+
+    uint64_t Value() const { return m_hash; }
+
+private:
+    uint64_t m_hash = 0xcbf29ce484222325ull;
+};
+
+// Adds the size of the file and its first, middle and last MiB, so that a changed file gets another key without
+// reading it all; false if it can't be read (a pipe).
+bool FingerprintFile(const char* path, Fingerprint& fingerprint);
+
+// A motion cache file is a MotionCacheHeader followed by a record per frame, at the offset of its index;
+// the records of the frames not estimated yet are zero.
+struct MotionCacheHeader
+{
+    char magic[4]; // "VSMC"
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+    uint64_t key;
+};
+
+struct MotionCacheRecord
+{
+    MotionSample sample;
+    uint32_t present;
+    uint32_t reserved;
+};
+
+class MappedFile;
+
+// Frame to frame motion kept on disk across runs, so that re-rendering a video with other smoothing, crop or
+// encoder settings skips the feature tracking and the estimation. The file is memory mapped: a lookup is a read
+// from the mapping and a store writes the record in place, growing the file as frames come. The key identifies
+// the input and the analysis settings; a cache with the same key is reused as is, so a run that was interrupted
+// resumes where it stopped, and a cache with another key is started over. Thread safe, for one process at a time.
+class MotionCache
+{
+public:
+    MotionCache();
+    ~MotionCache();
+
+    MotionCache(const MotionCache&) = delete;
+    MotionCache& operator=(const MotionCache&) = delete;
+
+    // Opens or creates the cache; fails if path exists and is neither empty nor a motion cache.
+    bool Open(const std::string& path, uint64_t key);
+    bool IsOpen() const;
+
+    // Motion of frame index, from the frame before, in sample if it is cached.
+    bool Lookup(int64_t index, MotionSample& sample) const;
+    bool Contains(int64_t index) const;
+    void Store(int64_t index, const MotionSample& sample);
+
+    // Frames cached when the file was opened.
+    size_t Reused() const { return m_reused; }
+
+private:
+    const MotionCacheRecord* Record(int64_t index) const;
+
+    std::unique_ptr<MappedFile> m_file;
+    mutable std::mutex m_mutex;
+    size_t m_reused = 0;
+};
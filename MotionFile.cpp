@@ -0,0 +1,56 @@
+#include "MotionFile.h"
+
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+const char MOTION_MAGIC[4] = { 'V', 'S', 'M', 'O' };
+const uint32_t MOTION_VERSION = 2;
+
+}
+
+bool SaveMotion(const char* path, const std::vector<MotionSample>& samples)
+{
+    FILE* file = fopen(path, "wb");
+    if (file == nullptr) {
+        fprintf(stderr, "Could not open motion file '%s'\n", path);
+        return false;
+    }
+
+    MotionFileHeader header{};
+    memcpy(header.magic, MOTION_MAGIC, sizeof(header.magic));
+    header.version = MOTION_VERSION;
+    header.record_size = sizeof(MotionSample);
+    header.count = uint32_t(samples.size());
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(samples.data(), sizeof(MotionSample), samples.size(), file) == samples.size();
+    ok = (fclose(file) == 0) && ok;
+    if (!ok)
+        fprintf(stderr, "Error writing motion file '%s'\n", path);
+    return ok;
+}
+
+bool LoadMotion(const char* path, std::vector<MotionSample>& samples)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr) {
+        fprintf(stderr, "Could not open motion file '%s'\n", path);
+        return false;
+    }
+
+    MotionFileHeader header{};
+    bool ok = fread(&header, sizeof(header), 1, file) == 1
+        && memcmp(header.magic, MOTION_MAGIC, sizeof(header.magic)) == 0
+        && header.version == MOTION_VERSION
+        && header.record_size == sizeof(MotionSample);
+    if (ok) {
+        samples.resize(header.count);
+        ok = fread(samples.data(), sizeof(MotionSample), samples.size(), file) == samples.size();
+    }
+    fclose(file);
+    if (!ok)
+        fprintf(stderr, "'%s' is not a valid motion file\n", path);
+    return ok;
+}
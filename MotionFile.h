@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Frame to frame motion found by the analysis pass, in full resolution pixels, radians and log scale.
+// Sample i describes the motion from frame i to frame i + 1.
+struct MotionSample
+{
+    double dx;
+    double dy;
+    double da;
+    double ds; // 0 unless the motion model is a similarity
+    int32_t tracked; // number of point pairs the motion was estimated from
+    int32_t estimated; // 0 if the estimation failed and the previous motion was reused
+};
+
+// The sidecar file is a MotionFileHeader followed by count MotionSample records.
+struct MotionFileHeader
+{
+    char magic[4]; // "VSMO"
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t count;
+};
+
+bool SaveMotion(const char* path, const std::vector<MotionSample>& samples);
+bool LoadMotion(const char* path, std::vector<MotionSample>& samples);
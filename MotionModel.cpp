@@ -0,0 +1,25 @@
+#include "MotionModel.h"
+
+#include <cstring>
+
+namespace {
+
+const char* const MODEL_NAMES[] = { "translation", "rigid", "similarity" };
+
+}
+
+const char* MotionModelName(MotionModel model)
+{
+    return MODEL_NAMES[int(model)];
+}
+
+bool ParseMotionModel(const char* name, MotionModel& model)
+{
+    for (int i = 0; i < int(sizeof(MODEL_NAMES) / sizeof(MODEL_NAMES[0])); ++i) {
+        if (strcmp(name, MODEL_NAMES[i]) == 0) {
+            model = MotionModel(i);
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "Trajectory.h"
+
+#include <opencv2/core.hpp>
+
+#include <cmath>
+
+// Motion the stabilizer estimates between frames, smooths and warps with. Fixed-mount cameras only need the
+// translation; handheld footage also rotates, and zooms or walks towards the scene, which a similarity follows.
+enum class MotionModel
+{
+    Translation, // dx, dy
+    Rigid,       // dx, dy, da
+    Similarity,  // dx, dy, da, ds
+};
+
+const char* MotionModelName(MotionModel model);
+// "translation", "rigid" or "similarity"; false for anything else.
+bool ParseMotionModel(const char* name, MotionModel& model);
+
+// Policies of the models, for the code specialised on them at compile time: the RANSAC of EstimateMotionRansac()
+// and the stabilizer's decomposition and warp matrices. Decompose() turns a transform estimated on the analysis
+// proxy, scale times the frame size, into the motion in full resolution pixels; Linear() gives the linear part
+// of the warp by t as the matrix [c -s; s c].
+struct TranslationModel
+{
+    static const MotionModel model = MotionModel::Translation;
+    static const int SampleSize = 1;
+    static const bool Rotates = false;
+    static const bool Scales = false;
+
+    static TransformParam Decompose(const cv::Matx23d& T, double scale)
+    {
+        return TransformParam(T(0, 2) / scale, T(1, 2) / scale, 0);
+    }
+    static void Linear(const TransformParam&, double& c, double& s)
+    {
+        c = 1;
+        s = 0;
+    }
+};
+
+struct RigidModel
+{
+    static const MotionModel model = MotionModel::Rigid;
+    static const int SampleSize = 2;
+    static const bool Rotates = true;
+    static const bool Scales = false;
+
+    static TransformParam Decompose(const cv::Matx23d& T, double scale)
+    {
+        return TransformParam(T(0, 2) / scale, T(1, 2) / scale, atan2(T(1, 0), T(0, 0)));
+    }
+    static void Linear(const TransformParam& t, double& c, double& s)
+    {
+        c = cos(t.da);
+        s = sin(t.da);
+    }
+};
+
+struct SimilarityModel
+{
+    static const MotionModel model = MotionModel::Similarity;
+    static const int SampleSize = 2;
+    static const bool Rotates = true;
+    static const bool Scales = true;
+
+    // the scale is smoothed as its log, so that zooming in and back out again adds up to nothing
+    static TransformParam Decompose(const cv::Matx23d& T, double scale)
+    {
+        return TransformParam(T(0, 2) / scale, T(1, 2) / scale, atan2(T(1, 0), T(0, 0)),
+            log(std::hypot(T(0, 0), T(1, 0))));
+    }
+    static void Linear(const TransformParam& t, double& c, double& s)
+    {
+        const double zoom = exp(t.ds);
+        c = zoom * cos(t.da);
+        s = zoom * sin(t.da);
+    }
+};
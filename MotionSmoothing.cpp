@@ -0,0 +1,83 @@
+#include "MotionSmoothing.h"
+
+#include <algorithm>
+
+
+const double pstd = 4e-3;//can be changed
+const double cstd = 0.25;//can be changed
+
+const Trajectory Q(pstd, pstd, pstd, pstd);// process noise covariance
+const Trajectory R(cstd, cstd, cstd, cstd);// measurement noise covariance 
+
+
+Trajectory KalmanSmoother::Update(const Trajectory& z)
+{
+    if (!initialized) {
+        initialized = true;
+        // intial guesses
+        X = Trajectory(0, 0, 0, 0); //Initial estimate,  set 0
+        P = Trajectory(1, 1, 1, 1); //set error variance,set 1
+    }
+    else
+    {
+        //time update（prediction）
+        X_ = X; //X_(k) = X(k-1);
+        P_ = P + Q; //P_(k) = P(k-1)+Q;
+        // measurement update（correction）
+        K = P_ / (P_ + R); //gain;K(k) = P_(k)/( P_(k)+R );
+        X = X_ + K * (z - X_); //z-X_ is residual,X(k) = X_(k)+K(k)*(z(k)-X_(k)); 
+        P = (Trajectory(1, 1, 1, 1) - K)*P_; //P(k) = (1-K(k))*P_(k);
+    }
+    return X;
+}
+
+std::vector<TransformParam> SmoothMotion(const std::vector<TransformParam>& motion, Smoothing method, int radius)
+{
+    const int n = int(motion.size());
+
+    // Accumulate the transformations to get the image trajectory
+    std::vector<Trajectory> trajectory(n);
+    double a = 0;
+    double x = 0;
+    double y = 0;
+    double s = 0;
+    for (int i = 0; i < n; ++i) {
+        x += motion[i].dx;
+        y += motion[i].dy;
+        a += motion[i].da;
+        s += motion[i].ds;
+        trajectory[i] = Trajectory(x, y, a, s);
+    }
+
+    std::vector<Trajectory> smoothed(n);
+    if (method == Smoothing::Kalman) {
+        KalmanSmoother kalman;
+        for (int i = 0; i < n; ++i)
+            smoothed[i] = kalman.Update(trajectory[i]);
+    }
+    else {
+        // centred averaging window, shrunk at both ends; running sums keep it linear
+        Trajectory sum(0, 0, 0, 0);
+        int begin = 0;
+        int end = 0; // [begin, end) is summed
+        for (int i = 0; i < n; ++i) {
+            const int from = std::max(0, i - radius);
+            const int to = std::min(n, i + radius + 1);
+            for (; end < to; ++end)
+                sum = sum + trajectory[end];
+            for (; begin < from; ++begin)
+                sum = sum - trajectory[begin];
+            const double count = end - begin;
+            smoothed[i] = sum / Trajectory(count, count, count, count);
+        }
+    }
+
+    // Generate new set of previous to current transform, such that the trajectory ends up being the same as the smoothed trajectory
+    std::vector<TransformParam> result(n);
+    for (int i = 0; i < n; ++i) {
+        const Trajectory diff = smoothed[i] - trajectory[i];
+        result[i] = TransformParam(motion[i].dx + diff.x, motion[i].dy + diff.y, motion[i].da + diff.a,
+            motion[i].ds + diff.s);
+    }
+    return result;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "Trajectory.h"
+
+#include <vector>
+
+const int SMOOTHING_RADIUS = 15; // In frames. The larger the more stable the video, but less reactive to sudden panning
+
+// The simple one-pass Kalman filter the stabilizer smooths the trajectory with.
+class KalmanSmoother
+{
+public:
+    // Takes the accumulated trajectory z of the next frame, returns its smoothed estimate.
+    Trajectory Update(const Trajectory& z);
+
+private:
+    Trajectory X;//posteriori state estimate
+    Trajectory	X_;//priori estimate
+    Trajectory P;// posteriori estimate error covariance
+    Trajectory P_;// priori estimate error covariance
+    Trajectory K;//gain
+
+    bool initialized = false;
+};
+
+enum class Smoothing
+{
+    Kalman,
+    Window, // centred averaging window of SMOOTHING_RADIUS frames on each side
+};
+
+// Offline smoothing of the frame to frame motion of a whole video: returns the new previous to current
+// transformations such that the trajectory ends up being the smoothed one.
+std::vector<TransformParam> SmoothMotion(const std::vector<TransformParam>& motion, Smoothing method,
+    int radius = SMOOTHING_RADIUS);
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <memory>
+
+// 8-bit planar image (grey or YUV) whose planes reference memory owned by somebody else,
+// typically the buffers of a decoded AVFrame. planes[0] is the luma plane, the chroma
+// planes are subsampled by (1 << chromaShiftX) horizontally and (1 << chromaShiftY) vertically.
+struct PlanarImage
+{
+    cv::Mat planes[3];
+    int numPlanes = 0;
+    int chromaShiftX = 0;
+    int chromaShiftY = 0;
+
+    // Keeps the memory referenced by the planes alive while the image is being held.
+    std::shared_ptr<void> owner;
+};
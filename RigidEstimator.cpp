@@ -0,0 +1,244 @@
+#include "RigidEstimator.h"
+
+#include <algorithm>
+#include <cmath>
+
+// SSE2 is part of every x86-64 CPU, so the scoring loop needs no runtime dispatch
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RANSAC_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// the first n pairs into the coordinate arrays of pairs, which keep their capacity
+void SetPairs(RansacScratch& pairs, const std::vector<cv::Point2f>& from, const std::vector<cv::Point2f>& to, int n)
+{
+    pairs.x0.resize(n);
+    pairs.y0.resize(n);
+    pairs.x1.resize(n);
+    pairs.y1.resize(n);
+    for (int i = 0; i < n; ++i) {
+        pairs.x0[i] = from[i].x;
+        pairs.y0[i] = from[i].y;
+        pairs.x1[i] = to[i].x;
+        pairs.y1[i] = to[i].y;
+    }
+}
+
+// Least squares transform of the n pairs listed in indices, in closed form: with the pairs centred on their means,
+// the rotation is the angle of (sum of p.q, sum of p x q) and the scale the length of that over the sum of |p|^2.
+// False if the points coincide.
+bool Fit(const RansacScratch& pairs, const int* indices, int n, bool similarity, cv::Matx23d& T)
+{
+    double mx0 = 0, my0 = 0, mx1 = 0, my1 = 0;
+    for (int k = 0; k < n; ++k) {
+        const int i = indices[k];
+        mx0 += pairs.x0[i];
+        my0 += pairs.y0[i];
+        mx1 += pairs.x1[i];
+        my1 += pairs.y1[i];
+    }
+    mx0 /= n;
+    my0 /= n;
+    mx1 /= n;
+    my1 /= n;
+
+    double dot = 0, cross = 0, spread = 0;
+    for (int k = 0; k < n; ++k) {
+        const int i = indices[k];
+        const double px = pairs.x0[i] - mx0;
+        const double py = pairs.y0[i] - my0;
+        const double qx = pairs.x1[i] - mx1;
+        const double qy = pairs.y1[i] - my1;
+        dot += px * qx + py * qy;
+        cross += px * qy - py * qx;
+        spread += px * px + py * py;
+    }
+    const double norm = std::sqrt(dot * dot + cross * cross);
+    if (spread < 1e-9 || norm < 1e-12)
+        return false;
+
+    const double scale = similarity ? norm / spread : 1;
+    const double a = scale * dot / norm;
+    const double b = scale * cross / norm;
+    T = cv::Matx23d(a, -b, mx1 - (a * mx0 - b * my0),
+                    b, a, my1 - (b * mx0 + a * my0));
+    return true;
+}
+
+// Least squares translation of the n pairs listed in indices: their mean displacement.
+bool FitTranslation(const RansacScratch& pairs, const int* indices, int n, cv::Matx23d& T)
+{
+    double dx = 0, dy = 0;
+    for (int k = 0; k < n; ++k) {
+        const int i = indices[k];
+        dx += pairs.x1[i] - pairs.x0[i];
+        dy += pairs.y1[i] - pairs.y0[i];
+    }
+    T = cv::Matx23d(1, 0, dx / n,
+                    0, 1, dy / n);
+    return n > 0;
+}
+
+template<class Model>
+bool FitModel(const RansacScratch& pairs, const int* indices, int n, cv::Matx23d& T)
+{
+    if (!Model::Rotates)
+        return FitTranslation(pairs, indices, n, T);
+    return Fit(pairs, indices, n, Model::Scales, T);
+}
+
+// Pairs T maps within sqrt(threshold2) pixels.
+int CountInliers(const RansacScratch& pairs, const cv::Matx23d& T, float threshold2)
+{
+    const int n = int(pairs.x0.size());
+    const float a = float(T(0, 0)), b = float(T(0, 1)), tx = float(T(0, 2));
+    const float c = float(T(1, 0)), d = float(T(1, 1)), ty = float(T(1, 2));
+
+    int i = 0;
+    int count = 0;
+#if RANSAC_SSE2
+    const __m128 va = _mm_set1_ps(a), vb = _mm_set1_ps(b), vtx = _mm_set1_ps(tx);
+    const __m128 vc = _mm_set1_ps(c), vd = _mm_set1_ps(d), vty = _mm_set1_ps(ty);
+    const __m128 vthreshold = _mm_set1_ps(threshold2);
+    // the comparison masks are -1 per inlier
+    __m128i counts = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4) {
+        const __m128 x0 = _mm_loadu_ps(&pairs.x0[i]);
+        const __m128 y0 = _mm_loadu_ps(&pairs.y0[i]);
+        const __m128 ex = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(va, x0), _mm_mul_ps(vb, y0)), vtx),
+            _mm_loadu_ps(&pairs.x1[i]));
+        const __m128 ey = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(vc, x0), _mm_mul_ps(vd, y0)), vty),
+            _mm_loadu_ps(&pairs.y1[i]));
+        const __m128 distance2 = _mm_add_ps(_mm_mul_ps(ex, ex), _mm_mul_ps(ey, ey));
+        counts = _mm_sub_epi32(counts, _mm_castps_si128(_mm_cmple_ps(distance2, vthreshold)));
+    }
+    alignas(16) int lanes[4];
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes), counts);
+    count = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+    for (; i < n; ++i) {
+        const float ex = a * pairs.x0[i] + b * pairs.y0[i] + tx - pairs.x1[i];
+        const float ey = c * pairs.x0[i] + d * pairs.y0[i] + ty - pairs.y1[i];
+        count += (ex * ex + ey * ey <= threshold2);
+    }
+    return count;
+}
+
+void CollectInliers(const RansacScratch& pairs, const cv::Matx23d& T, float threshold2, std::vector<int>& indices)
+{
+    indices.clear();
+    for (int i = 0; i < int(pairs.x0.size()); ++i) {
+        const double ex = T(0, 0) * pairs.x0[i] + T(0, 1) * pairs.y0[i] + T(0, 2) - pairs.x1[i];
+        const double ey = T(1, 0) * pairs.x0[i] + T(1, 1) * pairs.y0[i] + T(1, 2) - pairs.y1[i];
+        if (ex * ex + ey * ey <= threshold2)
+            indices.push_back(i);
+    }
+}
+
+} // namespace
+
+template<class Model>
+bool EstimateMotionRansac(const std::vector<cv::Point2f>& from, const std::vector<cv::Point2f>& to, cv::Matx23d& T,
+    const RigidEstimatorOptions& options, int* inliers, RansacScratch* scratch)
+{
+    const int n = int(std::min(from.size(), to.size()));
+    if (n < 2)
+        return false;
+
+    RansacScratch ownScratch;
+    RansacScratch& pairs = scratch ? *scratch : ownScratch;
+    SetPairs(pairs, from, to, n);
+    const float threshold2 = float(options.threshold * options.threshold);
+    // a sample whose points are closer than this hardly tells the rotation
+    const double minSpan2 = 4 * threshold2;
+
+    cv::RNG rng(options.seed);
+    int best = 0;
+    cv::Matx23d bestT;
+    int iterations = std::max(1, options.maxIterations);
+    for (int iteration = 0; iteration < iterations; ++iteration) {
+        int sample[2];
+        sample[0] = rng.uniform(0, n);
+        if (Model::SampleSize == 2) {
+            sample[1] = rng.uniform(0, n - 1);
+            if (sample[1] >= sample[0])
+                ++sample[1];
+            const double spanX = pairs.x0[sample[0]] - pairs.x0[sample[1]];
+            const double spanY = pairs.y0[sample[0]] - pairs.y0[sample[1]];
+            if (n > 2 && spanX * spanX + spanY * spanY < minSpan2)
+                continue;
+        }
+
+        cv::Matx23d model;
+        if (!FitModel<Model>(pairs, sample, Model::SampleSize, model))
+            continue;
+        const int count = CountInliers(pairs, model, threshold2);
+        if (count <= best)
+            continue;
+
+        best = count;
+        bestT = model;
+        if (best == n)
+            break;
+        // samples needed to draw a sample of inliers only with the confidence, at the inlier ratio of the best model
+        const double ratio = double(best) / n;
+        const double miss = 1 - std::pow(ratio, Model::SampleSize);
+        const double needed = std::log(1 - options.confidence) / std::log(miss);
+        if (needed < iterations)
+            iterations = std::max(iteration + 1, int(std::ceil(needed)));
+    }
+
+    const int minInliers = std::max(2, int(std::ceil(options.minInlierRatio * n)));
+    if (best < minInliers)
+        return false;
+
+    if (options.refine) {
+        std::vector<int>& indices = pairs.indices;
+        for (int pass = 0; pass < 2; ++pass) {
+            CollectInliers(pairs, bestT, threshold2, indices);
+            cv::Matx23d refined;
+            if (!FitModel<Model>(pairs, indices.data(), int(indices.size()), refined))
+                break;
+            const int count = CountInliers(pairs, refined, threshold2);
+            if (count < best)
+                break;
+            bestT = refined;
+            if (count == best)
+                break;
+            best = count;
+        }
+    }
+
+    T = bestT;
+    if (inliers)
+        *inliers = best;
+    return true;
+}
+
+template bool EstimateMotionRansac<TranslationModel>(const std::vector<cv::Point2f>&, const std::vector<cv::Point2f>&,
+    cv::Matx23d&, const RigidEstimatorOptions&, int*, RansacScratch*);
+template bool EstimateMotionRansac<RigidModel>(const std::vector<cv::Point2f>&, const std::vector<cv::Point2f>&,
+    cv::Matx23d&, const RigidEstimatorOptions&, int*, RansacScratch*);
+template bool EstimateMotionRansac<SimilarityModel>(const std::vector<cv::Point2f>&, const std::vector<cv::Point2f>&,
+    cv::Matx23d&, const RigidEstimatorOptions&, int*, RansacScratch*);
+
+bool EstimateRigidRansac(const std::vector<cv::Point2f>& from, const std::vector<cv::Point2f>& to, cv::Matx23d& T,
+    const RigidEstimatorOptions& options, int* inliers)
+{
+    return options.similarity ? EstimateMotionRansac<SimilarityModel>(from, to, T, options, inliers)
+        : EstimateMotionRansac<RigidModel>(from, to, T, options, inliers);
+}
+
+void RigidInliers(const std::vector<cv::Point2f>& from, const std::vector<cv::Point2f>& to, const cv::Matx23d& T,
+    double threshold, std::vector<uchar>& inliers)
+{
+    const size_t n = std::min(from.size(), to.size());
+    inliers.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        const double ex = T(0, 0) * from[i].x + T(0, 1) * from[i].y + T(0, 2) - to[i].x;
+        const double ey = T(1, 0) * from[i].x + T(1, 1) * from[i].y + T(1, 2) - to[i].y;
+        inliers[i] = (ex * ex + ey * ey <= threshold * threshold) ? 1 : 0;
+    }
+}
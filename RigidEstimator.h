@@ -0,0 +1,55 @@
+#pragma once
+
+#include "MotionModel.h"
+
+#include <opencv2/core.hpp>
+
+#include <cstdint>
+#include <vector>
+
+struct RigidEstimatorOptions
+{
+    // Also estimate a uniform scale, i.e. a similarity instead of a rotation + translation, in
+    // EstimateRigidRansac(); the stabilizer fits its StabilizerOptions::model instead.
+    bool similarity = false;
+    // A pair is an inlier if the transform maps its first point within this many pixels of its second.
+    double threshold = 2;
+    // RANSAC stops once it has drawn a sample of inliers only with this probability...
+    double confidence = 0.995;
+    // ...or after this many samples.
+    int maxIterations = 1000;
+    // Fewer inliers than this fraction of the pairs (and than 2) is a failure.
+    double minInlierRatio = 0.2;
+    // Fit the transform to all the inliers of the best sample by least squares, twice at most.
+    bool refine = true;
+    // The samples are drawn with this seed on every call, so the same points always give the same transform.
+    uint64_t seed = 0x5eed;
+};
+
+// Buffers of EstimateMotionRansac(): the pairs as coordinate arrays, four of them are scored at a time, and the
+// inliers the refinement fits. A caller that keeps one across calls stops allocating once it has seen the most
+// pairs; one is used by a single call at a time.
+struct RansacScratch
+{
+    std::vector<float> x0, y0, x1, y1;
+    std::vector<int> indices;
+};
+
+// Robust rigid (or similarity) transform T mapping from[i] to to[i]: RANSAC over samples of two pairs, each
+// solved in closed form by least squares, with as many iterations as the best inlier ratio so far needs for
+// the confidence. Returns false if there are fewer than two pairs or too few inliers; inliers receives their
+// count if given. Replaces estimateRigidTransform(from, to, false), which also fits a scale.
+bool EstimateRigidRansac(const std::vector<cv::Point2f>& from, const std::vector<cv::Point2f>& to, cv::Matx23d& T,
+    const RigidEstimatorOptions& options = {}, int* inliers = nullptr);
+
+// Same for the model of the policy Model (see MotionModel.h), whose RANSAC is specialised at compile time: the
+// translation samples single pairs and fits their mean displacement, which needs far fewer samples, and the rigid
+// and the similarity models pairs of pairs as above. Instantiated for TranslationModel, RigidModel and
+// SimilarityModel. The buffers come from scratch if given, else from the heap.
+template<class Model>
+bool EstimateMotionRansac(const std::vector<cv::Point2f>& from, const std::vector<cv::Point2f>& to, cv::Matx23d& T,
+    const RigidEstimatorOptions& options = {}, int* inliers = nullptr, RansacScratch* scratch = nullptr);
+
+// Marks the pairs T maps from[i] within threshold pixels of to[i].
+void RigidInliers(const std::vector<cv::Point2f>& from, const std::vector<cv::Point2f>& to, const cv::Matx23d& T,
+    double threshold, std::vector<uchar>& inliers);
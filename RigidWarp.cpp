@@ -0,0 +1,485 @@
+#include "RigidWarp.h"
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define WARP_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET_SSE41
+#define TARGET_AVX2
+#else
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace {
+
+// the fixed point layout of warpAffine
+const int INTER_BITS = 5;
+const int INTER_TAB = 1 << INTER_BITS;
+const int AB_BITS = 10;
+const int AB_SCALE = 1 << AB_BITS;
+const int ROUND_DELTA = AB_SCALE / INTER_TAB / 2;
+// the four bilinear weights add up to 1 << WEIGHT_BITS
+const int WEIGHT_BITS = 2 * INTER_BITS;
+const int WEIGHT_ROUND = 1 << (WEIGHT_BITS - 1);
+
+// coordinates are computed for this many pixels of a row at a time
+const int BLOCK = 256;
+
+struct WarpJob
+{
+    const uchar* src;
+    size_t srcStep;
+    int srcCols;
+    int srcRows;
+    int cn;
+
+    uchar* dst;
+    size_t dstStep;
+    int dstCols;
+
+    // dst to src mapping
+    double A11, A12, b1, A21, A22, b2;
+    // A11 * x and A21 * x in AB_BITS fixed point, per dst column
+    const int* adelta;
+    const int* bdelta;
+
+    // separable mode: the rotation is negligible, so the source column only depends on x
+    bool separable = false;
+    const int* xofs = nullptr; // source column, may be outside
+    const int* xfrac = nullptr; // its fraction in 1/INTER_TAB
+    bool unitColumns = false; // xofs[x] = xofs[0] + x with no fraction, rows are shifted copies
+};
+
+// Bilinear sample at X, Y in INTER_BITS fixed point, with black outside of src.
+inline void SamplePixel(const WarpJob& job, int X, int Y, uchar* out)
+{
+    const int ix = X >> INTER_BITS;
+    const int iy = Y >> INTER_BITS;
+    const int fx = X & (INTER_TAB - 1);
+    const int fy = Y & (INTER_TAB - 1);
+    const int cn = job.cn;
+
+    if (ix < -1 || iy < -1 || ix >= job.srcCols || iy >= job.srcRows) {
+        for (int c = 0; c < cn; ++c)
+            out[c] = 0;
+        return;
+    }
+
+    const int w00 = (INTER_TAB - fx) * (INTER_TAB - fy);
+    const int w01 = fx * (INTER_TAB - fy);
+    const int w10 = (INTER_TAB - fx) * fy;
+    const int w11 = fx * fy;
+
+    const uchar* p = job.src + iy * job.srcStep + ix * cn;
+    if (ix >= 0 && iy >= 0 && ix < job.srcCols - 1 && iy < job.srcRows - 1) {
+        for (int c = 0; c < cn; ++c)
+            out[c] = uchar((p[c] * w00 + p[c + cn] * w01 + p[c + job.srcStep] * w10
+                + p[c + job.srcStep + cn] * w11 + WEIGHT_ROUND) >> WEIGHT_BITS);
+        return;
+    }
+
+    // a tap outside of src counts as black
+    const bool left = ix >= 0, right = ix + 1 < job.srcCols;
+    const bool top = iy >= 0, bottom = iy + 1 < job.srcRows;
+    for (int c = 0; c < cn; ++c) {
+        int sum = WEIGHT_ROUND;
+        if (top && left) sum += p[c] * w00;
+        if (top && right) sum += p[c + cn] * w01;
+        if (bottom && left) sum += p[c + job.srcStep] * w10;
+        if (bottom && right) sum += p[c + job.srcStep + cn] * w11;
+        out[c] = uchar(sum >> WEIGHT_BITS);
+    }
+}
+
+void CoordinatesScalar(const WarpJob& job, int X0, int Y0, int x0, int n, int* X, int* Y)
+{
+    for (int i = 0; i < n; ++i) {
+        X[i] = (X0 + job.adelta[x0 + i]) >> (AB_BITS - INTER_BITS);
+        Y[i] = (Y0 + job.bdelta[x0 + i]) >> (AB_BITS - INTER_BITS);
+    }
+}
+
+void InterpolateScalar(const WarpJob& job, const int* X, const int* Y, int n, uchar* out)
+{
+    for (int i = 0; i < n; ++i)
+        SamplePixel(job, X[i], Y[i], out + i * job.cn);
+}
+
+#ifdef WARP_X86
+
+TARGET_SSE41 void CoordinatesSse41(const WarpJob& job, int X0, int Y0, int x0, int n, int* X, int* Y)
+{
+    const __m128i vX0 = _mm_set1_epi32(X0);
+    const __m128i vY0 = _mm_set1_epi32(Y0);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(job.adelta + x0 + i));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(job.bdelta + x0 + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(X + i), _mm_srai_epi32(_mm_add_epi32(vX0, a), AB_BITS - INTER_BITS));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(Y + i), _mm_srai_epi32(_mm_add_epi32(vY0, b), AB_BITS - INTER_BITS));
+    }
+    CoordinatesScalar(job, X0, Y0, x0 + i, n - i, X + i, Y + i);
+}
+
+// Weight pairs (w00, w01) and (w10, w11) as 16-bit halves of 32-bit lanes, for _mm_madd_epi16.
+TARGET_SSE41 inline void WeightPairsSse41(__m128i vx, __m128i vy, __m128i& top, __m128i& bottom)
+{
+    const __m128i mask = _mm_set1_epi32(INTER_TAB - 1);
+    const __m128i tab = _mm_set1_epi32(INTER_TAB);
+    const __m128i fx = _mm_and_si128(vx, mask);
+    const __m128i fy = _mm_and_si128(vy, mask);
+    const __m128i gx = _mm_sub_epi32(tab, fx);
+    const __m128i gy = _mm_sub_epi32(tab, fy);
+    top = _mm_or_si128(_mm_mullo_epi32(gx, gy), _mm_slli_epi32(_mm_mullo_epi32(fx, gy), 16));
+    bottom = _mm_or_si128(_mm_mullo_epi32(gx, fy), _mm_slli_epi32(_mm_mullo_epi32(fx, fy), 16));
+}
+
+TARGET_SSE41 void InterpolateSse41(const WarpJob& job, const int* X, const int* Y, int n, uchar* out)
+{
+    const __m128i round = _mm_set1_epi32(WEIGHT_ROUND);
+    const int step = int(job.srcStep);
+    int i = 0;
+
+    if (job.cn == 1) {
+        // four pixels at a time, the two taps of a row are the low bytes of a 32-bit lane
+        const __m128i pairs = _mm_setr_epi8(0, -1, 1, -1, 4, -1, 5, -1, 8, -1, 9, -1, 12, -1, 13, -1);
+        for (; i + 4 <= n; i += 4) {
+            const __m128i vx = _mm_loadu_si128(reinterpret_cast<const __m128i*>(X + i));
+            const __m128i vy = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Y + i));
+            alignas(16) int ix[4], iy[4];
+            _mm_store_si128(reinterpret_cast<__m128i*>(ix), _mm_srai_epi32(vx, INTER_BITS));
+            _mm_store_si128(reinterpret_cast<__m128i*>(iy), _mm_srai_epi32(vy, INTER_BITS));
+
+            bool inside = true;
+            for (int k = 0; k < 4; ++k)
+                inside = inside && ix[k] >= 0 && iy[k] >= 0 && ix[k] < job.srcCols - 1 && iy[k] < job.srcRows - 1;
+            if (!inside) {
+                InterpolateScalar(job, X + i, Y + i, 4, out + i);
+                continue;
+            }
+
+            alignas(16) uint32_t row0[4], row1[4];
+            for (int k = 0; k < 4; ++k) {
+                const uchar* p = job.src + iy[k] * job.srcStep + ix[k];
+                row0[k] = p[0] | (p[1] << 8);
+                row1[k] = p[step] | (p[step + 1] << 8);
+            }
+
+            __m128i top, bottom;
+            WeightPairsSse41(vx, vy, top, bottom);
+            const __m128i p0 = _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(row0)), pairs);
+            const __m128i p1 = _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(row1)), pairs);
+            __m128i sum = _mm_add_epi32(_mm_madd_epi16(p0, top), _mm_madd_epi16(p1, bottom));
+            sum = _mm_srai_epi32(_mm_add_epi32(sum, round), WEIGHT_BITS);
+            sum = _mm_packus_epi16(_mm_packus_epi32(sum, sum), sum);
+            const int packed = _mm_cvtsi128_si32(sum);
+            memcpy(out + i, &packed, 4);
+        }
+    }
+    else if (job.cn == 3) {
+        // one pixel at a time, the channels of the two taps of a row are interleaved into 16-bit pairs
+        const __m128i pairs = _mm_setr_epi8(0, -1, 3, -1, 1, -1, 4, -1, 2, -1, 5, -1, -1, -1, -1, -1);
+        for (; i < n; ++i) {
+            const int ix = X[i] >> INTER_BITS;
+            const int iy = Y[i] >> INTER_BITS;
+            // the 8-byte loads must not run past the row
+            if (ix < 0 || iy < 0 || ix >= job.srcCols - 2 || iy >= job.srcRows - 1) {
+                SamplePixel(job, X[i], Y[i], out + i * 3);
+                continue;
+            }
+
+            const uchar* p = job.src + iy * job.srcStep + ix * 3;
+            __m128i top, bottom;
+            WeightPairsSse41(_mm_set1_epi32(X[i]), _mm_set1_epi32(Y[i]), top, bottom);
+            const __m128i p0 = _mm_shuffle_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)), pairs);
+            const __m128i p1 = _mm_shuffle_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p + step)), pairs);
+            __m128i sum = _mm_add_epi32(_mm_madd_epi16(p0, top), _mm_madd_epi16(p1, bottom));
+            sum = _mm_srai_epi32(_mm_add_epi32(sum, round), WEIGHT_BITS);
+            sum = _mm_packus_epi16(_mm_packus_epi32(sum, sum), sum);
+            const int packed = _mm_cvtsi128_si32(sum);
+            memcpy(out + i * 3, &packed, 3);
+        }
+    }
+    InterpolateScalar(job, X + i, Y + i, n - i, out + i * job.cn);
+}
+
+TARGET_AVX2 void CoordinatesAvx2(const WarpJob& job, int X0, int Y0, int x0, int n, int* X, int* Y)
+{
+    const __m256i vX0 = _mm256_set1_epi32(X0);
+    const __m256i vY0 = _mm256_set1_epi32(Y0);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(job.adelta + x0 + i));
+        const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(job.bdelta + x0 + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(X + i), _mm256_srai_epi32(_mm256_add_epi32(vX0, a), AB_BITS - INTER_BITS));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(Y + i), _mm256_srai_epi32(_mm256_add_epi32(vY0, b), AB_BITS - INTER_BITS));
+    }
+    CoordinatesScalar(job, X0, Y0, x0 + i, n - i, X + i, Y + i);
+}
+
+TARGET_AVX2 void InterpolateAvx2(const WarpJob& job, const int* X, const int* Y, int n, uchar* out)
+{
+    // three channel pixels don't gather well, they take the per-pixel SSE path
+    if (job.cn != 1) {
+        InterpolateSse41(job, X, Y, n, out);
+        return;
+    }
+
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i mask = _mm256_set1_epi32(INTER_TAB - 1);
+    const __m256i tab = _mm256_set1_epi32(INTER_TAB);
+    const __m256i round = _mm256_set1_epi32(WEIGHT_ROUND);
+    const __m256i step = _mm256_set1_epi32(int(job.srcStep));
+    // the gathers read four bytes
+    const __m256i maxX = _mm256_set1_epi32(job.srcCols - 4);
+    const __m256i maxY = _mm256_set1_epi32(job.srcRows - 2);
+    const __m256i pairs = _mm256_setr_epi8(0, -1, 1, -1, 4, -1, 5, -1, 8, -1, 9, -1, 12, -1, 13, -1,
+        0, -1, 1, -1, 4, -1, 5, -1, 8, -1, 9, -1, 12, -1, 13, -1);
+    const int* row0 = reinterpret_cast<const int*>(job.src);
+    const int* row1 = reinterpret_cast<const int*>(job.src + job.srcStep);
+
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256i vx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(X + i));
+        const __m256i vy = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Y + i));
+        const __m256i ix = _mm256_srai_epi32(vx, INTER_BITS);
+        const __m256i iy = _mm256_srai_epi32(vy, INTER_BITS);
+
+        const __m256i outside = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpgt_epi32(zero, ix), _mm256_cmpgt_epi32(ix, maxX)),
+            _mm256_or_si256(_mm256_cmpgt_epi32(zero, iy), _mm256_cmpgt_epi32(iy, maxY)));
+        if (!_mm256_testz_si256(outside, outside)) {
+            InterpolateScalar(job, X + i, Y + i, 8, out + i);
+            continue;
+        }
+
+        const __m256i offset = _mm256_add_epi32(_mm256_mullo_epi32(iy, step), ix);
+        const __m256i p0 = _mm256_shuffle_epi8(_mm256_i32gather_epi32(row0, offset, 1), pairs);
+        const __m256i p1 = _mm256_shuffle_epi8(_mm256_i32gather_epi32(row1, offset, 1), pairs);
+
+        const __m256i fx = _mm256_and_si256(vx, mask);
+        const __m256i fy = _mm256_and_si256(vy, mask);
+        const __m256i gx = _mm256_sub_epi32(tab, fx);
+        const __m256i gy = _mm256_sub_epi32(tab, fy);
+        const __m256i top = _mm256_or_si256(_mm256_mullo_epi32(gx, gy), _mm256_slli_epi32(_mm256_mullo_epi32(fx, gy), 16));
+        const __m256i bottom = _mm256_or_si256(_mm256_mullo_epi32(gx, fy), _mm256_slli_epi32(_mm256_mullo_epi32(fx, fy), 16));
+
+        __m256i sum = _mm256_add_epi32(_mm256_madd_epi16(p0, top), _mm256_madd_epi16(p1, bottom));
+        sum = _mm256_srai_epi32(_mm256_add_epi32(sum, round), WEIGHT_BITS);
+        // per 128-bit lane the four results end up in the low four bytes
+        sum = _mm256_packus_epi16(_mm256_packus_epi32(sum, sum), sum);
+        const int lo = _mm_cvtsi128_si32(_mm256_castsi256_si128(sum));
+        const int hi = _mm_cvtsi128_si32(_mm256_extracti128_si256(sum, 1));
+        memcpy(out + i, &lo, 4);
+        memcpy(out + i + 4, &hi, 4);
+    }
+    InterpolateScalar(job, X + i, Y + i, n - i, out + i);
+}
+
+#endif // WARP_X86
+
+typedef void (*CoordinatesFn)(const WarpJob&, int, int, int, int, int*, int*);
+typedef void (*InterpolateFn)(const WarpJob&, const int*, const int*, int, uchar*);
+
+struct Kernels
+{
+    CoordinatesFn coordinates;
+    InterpolateFn interpolate;
+};
+
+Kernels GetKernels(WarpIsa isa)
+{
+#ifdef WARP_X86
+    if (isa == WarpIsa::Avx2)
+        return { CoordinatesAvx2, InterpolateAvx2 };
+    if (isa == WarpIsa::Sse41)
+        return { CoordinatesSse41, InterpolateSse41 };
+#endif
+    return { CoordinatesScalar, InterpolateScalar };
+}
+
+WarpIsa DetectIsa()
+{
+#if defined(WARP_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    const int maxLeaf = info[0];
+    __cpuid(info, 1);
+    const bool sse41 = (info[2] & (1 << 19)) != 0;
+    // AVX state has to be enabled by the OS as well
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx2 = false;
+    if (maxLeaf >= 7 && osxsave && (_xgetbv(0) & 6) == 6) {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & (1 << 5)) != 0;
+    }
+    if (avx2)
+        return WarpIsa::Avx2;
+    if (sse41)
+        return WarpIsa::Sse41;
+#elif defined(WARP_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return WarpIsa::Avx2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return WarpIsa::Sse41;
+#endif
+    return WarpIsa::Scalar;
+}
+
+const WarpIsa g_detectedIsa = DetectIsa();
+std::atomic<WarpIsa> g_isa{ g_detectedIsa };
+
+// Separable row: the source row and its fraction are the same across the row.
+void SeparableRow(const WarpJob& job, int Y, uchar* out)
+{
+    const int iy = Y >> INTER_BITS;
+    const int fy = Y & (INTER_TAB - 1);
+    const int cn = job.cn;
+
+    if (iy < -1 || iy >= job.srcRows) {
+        memset(out, 0, size_t(job.dstCols) * cn);
+        return;
+    }
+
+    const uchar* row0 = job.src + iy * job.srcStep;
+    const uchar* row1 = row0 + job.srcStep;
+    const bool inside = iy >= 0 && iy < job.srcRows - 1;
+
+    if (job.unitColumns && fy == 0 && iy >= 0) {
+        // a whole pixel shift of the source row
+        const int first = std::min(std::max(-job.xofs[0], 0), job.dstCols);
+        const int last = std::max(std::min(job.srcCols - job.xofs[0], job.dstCols), first);
+        memset(out, 0, size_t(first) * cn);
+        memcpy(out + first * cn, row0 + (job.xofs[0] + first) * cn, size_t(last - first) * cn);
+        memset(out + last * cn, 0, size_t(job.dstCols - last) * cn);
+        return;
+    }
+
+    for (int x = 0; x < job.dstCols; ++x) {
+        const int ix = job.xofs[x];
+        if (!inside || ix < 0 || ix >= job.srcCols - 1) {
+            SamplePixel(job, ix * INTER_TAB + job.xfrac[x], Y, out + x * cn);
+            continue;
+        }
+        const int fx = job.xfrac[x];
+        const uchar* p0 = row0 + ix * cn;
+        const uchar* p1 = row1 + ix * cn;
+        for (int c = 0; c < cn; ++c) {
+            const int top = p0[c] * (INTER_TAB - fx) + p0[c + cn] * fx;
+            const int bottom = p1[c] * (INTER_TAB - fx) + p1[c + cn] * fx;
+            out[x * cn + c] = uchar((top * (INTER_TAB - fy) + bottom * fy + WEIGHT_ROUND) >> WEIGHT_BITS);
+        }
+    }
+}
+
+void WarpRows(const WarpJob& job, const Kernels& kernels, int y0, int y1)
+{
+    int X[BLOCK], Y[BLOCK];
+    for (int y = y0; y < y1; ++y) {
+        uchar* out = job.dst + y * job.dstStep;
+        if (job.separable) {
+            const int Y0 = cvRound((job.A22 * y + job.b2) * AB_SCALE) + ROUND_DELTA;
+            SeparableRow(job, Y0 >> (AB_BITS - INTER_BITS), out);
+            continue;
+        }
+
+        const int X0 = cvRound((job.A12 * y + job.b1) * AB_SCALE) + ROUND_DELTA;
+        const int Y0 = cvRound((job.A22 * y + job.b2) * AB_SCALE) + ROUND_DELTA;
+        for (int x = 0; x < job.dstCols; x += BLOCK) {
+            const int n = std::min(BLOCK, job.dstCols - x);
+            kernels.coordinates(job, X0, Y0, x, n, X, Y);
+            kernels.interpolate(job, X, Y, n, out + x * job.cn);
+        }
+    }
+}
+
+} // namespace
+
+WarpIsa GetWarpIsa()
+{
+    return g_isa;
+}
+
+void SetWarpIsa(WarpIsa isa)
+{
+    g_isa = std::min(isa, g_detectedIsa);
+}
+
+const char* WarpIsaName(WarpIsa isa)
+{
+    switch (isa) {
+    case WarpIsa::Avx2: return "avx2";
+    case WarpIsa::Sse41: return "sse4.1";
+    default: return "scalar";
+    }
+}
+
+void RigidWarp(const cv::Mat& src, cv::Mat& dst, const cv::Matx23d& M, cv::Size size)
+{
+    CV_Assert(src.depth() == CV_8U && (src.channels() == 1 || src.channels() == 3) && src.data != dst.data);
+    dst.create(size, src.type());
+
+    WarpJob job;
+    job.src = src.data;
+    job.srcStep = src.step[0];
+    job.srcCols = src.cols;
+    job.srcRows = src.rows;
+    job.cn = src.channels();
+    job.dst = dst.data;
+    job.dstStep = dst.step[0];
+    job.dstCols = size.width;
+
+    // M maps src to dst, the inverse is computed the way warpAffine does
+    double D = M(0, 0) * M(1, 1) - M(0, 1) * M(1, 0);
+    D = D != 0 ? 1. / D : 0;
+    job.A11 = M(1, 1) * D;
+    job.A22 = M(0, 0) * D;
+    job.A12 = -M(0, 1) * D;
+    job.A21 = -M(1, 0) * D;
+    job.b1 = -job.A11 * M(0, 2) - job.A12 * M(1, 2);
+    job.b2 = -job.A21 * M(0, 2) - job.A22 * M(1, 2);
+
+    // the column tables of adelta, bdelta, xofs and xfrac; on the stack up to 4K wide, like warpAffine's
+    cv::AutoBuffer<int, 4 * 4096> columns(4 * size_t(size.width));
+    int* adelta = columns.data();
+    int* bdelta = adelta + size.width;
+    for (int x = 0; x < size.width; ++x) {
+        adelta[x] = cvRound(job.A11 * x * AB_SCALE);
+        bdelta[x] = cvRound(job.A21 * x * AB_SCALE);
+    }
+    job.adelta = adelta;
+    job.bdelta = bdelta;
+
+    // negligible: the cross terms move no coordinate by more than half a fixed point step over the image
+    job.separable = std::abs(job.A12) * size.height * INTER_TAB < 0.5
+        && std::abs(job.A21) * size.width * INTER_TAB < 0.5;
+    if (job.separable) {
+        int* xofs = bdelta + size.width;
+        int* xfrac = xofs + size.width;
+        const int X0 = cvRound(job.b1 * AB_SCALE) + ROUND_DELTA;
+        job.unitColumns = true;
+        for (int x = 0; x < size.width; ++x) {
+            const int X = (X0 + adelta[x]) >> (AB_BITS - INTER_BITS);
+            xofs[x] = X >> INTER_BITS;
+            xfrac[x] = X & (INTER_TAB - 1);
+            job.unitColumns = job.unitColumns && xfrac[x] == 0 && xofs[x] == xofs[0] + x;
+        }
+        job.xofs = xofs;
+        job.xfrac = xfrac;
+    }
+
+    const Kernels kernels = GetKernels(g_isa);
+    cv::parallel_for_(cv::Range(0, size.height), [&](const cv::Range& rows) {
+        WarpRows(job, kernels, rows.start, rows.end);
+    }, std::max(1., size.height / 64.));
+}
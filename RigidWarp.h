@@ -0,0 +1,25 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+
+// Instruction sets the warp kernels are built for; the best one the CPU supports is used.
+enum class WarpIsa
+{
+    Scalar,
+    Sse41,
+    Avx2,
+};
+
+// Same as warpAffine(src, dst, M, size) with bilinear interpolation and a black constant border, for the
+// 8-bit one and three channel images (grey, BGR24, planes of planar YUV) and the rotation + translation
+// matrices, with the crop scale folded in, that the stabilizer warps with. Coordinates and weights are
+// quantized to 1/32 pixel in fixed point as in warpAffine. If the rotation is negligible each row is
+// resampled separably, and rows that are whole pixel shifts of a source row are copied. Rows are
+// processed in parallel blocks.
+void RigidWarp(const cv::Mat& src, cv::Mat& dst, const cv::Matx23d& M, cv::Size size);
+
+// Instruction set RigidWarp() uses, by default the best one available.
+WarpIsa GetWarpIsa();
+// Limits RigidWarp() to isa, or to the best available one below it, e.g. to compare the kernels.
+void SetWarpIsa(WarpIsa isa);
+const char* WarpIsaName(WarpIsa isa);
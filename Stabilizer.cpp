@@ -1,5 +1,8 @@
 ﻿#include "Stabilizer.h"
 
+#include "MotionCache.h"
+#include "RigidWarp.h"
+
 
 /*
 Thanks Nghia Ho for his excellent code.
@@ -12,7 +15,6 @@ email:chenjia2013@foxmail.com
 
 // This video stablisation smooths the global trajectory using a sliding average window
 
-//const int SMOOTHING_RADIUS = 15; // In frames. The larger the more stable the video, but less reactive to sudden panning
 const int HORIZONTAL_BORDER_CROP = 20; // In pixels. Crops the border to reduce the black borders from stabilisation being too noticeable.
 
 // 1. Get previous to current frame transformation (dx, dy, da) for all frames
@@ -21,153 +23,826 @@ const int HORIZONTAL_BORDER_CROP = 20; // In pixels. Crops the border to reduce
 // 4. Generate new set of previous to current transform, such that the trajectory ends up being the same as the smoothed trajectory
 // 5. Apply the new transformation to the video
 
-struct TransformParam
+
+// The steps of the stabilizer that depend on the motion model, instantiated for every model.
+struct MotionModelOps
+{
+    bool (*estimate)(const std::vector<cv::Point2f>& from, const std::vector<cv::Point2f>& to, cv::Matx23d& T,
+        const RigidEstimatorOptions& options, int* inliers, RansacScratch* scratch);
+    TransformParam (*decompose)(const cv::Matx23d& T, double scale);
+    cv::Matx23d (*cropScaleMatrix)(const TransformParam& t, cv::Size src_size, cv::Size size,
+        int crop_x, int crop_y, int shift_x, int shift_y);
+};
+
+namespace {
+
+// the feature trackers time their work into the same metrics
+StabilizerOptions WithTrackerMetrics(StabilizerOptions options)
+{
+    options.tracking.metrics = options.metrics;
+    return options;
+}
+
+const MotionModelOps& ModelOps(MotionModel model);
+
+// grey frames EstimatePair() keeps for the next pair, twice as many as TransformVideo estimates at once by default,
+// so that a slot is free again by the time its turn comes round
+const size_t PAIR_GREY_SLOTS = 32;
+
+}
+
+Stabilizer::Stabilizer(const StabilizerOptions& options)
+:options(WithTrackerMetrics(options))
+,ops(&ModelOps(options.model))
+,tracker(this->options.tracking)
+,tile_fit(this->options.tracking)
+,pair_greys(PAIR_GREY_SLOTS)
 {
-    TransformParam() = default;
-    TransformParam(double _dx, double _dy, double _da) {
-        dx = _dx;
-        dy = _dy;
-        da = _da;
+    // For further analysis
+    if (!options.telemetryPath.empty())
+    {
+        telemetry = std::make_unique<TelemetrySink>(options.telemetryPath);
+        if (!telemetry->IsOpen())
+            telemetry.reset();
     }
+}
+
+namespace {
 
-    double dx;
-    double dy;
-    double da; // angle
+// Matrix that warps an image of src_size with the transform t of Model, crops the stabilisation border and scales
+// the result to size in a single resample: the crop and the scale are folded into the affine matrix. For a chroma
+// plane subsampled by 1 << shift_x, 1 << shift_y the luma transform is expressed in the plane's coordinates first.
+// A translation leaves the matrix without rotation, which RigidWarp() resamples separably.
+template<class Model>
+cv::Matx23d CropScaleMatrix(const TransformParam& t, cv::Size src_size, cv::Size size,
+    int crop_x, int crop_y, int shift_x, int shift_y)
+{
+    const double sub_x = 1 << shift_x;
+    const double sub_y = 1 << shift_y;
+
+    // scale of the cropped area back to the output size
+    const double sx = double(size.width) / (src_size.width - 2 * crop_x);
+    const double sy = double(size.height) / (src_size.height - 2 * crop_y);
+
+    double c, s;
+    Model::Linear(t, c, s);
+
+    // same pixel centre convention as resize()
+    cv::Matx23d M;
+    M(0, 0) = sx * c;
+    M(0, 1) = -sx * s * sub_y / sub_x;
+    M(0, 2) = sx * (t.dx / sub_x - crop_x + 0.5) - 0.5;
+    M(1, 0) = sy * s * sub_x / sub_y;
+    M(1, 1) = sy * c;
+    M(1, 2) = sy * (t.dy / sub_y - crop_y + 0.5) - 0.5;
+    return M;
+}
+
+template<class Model>
+MotionModelOps MakeModelOps()
+{
+    return { &EstimateMotionRansac<Model>, &Model::Decompose, &CropScaleMatrix<Model> };
+}
+
+// indexed by MotionModel
+const MotionModelOps MODEL_OPS[] = {
+    MakeModelOps<TranslationModel>(),
+    MakeModelOps<RigidModel>(),
+    MakeModelOps<SimilarityModel>(),
 };
 
+const MotionModelOps& ModelOps(MotionModel model)
+{
+    return MODEL_OPS[int(model)];
+}
 
-const double pstd = 4e-3;//can be changed
-const double cstd = 0.25;//can be changed
+// Warps src with t, crops and scales the result to dst's size, see CropScaleMatrix().
+void WarpCropScale(const MotionModelOps& ops, const cv::Mat& src, cv::Mat& dst, const TransformParam& t, cv::Size size,
+    int crop_x, int crop_y, int shift_x = 0, int shift_y = 0)
+{
+    RigidWarp(src, dst, ops.cropScaleMatrix(t, src.size(), size, crop_x, crop_y, shift_x, shift_y), size);
+}
 
-const Trajectory Q(pstd, pstd, pstd);// process noise covariance
-const Trajectory R(cstd, cstd, cstd);// measurement noise covariance 
+// Grey image of analysis_size motion is estimated on, made from the BGR frame or a grey plane.
+// A grey image of the right size is returned as is, otherwise the result is written into grey.
+cv::Mat AnalysisGrey(const cv::Mat& image, cv::Size analysis_size, cv::Mat& grey, cv::Mat& scratch)
+{
+    if (image.type() == CV_8UC1)
+    {
+        if (analysis_size == image.size())
+            return image;
+        resize(image, grey, analysis_size, 0, 0, cv::INTER_AREA);
+        return grey;
+    }
 
+    if (analysis_size != image.size())
+    {
+        // downscale first, so that the grey conversion runs on the proxy only
+        resize(image, scratch, analysis_size, 0, 0, cv::INTER_AREA);
+        cvtColor(scratch, grey, cv::COLOR_BGR2GRAY);
+    }
+    else
+    {
+        cvtColor(image, grey, cv::COLOR_BGR2GRAY);
+    }
+    return grey;
+}
+
+// fewer points than this left by the tile inlier map are not trusted on their own
+const size_t MIN_FIT_POINTS = 16;
+
+// Motion of the model of ops from prev_grey to grey in full resolution pixels, false if none was found.
+bool EstimateRigid(FeatureTracker& tracker, const MotionModelOps& ops, const RigidEstimatorOptions& estimation,
+    const cv::Mat& prev_grey, const cv::Mat& grey, double scale, std::vector<cv::Point2f>& prev_points, std::vector<cv::Point2f>& cur_points,
+    TransformParam& motion, Metrics* metrics, TileFit* tile_fit, RansacScratch& ransac, int* inliers = nullptr)
+{
+    // vector from prev to cur
+    tracker.Track(prev_grey, grey, prev_points, cur_points);
+
+    ScopedTimer timer(metrics, Stage::EstimateRigid);
+
+    // the points of the tiles dominated by motion of their own are left out of the fit, if enough remain
+    const auto& tiles = tracker.PointTiles();
+    const bool mapped = tile_fit != nullptr && tiles.size() == prev_points.size();
+    const std::vector<cv::Point2f>* from = &prev_points;
+    const std::vector<cv::Point2f>* to = &cur_points;
+    if (mapped)
+    {
+        auto& usable = tile_fit->usable;
+        auto& fit_from = tile_fit->from;
+        auto& fit_to = tile_fit->to;
+        tile_fit->map.Usable(usable);
+        fit_from.clear();
+        fit_to.clear();
+        for (size_t i = 0; i < tiles.size(); ++i)
+        {
+            if (usable[tiles[i]])
+            {
+                fit_from.push_back(prev_points[i]);
+                fit_to.push_back(cur_points[i]);
+            }
+        }
+        if (fit_from.size() < prev_points.size()
+            && fit_from.size() >= std::max(MIN_FIT_POINTS, prev_points.size() / 4))
+        {
+            from = &fit_from;
+            to = &fit_to;
+            if (metrics)
+                metrics->Add(Counter::TilesDropped, std::count(usable.begin(), usable.end(), false));
+        }
+    }
+
+    cv::Matx23d T;
+    if (!ops.estimate(*from, *to, T, estimation, inliers, &ransac))
+        return false;
 
+    // all the points are scored against the motion, so that a dropped tile recovers once it agrees again
+    if (mapped)
+    {
+        RigidInliers(prev_points, cur_points, T, estimation.threshold, tile_fit->inliers);
+        tile_fit->map.Update(tiles, tile_fit->inliers);
+    }
+
+    // decompose T, back to full resolution pixels
+    motion = ops.decompose(T, scale);
+    return true;
+}
 
-Stabilizer::Stabilizer()
-// For further analysis
-:out_transform("prev_to_cur_transformation.txt")
-,out_trajectory("trajectory.txt")
-,out_smoothed_trajectory("smoothed_trajectory.txt")
-,out_new_transform("new_prev_to_cur_transformation.txt")
+const int THUMBNAIL_WIDTH = 128;
+
+// Small float copy of grey for the phase correlation probe.
+void MakeThumbnail(const cv::Mat& grey, cv::Mat& thumb, cv::Mat& scratch)
 {
+    const int width = std::min(grey.cols, THUMBNAIL_WIDTH);
+    const cv::Size size(width, std::max(1, cvRound(double(grey.rows) * width / grey.cols)));
+    resize(grey, scratch, size, 0, 0, cv::INTER_AREA);
+    scratch.convertTo(thumb, CV_32F);
+}
+
+} // namespace
+
+void AddAnalysisOptions(Fingerprint& fingerprint, const StabilizerOptions& options)
+{
+    fingerprint.Add(options.analysisHeight);
+    fingerprint.Add(options.decimation);
+    fingerprint.Add(options.model);
+    const auto& tracking = options.tracking;
+    fingerprint.Add(tracking.maxCorners);
+    fingerprint.Add(tracking.qualityLevel);
+    fingerprint.Add(tracking.minDistance);
+    fingerprint.Add(tracking.persistent);
+    fingerprint.Add(tracking.minTracked);
+    fingerprint.Add(tracking.gridCols);
+    fingerprint.Add(tracking.gridRows);
+    fingerprint.Add(tracking.tiled);
+    fingerprint.Add(tracking.minTileInlierRatio);
+    const auto& estimation = options.estimation;
+    fingerprint.Add(estimation.similarity);
+    fingerprint.Add(estimation.threshold);
+    fingerprint.Add(estimation.confidence);
+    fingerprint.Add(estimation.maxIterations);
+    fingerprint.Add(estimation.minInlierRatio);
+    fingerprint.Add(estimation.refine);
+    fingerprint.Add(estimation.seed);
+    const auto& temporal = options.temporal;
+    fingerprint.Add(temporal.maxInterval);
+    if (temporal.maxInterval > 1)
+    {
+        fingerprint.Add(temporal.maxPredictionError);
+        fingerprint.Add(temporal.minInlierRatio);
+        fingerprint.Add(temporal.maxSpanDisplacement);
+        fingerprint.Add(temporal.probeThreshold);
+    }
+    // pairs are tracked on their own
+    fingerprint.Add(options.pairwiseEstimation);
+}
+
+cv::Size Stabilizer::AnalysisSize(cv::Size frame_size) const
+{
+    double scale = 1;
+    if (options.analysisHeight > 0 && options.analysisHeight < frame_size.height)
+        scale = double(options.analysisHeight) / frame_size.height;
+    else if (options.decimation > 1)
+        scale = 1. / options.decimation;
+
+    if (scale == 1)
+        return frame_size;
+
+    return { std::max(1, cvRound(frame_size.width * scale)), std::max(1, cvRound(frame_size.height * scale)) };
+}
+
+void Stabilizer::operator()(const cv::Mat& cur, cv::Mat& out)
+{
+    if (NeedsGrey())
+        MakeGrey(cur);
+    if (!Stabilize(cur, cur_grey, out))
+        cur.copyTo(out);
+    KeepGrey(cur_grey);
 }
 
 void Stabilizer::operator()(cv::Mat& cur)
 {
-    using std::vector;
-    using cv::Point2f;
+    if (NeedsGrey())
+        MakeGrey(cur);
+    auto out = out_pool.Acquire(cur.rows, cur.cols, cur.type());
+    if (Stabilize(cur, cur_grey, out))
+        cur = out;
+    KeepGrey(cur_grey);
+}
+
+void Stabilizer::operator()(cv::Mat& cur, const cv::Mat& analysis_grey)
+{
+    auto out = out_pool.Acquire(cur.rows, cur.cols, cur.type());
+    if (Stabilize(cur, analysis_grey, out))
+        cur = out;
+    KeepGrey(analysis_grey);
+}
+
+void Stabilizer::MakeGrey(const cv::Mat& cur)
+{
+    ScopedTimer timer(options.metrics, Stage::AnalysisGrey);
+    AnalysisGrey(cur, AnalysisSize(cur.size()), cur_grey, analysis_bgr);
+}
+
+bool Stabilizer::Stabilize(const cv::Mat& cur, const cv::Mat& grey, cv::Mat& out)
+{
+    if (options.metrics)
+        options.metrics->Add(Counter::FramesStabilized);
 
     if (k == 0)
     {
         k = 1;
         prev = cur;
-        cvtColor(prev, prev_grey, cv::COLOR_BGR2GRAY);
-        return;
+        return false;
     }
 
 
     const int vert_border = HORIZONTAL_BORDER_CROP * cur.rows / cur.cols; // get the aspect ratio correct
 
-    cvtColor(cur, cur_grey, cv::COLOR_BGR2GRAY);
+    const auto t = NextTransform(grey, double(grey.cols) / cur.cols);
 
-    // vector from prev to cur
-    vector <Point2f> prev_corner;
-    vector <Point2f> cur_corner;
-    vector <Point2f> prev_corner2;
-    vector <Point2f> cur_corner2;
-    vector <uchar> status;
-    vector <float> err;
-
-    goodFeaturesToTrack(prev_grey, prev_corner, 200, 0.01, 30);
-    calcOpticalFlowPyrLK(prev_grey, cur_grey, prev_corner, cur_corner, status, err);
-
-    // weed out bad matches
-    for (size_t i = 0; i < status.size(); i++) {
-        if (status[i] != 0) {
-            prev_corner2.push_back(prev_corner[i]);
-            cur_corner2.push_back(cur_corner[i]);
+    {
+        ScopedTimer timer(options.metrics, Stage::Warp);
+        WarpCropScale(*ops, prev, out, t, cur.size(), HORIZONTAL_BORDER_CROP, vert_border);
+    }
+
+    // the caller doesn't modify cur, so it is referenced rather than cloned
+    prev = cur;
+
+    k++;
+    return true;
+}
+
+void Stabilizer::operator()(const PlanarImage& cur, PlanarImage& out)
+{
+    const auto& cur_luma = cur.planes[0];
+
+    if (options.metrics)
+        options.metrics->Add(Counter::FramesStabilized);
+
+    const auto grey = LumaGrey(cur_luma);
+
+    if (k == 0)
+    {
+        k = 1;
+        for (int i = 0; i < cur.numPlanes; ++i)
+            cur.planes[i].copyTo(out.planes[i]);
+        prev_planes = cur;
+        KeepGrey(grey);
+        return;
+    }
+
+    const int vert_border = HORIZONTAL_BORDER_CROP * cur_luma.rows / cur_luma.cols; // get the aspect ratio correct
+
+    const auto t = NextTransform(grey, double(grey.cols) / cur_luma.cols);
+
+    ScopedTimer timer(options.metrics, Stage::Warp);
+    for (int i = 0; i < cur.numPlanes; ++i)
+    {
+        const int shift_x = (i == 0) ? 0 : cur.chromaShiftX;
+        const int shift_y = (i == 0) ? 0 : cur.chromaShiftY;
+
+        WarpCropScale(*ops, prev_planes.planes[i], out.planes[i], t, out.planes[i].size(),
+            HORIZONTAL_BORDER_CROP >> shift_x, vert_border >> shift_y, shift_x, shift_y);
+    }
+
+    // keeps the decoded frame alive instead of copying it
+    prev_planes = cur;
+    KeepGrey(grey);
+
+    k++;
+}
+
+bool Stabilizer::Transform(const cv::Mat& cur, TransformParam& t, cv::Matx23d& M)
+{
+    if (NeedsGrey())
+        MakeGrey(cur);
+    const bool result = NextCropTransform(cur.size(), cur_grey, t, M);
+    KeepGrey(cur_grey);
+    return result;
+}
+
+bool Stabilizer::Transform(const PlanarImage& cur, TransformParam& t, cv::Matx23d& M)
+{
+    const auto grey = LumaGrey(cur.planes[0]);
+    const bool result = NextCropTransform(cur.planes[0].size(), grey, t, M);
+    KeepGrey(grey);
+    return result;
+}
+
+bool Stabilizer::NextCropTransform(cv::Size size, const cv::Mat& grey, TransformParam& t, cv::Matx23d& M)
+{
+    if (options.metrics)
+        options.metrics->Add(Counter::FramesStabilized);
+
+    if (k == 0)
+    {
+        k = 1;
+        return false;
+    }
+
+    t = NextTransform(grey, double(grey.cols) / size.width);
+    M = CropMatrix(t, size);
+
+    k++;
+    return true;
+}
+
+cv::Matx23d Stabilizer::CropMatrix(const TransformParam& t, cv::Size size)
+{
+    const int vert_border = HORIZONTAL_BORDER_CROP * size.height / size.width; // get the aspect ratio correct
+    return CropScaleMatrix<SimilarityModel>(t, size, size, HORIZONTAL_BORDER_CROP, vert_border, 0, 0);
+}
+
+bool Stabilizer::Analyze(const PlanarImage& cur, MotionSample& sample)
+{
+    const auto& cur_luma = cur.planes[0];
+
+    if (options.metrics)
+        options.metrics->Add(Counter::FramesStabilized);
+
+    const auto grey = LumaGrey(cur_luma);
+
+    bool result = false;
+    if (k > 0)
+    {
+        TransformParam motion;
+        sample.estimated = EstimateMotion(grey, double(grey.cols) / cur_luma.cols, motion);
+        sample.dx = motion.dx;
+        sample.dy = motion.dy;
+        sample.da = motion.da;
+        sample.ds = motion.ds;
+        sample.tracked = tracked;
+        result = true;
+    }
+
+    // keeps the decoded frame alive as long as its luma is referenced
+    prev_planes = cur;
+    KeepGrey(grey);
+
+    k++;
+    return result;
+}
+
+void Stabilizer::SetPlan(std::vector<TransformParam> transforms)
+{
+    plan = std::move(transforms);
+}
+
+cv::Mat Stabilizer::LumaGrey(const cv::Mat& luma)
+{
+    // the luma plane is used as is, no grey copy is made at full resolution
+    if (!NeedsGrey())
+        return {};
+    ScopedTimer timer(options.metrics, Stage::AnalysisGrey);
+    return AnalysisGrey(luma, AnalysisSize(luma.size()), cur_grey, analysis_bgr);
+}
+
+void Stabilizer::KeepGrey(const cv::Mat& grey)
+{
+    // cur_grey is rewritten on the next frame, so its buffer is swapped with prev_grey;
+    // external memory (a luma plane kept alive by prev_planes, a caller's proxy) is just referenced
+    if (grey.data == cur_grey.data)
+        std::swap(prev_grey, cur_grey);
+    else
+        prev_grey = grey;
+}
+
+TransformParam Stabilizer::NextTransform(const cv::Mat& grey, double scale)
+{
+    if (!plan.empty())
+        last_transform = plan[std::min(size_t(k - 1), plan.size() - 1)];
+    else
+    {
+        TransformParam motion;
+        EstimateMotion(grey, scale, motion);
+        last_transform = SmoothMotion(motion);
+    }
+    return last_transform;
+}
+
+bool Stabilizer::EstimateMotion(const cv::Mat& grey, double scale, TransformParam& motion)
+{
+    bool found = false;
+    if (options.pairwiseEstimation)
+    {
+        // estimated ahead by EstimatePair()
+        std::lock_guard<std::mutex> lock(estimates_mutex);
+        const auto estimate = estimates.find(k);
+        if (estimate != estimates.end())
+        {
+            found = estimate->second.found;
+            motion = estimate->second.motion;
+            tracked = estimate->second.tracked;
+            estimates.erase(estimate);
         }
     }
+    else if (CachedMotion(k, found, motion, tracked))
+    {
+        // the tracked features and the span anchor belong to a frame before the cached ones
+        tracker.Reset();
+        anchor_valid = false;
+    }
+    else
+    {
+        if (options.temporal.maxInterval > 1)
+            found = EstimateSpan(grey, scale, motion);
+        else
+        {
+            found = EstimateRigid(tracker, *ops, options.estimation, prev_grey, grey, scale, prev_corner2,
+                cur_corner2, motion, options.metrics, TileInliers(), ransac_scratch);
+            tracked = int32_t(cur_corner2.size());
+        }
+        CacheMotion(k, found, motion, tracked);
+    }
 
-    // translation + rotation only
-    auto T = estimateRigidTransform(prev_corner2, cur_corner2, false); // false = rigid transform, no scaling/shearing
+    if (options.metrics)
+    {
+        options.metrics->Add(Counter::TrackedPoints, tracked);
+        if (!found)
+            options.metrics->Add(Counter::EstimationFailures);
+    }
 
     // in rare cases no transform is found. We'll just use the last known good transform.
-    if (T.data == nullptr) {
-        last_T.copyTo(T);
+    if (!found) {
+        motion = last_motion;
+        return false;
+    }
+
+    last_motion = motion;
+    return true;
+}
+
+bool Stabilizer::EstimateSpan(const cv::Mat& grey, double scale, TransformParam& motion)
+{
+    const auto& temporal = options.temporal;
+
+    ++span;
+    if (anchor_valid && span < interval && !ProbeDeviates(grey, scale))
+    {
+        // skipped: no points are tracked for this frame
+        motion = TransformParam(velocity.x, velocity.y, velocity.a, velocity.s);
+        predicted = predicted + velocity;
+        tracked = 0;
+        if (options.metrics)
+            options.metrics->Add(Counter::EstimationsSkipped);
+        return true;
     }
 
-    T.copyTo(last_T);
+    if (!anchor_valid)
+    {
+        span = 1;
+        predicted = Trajectory(0, 0, 0, 0);
+    }
+
+    // grey is copied, as it may be a plane of a frame that is recycled before the span ends; the buffers are
+    // swapped afterwards, so that the tracker finds the pyramid it built for this frame on the next span
+    grey.copyTo(span_grey);
+    TransformParam span_motion;
+    int inliers = 0;
+    const bool found = EstimateRigid(tracker, *ops, options.estimation, anchor_valid ? anchor_grey : prev_grey,
+        span_grey, scale, prev_corner2, cur_corner2, span_motion, options.metrics, TileInliers(), ransac_scratch, &inliers);
+    tracked = int32_t(cur_corner2.size());
+    std::swap(anchor_grey, span_grey);
+    anchor_valid = true;
+    MakeThumbnail(anchor_grey, anchor_thumb, thumb_scratch);
+
+    if (found)
+    {
+        // the trajectory is exact at the estimated frames: this one gets what the skipped ones didn't
+        motion = TransformParam(span_motion.dx - predicted.x, span_motion.dy - predicted.y,
+            span_motion.da - predicted.a, span_motion.ds - predicted.s);
+
+        const double error = std::hypot(span_motion.dx - span * velocity.x, span_motion.dy - span * velocity.y) / span;
+        const double inlier_ratio = tracked > 0 ? double(inliers) / tracked : 0;
+        velocity = Trajectory(span_motion.dx / span, span_motion.dy / span, span_motion.da / span,
+            span_motion.ds / span);
+
+        if (error > temporal.maxPredictionError || inlier_ratio < temporal.minInlierRatio)
+            interval = std::max(1, interval / 2);
+        else if (error < temporal.maxPredictionError / 2)
+            interval = std::min(temporal.maxInterval, interval + 1);
+
+        const double speed = std::hypot(velocity.x, velocity.y) * scale;
+        if (speed * interval > temporal.maxSpanDisplacement)
+            interval = std::max(1, int(temporal.maxSpanDisplacement / speed));
+    }
+    else
+        interval = 1;
 
-    // decompose T
-    double dx = T.at<double>(0, 2);
-    double dy = T.at<double>(1, 2);
-    double da = atan2(T.at<double>(1, 0), T.at<double>(0, 0));
+    span = 0;
+    predicted = Trajectory(0, 0, 0, 0);
+    return found;
+}
 
-    out_transform << k << " " << dx << " " << dy << " " << da << '\n';
+bool Stabilizer::ProbeDeviates(const cv::Mat& grey, double scale)
+{
+    if (options.temporal.probeThreshold <= 0)
+        return false;
+
+    MakeThumbnail(grey, thumb, thumb_scratch);
+    if (thumb.size() != anchor_thumb.size())
+        return true;
+    if (thumb_window.size() != thumb.size())
+        createHanningWindow(thumb_window, thumb.size(), CV_32F);
+
+    // displacement of the content since the anchor, in thumbnail pixels, against the extrapolated one
+    const cv::Point2d shift = phaseCorrelate(anchor_thumb, thumb, thumb_window);
+    const double to_thumb = scale * thumb.cols / grey.cols;
+    const double error_x = shift.x - (predicted.x + velocity.x) * to_thumb;
+    const double error_y = shift.y - (predicted.y + velocity.y) * to_thumb;
+    return std::hypot(error_x, error_y) * grey.cols / thumb.cols > options.temporal.probeThreshold;
+}
+
+bool Stabilizer::NeedsGrey() const
+{
+    // the grey frame is needed for the motion of this frame and of the next one
+    if (!EstimatesInline())
+        return false;
+    if (options.motionCache == nullptr)
+        return true;
+    return !((k == 0 || options.motionCache->Contains(k)) && options.motionCache->Contains(k + 1));
+}
+
+bool Stabilizer::CachedMotion(int64_t index, bool& found, TransformParam& motion, int32_t& tracked_points)
+{
+    MotionSample sample;
+    if (options.motionCache == nullptr || !options.motionCache->Lookup(index, sample))
+        return false;
+
+    found = sample.estimated != 0;
+    motion = TransformParam(sample.dx, sample.dy, sample.da, sample.ds);
+    tracked_points = sample.tracked;
+    if (options.metrics)
+        options.metrics->Add(Counter::MotionCacheHits);
+    return true;
+}
+
+void Stabilizer::CacheMotion(int64_t index, bool found, const TransformParam& motion, int32_t tracked_points)
+{
+    if (options.motionCache == nullptr)
+        return;
+    MotionSample sample;
+    sample.dx = motion.dx;
+    sample.dy = motion.dy;
+    sample.da = motion.da;
+    sample.ds = motion.ds;
+    sample.tracked = tracked_points;
+    sample.estimated = found ? 1 : 0;
+    options.motionCache->Store(index, sample);
+}
+
+void Stabilizer::EstimatePair(const cv::Mat& prev_image, const cv::Mat& cur_image, cv::Size frame_size, int64_t index)
+{
+    PairEstimate estimate;
+    if (CachedMotion(index, estimate.found, estimate.motion, estimate.tracked))
+    {
+        std::lock_guard<std::mutex> lock(estimates_mutex);
+        estimates[index] = estimate;
+        return;
+    }
+
+    // a proxy is already scaled, the frame or its luma plane is reduced the same way as inline
+    auto analysis_size = [&](const cv::Mat& image) {
+        return (image.size() == frame_size) ? AnalysisSize(frame_size) : image.size();
+    };
+
+    std::unique_ptr<PairWorkspace> workspace = AcquirePairWorkspace();
+    cv::Mat prev_grey, grey;
+    {
+        ScopedTimer timer(options.metrics, Stage::AnalysisGrey);
+        // cur is converted once for this pair and the next; a grey proxy of the analysis size is used as is
+        cv::Mat slot_buffer;
+        const bool shared = PairGreyBuffer(index, slot_buffer);
+        cv::Mat& cur_buffer = shared ? slot_buffer : workspace->cur_buffer;
+        grey = AnalysisGrey(cur_image, analysis_size(cur_image), cur_buffer, workspace->scratch);
+        if (shared && grey.data == cur_buffer.data)
+            PublishPairGrey(index, grey);
+        if (!TakePairGrey(index - 1, prev_grey))
+            prev_grey = AnalysisGrey(prev_image, analysis_size(prev_image), workspace->prev_buffer, workspace->scratch);
+    }
+
+    // The tracker doesn't carry the points over, a pair on its own can't, but keeps the pyramid of its last grey
+    // frame, which is this pair's prev if it tracked the pair before.
+    if (workspace->last_index != index - 1)
+        workspace->tracker.Restart();
+    workspace->last_index = index;
+
+    // the tile inlier map follows the frames in order, the pairs finish in any order and would make the tiles
+    // dropped depend on the thread timing; every pair fits all the tiles, as the serial estimation with 0
+    estimate.found = EstimateRigid(workspace->tracker, *ops, options.estimation, prev_grey, grey,
+        double(grey.cols) / frame_size.width, workspace->prev_points, workspace->cur_points, estimate.motion,
+        options.metrics, nullptr, workspace->ransac);
+    estimate.tracked = int32_t(workspace->cur_points.size());
+    ReleasePairWorkspace(std::move(workspace));
+    CacheMotion(index, estimate.found, estimate.motion, estimate.tracked);
+
+    std::lock_guard<std::mutex> lock(estimates_mutex);
+    estimates[index] = estimate;
+}
+
+std::unique_ptr<Stabilizer::PairWorkspace> Stabilizer::AcquirePairWorkspace()
+{
+    {
+        std::lock_guard<std::mutex> lock(pair_mutex);
+        if (!pair_workspaces.empty())
+        {
+            std::unique_ptr<PairWorkspace> workspace = std::move(pair_workspaces.back());
+            pair_workspaces.pop_back();
+            return workspace;
+        }
+    }
+    auto tracking = options.tracking;
+    tracking.persistent = false;
+    return std::make_unique<PairWorkspace>(tracking);
+}
+
+void Stabilizer::ReleasePairWorkspace(std::unique_ptr<PairWorkspace> workspace)
+{
+    std::lock_guard<std::mutex> lock(pair_mutex);
+    pair_workspaces.push_back(std::move(workspace));
+}
+
+bool Stabilizer::TakePairGrey(int64_t index, cv::Mat& grey)
+{
+    if (index < 0)
+        return false;
+    std::lock_guard<std::mutex> lock(pair_mutex);
+    PairGrey& slot = pair_greys[size_t(index) % pair_greys.size()];
+    if (slot.index != index)
+        return false;
+    grey = slot.grey;
+    slot.index = -1;
+    return true;
+}
+
+bool Stabilizer::PairGreyBuffer(int64_t index, cv::Mat& buffer)
+{
+    std::lock_guard<std::mutex> lock(pair_mutex);
+    PairGrey& slot = pair_greys[size_t(index) % pair_greys.size()];
+    // a pair that hasn't taken the frame in the slot yet converts it itself
+    slot.index = -1;
+    if (slot.grey.u && CV_XADD(&slot.grey.u->refcount, 0) != 1)
+        return false;
+    buffer = std::move(slot.grey);
+    return true;
+}
+
+void Stabilizer::PublishPairGrey(int64_t index, const cv::Mat& grey)
+{
+    std::lock_guard<std::mutex> lock(pair_mutex);
+    PairGrey& slot = pair_greys[size_t(index) % pair_greys.size()];
+    slot.index = index;
+    slot.grey = grey;
+}
+
+Trajectory Stabilizer::CentredMean(const Trajectory& current)
+{
+    Trajectory sum = current;
+    int count = 1;
+    for (const auto& past : past_trajectory)
+    {
+        sum = sum + past;
+        ++count;
+    }
+
+    // the trajectory ahead, from the pairs estimated so far; a failed estimation repeats the last motion
+    {
+        std::lock_guard<std::mutex> lock(estimates_mutex);
+        Trajectory ahead = current;
+        TransformParam motion = last_motion;
+        for (int i = 1; i <= options.lookahead; ++i)
+        {
+            const auto estimate = estimates.find(k + i);
+            if (estimate == estimates.end())
+                break;
+            if (estimate->second.found)
+                motion = estimate->second.motion;
+            ahead = ahead + Trajectory(motion.dx, motion.dy, motion.da, motion.ds);
+            sum = sum + ahead;
+            ++count;
+        }
+    }
+
+    past_trajectory.push_back(current);
+    if (int(past_trajectory.size()) > options.lookahead)
+        past_trajectory.pop_front();
+
+    return Trajectory(sum.x / count, sum.y / count, sum.a / count, sum.s / count);
+}
+
+TransformParam Stabilizer::SmoothMotion(const TransformParam& motion)
+{
+    double dx = motion.dx;
+    double dy = motion.dy;
+    double da = motion.da;
+    double ds = motion.ds;
+
+    MotionRecord record;
+    record.frame = k;
+    record.tracked = tracked;
+    record.dx = dx;
+    record.dy = dy;
+    record.da = da;
+    record.ds = ds;
     //
     // Accumulated frame to frame transform
     x += dx;
     y += dy;
     a += da;
+    s += ds;
     //
-    out_trajectory << k << " " << x << " " << y << " " << a << '\n';
+    record.x = x;
+    record.y = y;
+    record.a = a;
+    record.s = s;
     //
-    Trajectory z{ x, y, a };
+    const bool centred = options.lookahead > 0 && options.pairwiseEstimation;
+    const Trajectory X = centred ? CentredMean(Trajectory(x, y, a, s)) : kalman.Update(Trajectory(x, y, a, s));
     //
-    if (k == 1) {
-        // intial guesses
-        X = Trajectory(0, 0, 0); //Initial estimate,  set 0
-        P = Trajectory(1, 1, 1); //set error variance,set 1
-    }
-    else
-    {
-        //time update（prediction）
-        X_ = X; //X_(k) = X(k-1);
-        P_ = P + Q; //P_(k) = P(k-1)+Q;
-        // measurement update（correction）
-        K = P_ / (P_ + R); //gain;K(k) = P_(k)/( P_(k)+R );
-        X = X_ + K * (z - X_); //z-X_ is residual,X(k) = X_(k)+K(k)*(z(k)-X_(k)); 
-        P = (Trajectory(1, 1, 1) - K)*P_; //P(k) = (1-K(k))*P_(k);
-    }
-    //smoothed_trajectory.push_back(X);
-    out_smoothed_trajectory << k << " " << X.x << " " << X.y << " " << X.a << '\n';
+    record.smoothed_x = X.x;
+    record.smoothed_y = X.y;
+    record.smoothed_a = X.a;
+    record.smoothed_s = X.s;
     //-
     // target - current
     double diff_x = X.x - x;//
     double diff_y = X.y - y;
     double diff_a = X.a - a;
+    double diff_s = X.s - s;
 
     dx = dx + diff_x;
     dy = dy + diff_y;
     da = da + diff_a;
+    ds = ds + diff_s;
 
     //
-    out_new_transform << k << " " << dx << " " << dy << " " << da << '\n';
-    //
-    T.at<double>(0, 0) = cos(da);
-    T.at<double>(0, 1) = -sin(da);
-    T.at<double>(1, 0) = sin(da);
-    T.at<double>(1, 1) = cos(da);
-
-    T.at<double>(0, 2) = dx;
-    T.at<double>(1, 2) = dy;
-
-    cv::Mat cur2;
-
-    warpAffine(prev, cur2, T, cur.size());
-
-    cur2 = cur2(cv::Range(vert_border, cur2.rows - vert_border), 
-        cv::Range(HORIZONTAL_BORDER_CROP, cur2.cols - HORIZONTAL_BORDER_CROP));
-
-    // Resize cur2 back to cur size, for better side by side comparison
-    resize(cur2, cur2, cur.size());
-
-    prev = cur.clone();//cur.copyTo(prev);
-    cur_grey.copyTo(prev_grey);
-
-    cur = cur2;
-
-    k++;
+    record.new_dx = dx;
+    record.new_dy = dy;
+    record.new_da = da;
+    record.new_ds = ds;
+    if (telemetry)
+        telemetry->Push(record);
+
+    return TransformParam(dx, dy, da, ds);
 }
@@ -2,75 +2,268 @@
 
 #include <opencv2/opencv.hpp>
 
-struct TransformParam;
+#include "FeatureTracker.h"
+#include "MatPool.h"
+#include "Metrics.h"
+#include "MotionCache.h"
+#include "MotionFile.h"
+#include "MotionModel.h"
+#include "MotionSmoothing.h"
+#include "PlanarImage.h"
+#include "RigidEstimator.h"
+#include "Telemetry.h"
+#include "Trajectory.h"
 
-struct Trajectory
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// The tile inlier map of the inline estimation, and the buffers of the fit on the points of the tiles it keeps,
+// which keep their capacity from frame to frame.
+struct TileFit
 {
-    Trajectory() = default;
-    Trajectory(double _x, double _y, double _a) {
-        x = _x;
-        y = _y;
-        a = _a;
-    }
-    // "+"
-    friend Trajectory operator+(const Trajectory &c1, const Trajectory  &c2) {
-        return Trajectory(c1.x + c2.x, c1.y + c2.y, c1.a + c2.a);
-    }
-    //"-"
-    friend Trajectory operator-(const Trajectory &c1, const Trajectory  &c2) {
-        return Trajectory(c1.x - c2.x, c1.y - c2.y, c1.a - c2.a);
-    }
-    //"*"
-    friend Trajectory operator*(const Trajectory &c1, const Trajectory  &c2) {
-        return Trajectory(c1.x*c2.x, c1.y*c2.y, c1.a*c2.a);
-    }
-    //"/"
-    friend Trajectory operator/(const Trajectory &c1, const Trajectory  &c2) {
-        return Trajectory(c1.x / c2.x, c1.y / c2.y, c1.a / c2.a);
-    }
-    //"="
-    Trajectory operator =(const Trajectory &rx) {
-        x = rx.x;
-        y = rx.y;
-        a = rx.a;
-        return Trajectory(x, y, a);
-    }
+    explicit TileFit(const FeatureTrackerOptions& options) : map(options) {}
+
+    TileInlierMap map;
+    std::vector<bool> usable;
+    std::vector<cv::Point2f> from, to;
+    std::vector<uchar> inliers; // of every tracked point
+};
+
+// Adaptive temporal decimation of the inline motion estimation, for high frame rate footage whose consecutive
+// frames hardly differ. The motion is estimated over a span of frames at once, from the last estimated frame;
+// the frames in between get the motion of the last span extrapolated, and the estimated frame gets the rest,
+// so the trajectory is exact at every estimated frame. The span grows while the extrapolation holds and the
+// estimation is reliable, and shrinks otherwise.
+struct TemporalDecimationOptions
+{
+    // Longest span, 1 estimates the motion of every frame.
+    int maxInterval = 1;
+    // The span halves when the extrapolation was off by more than this many pixels per frame, at full
+    // resolution, and grows by one frame when it was off by less than half of it...
+    double maxPredictionError = 0.5;
+    // ...unless fewer of the tracked points than this were inliers.
+    double minInlierRatio = 0.6;
+    // The motion over a span is kept below this many analysis pixels, which the tracking can follow.
+    double maxSpanDisplacement = 24;
+    // A frame is estimated early if a phase correlation of thumbnails against the last estimated frame puts it
+    // more than this many analysis pixels away from the extrapolated position; 0 disables the probe.
+    double probeThreshold = 2;
+};
+
+struct StabilizerOptions
+{
+    // Motion is estimated on a grey proxy no taller than this, 0 keeps the full resolution.
+    int analysisHeight = 0;
+    // Alternatively, the proxy is the frame decimated by this factor.
+    int decimation = 1;
+
+    // Estimated, smoothed and warped with code specialised for the model, picked from a table at construction.
+    MotionModel model = MotionModel::Rigid;
+
+    FeatureTrackerOptions tracking;
+    RigidEstimatorOptions estimation;
+    // Applies to the inline estimation only, not to pairwise estimation or to a plan.
+    TemporalDecimationOptions temporal;
+
+    // Motion is estimated by EstimatePair() calls made ahead of the frames, e.g. from a thread pool,
+    // instead of inline. Every pair is tracked on its own, as with tracking.persistent = false.
+    bool pairwiseEstimation = false;
+    // With pairwise estimation, the trajectory is smoothed with a window centred on the frame, reaching this
+    // many frames back and ahead, instead of the causal Kalman filter. The motion of the frames ahead is
+    // taken from what EstimatePair() has done so far, see TransformVideoOptions::lookahead.
+    int lookahead = 0;
+
+    // If set, the motion of the frames it has is read from it instead of being estimated, and the motion
+    // estimated for the others is stored into it; no grey proxy is made for a run of cached frames.
+    MotionCache* motionCache = nullptr;
+
+    // Binary per-frame motion records are written here if set, see telemetry-dump.
+    std::string telemetryPath;
 
-    double x;
-    double y;
-    double a; // angle
+    // If set, the analysis proxy, the tracking, the estimation and the warp are timed into it, and the frames,
+    // the estimation failures and the tracked points are counted. Also passed on to the feature tracker.
+    Metrics* metrics = nullptr;
 };
 
+struct MotionModelOps;
+
+// Adds the options that change the motion Stabilizer estimates, for the key of a MotionCache.
+void AddAnalysisOptions(Fingerprint& fingerprint, const StabilizerOptions& options);
+
 
 class Stabilizer {
 public:
-    Stabilizer();
+    explicit Stabilizer(const StabilizerOptions& options = {});
+    // Writes the stabilized frame into out, a buffer provided by the caller. cur is kept by reference
+    // as the previous frame, so the caller must not write into it afterwards.
+    void operator()(const cv::Mat& cur, cv::Mat& out);
+    // Replaces cur with the stabilized frame, which is taken from a pool of output buffers.
     void operator()(cv::Mat& cur);
+    // Same as above with the analysis proxy already made by the caller, e.g. scaled straight from the decoded frame.
+    void operator()(cv::Mat& cur, const cv::Mat& analysis_grey);
+    // Native planar path: motion is estimated on the luma plane of cur and every plane
+    // of the previous frame is warped straight into the caller-provided planes of out.
+    void operator()(const PlanarImage& cur, PlanarImage& out);
+
+    // Estimation only, for callers that warp the frames themselves: t receives the transformation operator()
+    // would warp the previous frame with, and M the matrix that does so including the border crop, as in
+    // warpAffine(prev, out, M, prev.size()); returns false for the first frame. Like the frames passed to
+    // operator(), cur is referenced until the next call.
+    bool Transform(const cv::Mat& cur, TransformParam& t, cv::Matx23d& M);
+    bool Transform(const PlanarImage& cur, TransformParam& t, cv::Matx23d& M);
+
+    // Transformation the last frame was warped with, the identity until the second frame.
+    const TransformParam& LastTransform() const { return last_transform; }
+    // Matrix that warps a frame of the given size with t, including the border crop, for any model.
+    static cv::Matx23d CropMatrix(const TransformParam& t, cv::Size size);
+
+    // Analysis pass: only estimates the motion from the previous frame to cur, nothing is warped.
+    // Returns false for the first frame, which has no motion.
+    bool Analyze(const PlanarImage& cur, MotionSample& sample);
+
+    // Apply pass: the frames are warped with these transformations (the one at index i is applied
+    // to frame i + 1) instead of estimating and smoothing the motion inline.
+    void SetPlan(std::vector<TransformParam> transforms);
+
+    // Estimates the motion from prev to cur, the images the pipeline has for frames index - 1 and index
+    // (the BGR frames, their luma planes or grey proxies); may be called for several pairs at once.
+    // The result is used when frame index is stabilized, see StabilizerOptions::pairwiseEstimation.
+    void EstimatePair(const cv::Mat& prev, const cv::Mat& cur, cv::Size frame_size, int64_t index);
+
+    // Size of the grey proxy motion is estimated on for frames of the given size.
+    cv::Size AnalysisSize(cv::Size frame_size) const;
+
+    // Output buffers allocated so far; stays constant in the steady state.
+    size_t OutputBufferAllocations() const { return out_pool.allocations(); }
 
     Stabilizer(const Stabilizer&) = delete;
     Stabilizer& operator=(const Stabilizer&) = delete;
 
 private:
-    std::ofstream out_transform;
-    std::ofstream out_trajectory;
-    std::ofstream out_smoothed_trajectory;
-    std::ofstream out_new_transform;
+    // returns false for the first frame, which is not warped
+    bool Stabilize(const cv::Mat& cur, const cv::Mat& grey, cv::Mat& out);
+    // the transformation of the previous frame for Transform(), false for the first frame
+    bool NextCropTransform(cv::Size size, const cv::Mat& grey, TransformParam& t, cv::Matx23d& M);
+    void MakeGrey(const cv::Mat& cur);
+    cv::Mat LumaGrey(const cv::Mat& luma);
+    void KeepGrey(const cv::Mat& grey);
+    // false if the motion comes from a plan or from EstimatePair(), so no grey frames are needed
+    bool EstimatesInline() const { return plan.empty() && !options.pairwiseEstimation; }
+    // ...or if the motion cache has the motion of the current and the next frame
+    bool NeedsGrey() const;
+    // the map of the tiles, if the tracking is tiled and drops tiles
+    TileFit* TileInliers()
+    {
+        return (options.tracking.tiled && options.tracking.minTileInlierRatio > 0) ? &tile_fit : nullptr;
+    }
+    // the motion of frame index from options.motionCache, false if it isn't cached
+    bool CachedMotion(int64_t index, bool& found, TransformParam& motion, int32_t& tracked_points);
+    void CacheMotion(int64_t index, bool found, const TransformParam& motion, int32_t tracked_points);
 
+    // grey is the analysis proxy, scale is its size relative to the frame
+    TransformParam NextTransform(const cv::Mat& grey, double scale);
+    // Motion from prev_grey to grey in full resolution pixels; false if it couldn't be estimated
+    // and the last known motion was reused.
+    bool EstimateMotion(const cv::Mat& grey, double scale, TransformParam& motion);
+    // Same with temporal decimation: extrapolated, or estimated from the last estimated frame.
+    bool EstimateSpan(const cv::Mat& grey, double scale, TransformParam& motion);
+    // Whether the cheap probe finds grey away from where the extrapolated motion puts it.
+    bool ProbeDeviates(const cv::Mat& grey, double scale);
+    // Accumulates the motion into the trajectory, smooths it and returns the transformation
+    // that moves the previous frame onto the smoothed trajectory.
+    TransformParam SmoothMotion(const TransformParam& motion);
+    // Mean of the trajectory over the lookahead window around the current frame, whose trajectory is current.
+    Trajectory CentredMean(const Trajectory& current);
+
+    StabilizerOptions options;
+    const MotionModelOps* ops; // the steps specialised for options.model
+    FeatureTracker tracker;
+    TileFit tile_fit; // of the inline estimation only, the pairwise one keeps every tile
+    RansacScratch ransac_scratch; // of the inline estimation
+
+    std::unique_ptr<TelemetrySink> telemetry;
+
+    cv::Mat analysis_bgr;
     cv::Mat cur_grey;
     cv::Mat prev;
     cv::Mat prev_grey;
+    MatPool out_pool;
+    PlanarImage prev_planes;
+
+    std::vector<cv::Point2f> prev_corner2;
+    std::vector<cv::Point2f> cur_corner2;
+
+    TransformParam last_motion{ 0, 0, 0, 0 };
+    TransformParam last_transform{ 0, 0, 0, 0 };
+    int32_t tracked = 0;
+
+    struct PairEstimate
+    {
+        bool found;
+        TransformParam motion;
+        int32_t tracked;
+    };
+    std::mutex estimates_mutex;
+    std::map<int64_t, PairEstimate> estimates;
+
+    // What EstimatePair() needs for one pair, kept for the next one: a pool of n threads ends up with n of them.
+    struct PairWorkspace
+    {
+        explicit PairWorkspace(const FeatureTrackerOptions& tracking) : tracker(tracking) {}
+
+        FeatureTracker tracker;
+        int64_t last_index = -1; // the pair the tracker last tracked, whose grey frame is this one's prev
+        cv::Mat prev_buffer;
+        cv::Mat cur_buffer; // if the slot of the grey frame is still used
+        cv::Mat scratch;
+        std::vector<cv::Point2f> prev_points;
+        std::vector<cv::Point2f> cur_points;
+        RansacScratch ransac;
+    };
+    std::unique_ptr<PairWorkspace> AcquirePairWorkspace();
+    void ReleasePairWorkspace(std::unique_ptr<PairWorkspace> workspace);
+
+    // The grey frames EstimatePair() converts, by index modulo their count, so that the pair starting from a frame
+    // takes it from the pair ending in it instead of converting it again. A slot whose grey frame is still used
+    // is left to its users, the frame that comes round to it is converted into the pair's own buffer.
+    struct PairGrey
+    {
+        int64_t index = -1; // the frame in grey, -1 once it's taken
+        cv::Mat grey;
+    };
+    // the converted grey of frame index if it's there, which frees its slot
+    bool TakePairGrey(int64_t index, cv::Mat& grey);
+    // the buffer of the slot to convert frame index into, false if it's still used
+    bool PairGreyBuffer(int64_t index, cv::Mat& buffer);
+    void PublishPairGrey(int64_t index, const cv::Mat& grey);
+    std::mutex pair_mutex; // of the workspaces and the grey frames
+    std::vector<std::unique_ptr<PairWorkspace>> pair_workspaces;
+    std::vector<PairGrey> pair_greys;
 
-    cv::Mat last_T;
+    // temporal decimation: the last estimated frame, the buffer the next one is copied into, their thumbnails
+    cv::Mat anchor_grey;
+    cv::Mat span_grey;
+    cv::Mat anchor_thumb;
+    cv::Mat thumb;
+    cv::Mat thumb_scratch;
+    cv::Mat thumb_window;
+    bool anchor_valid = false;
+    int span = 0; // frames since the anchor
+    int interval = 1;
+    Trajectory velocity{ 0, 0, 0, 0 }; // motion per frame over the last span
+    Trajectory predicted{ 0, 0, 0, 0 }; // motion given to the skipped frames of the current span
 
-    Trajectory X;//posteriori state estimate
-    Trajectory	X_;//priori estimate
-    Trajectory P;// posteriori estimate error covariance
-    Trajectory P_;// priori estimate error covariance
-    Trajectory K;//gain
+    KalmanSmoother kalman;
+    std::deque<Trajectory> past_trajectory; // of the lookahead frames before the current one
+    std::vector<TransformParam> plan;
 
     double a = 0;
     double x = 0;
     double y = 0;
+    double s = 0;
 
     int k = 0;
 };
\ No newline at end of file
@@ -0,0 +1,202 @@
+#include "StabilizerApi.h"
+
+#include "Stabilizer.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <string>
+
+struct vstab_stabilizer
+{
+    std::unique_ptr<Stabilizer> stabilizer;
+    std::string lastError;
+};
+
+namespace {
+
+struct FormatLayout
+{
+    int numPlanes;
+    int chromaShiftX;
+    int chromaShiftY;
+    int type; // of the first plane
+};
+
+bool GetLayout(vstab_pixel_format format, FormatLayout& layout)
+{
+    switch (format) {
+    case VSTAB_PIXEL_FORMAT_GRAY8: layout = { 1, 0, 0, CV_8UC1 }; return true;
+    case VSTAB_PIXEL_FORMAT_YUV420P: layout = { 3, 1, 1, CV_8UC1 }; return true;
+    case VSTAB_PIXEL_FORMAT_YUV422P: layout = { 3, 1, 0, CV_8UC1 }; return true;
+    case VSTAB_PIXEL_FORMAT_YUV444P: layout = { 3, 0, 0, CV_8UC1 }; return true;
+    case VSTAB_PIXEL_FORMAT_BGR24: layout = { 1, 0, 0, CV_8UC3 }; return true;
+    }
+    return false;
+}
+
+// Wraps the planes of image without copying; the packed BGR24 frame is left in planes[0].
+int Wrap(const vstab_image* image, PlanarImage& planar)
+{
+    if (image == nullptr || image->width <= 0 || image->height <= 0)
+        return VSTAB_ERROR_INVALID_ARGUMENT;
+    FormatLayout layout;
+    if (!GetLayout(image->format, layout))
+        return VSTAB_ERROR_UNSUPPORTED_FORMAT;
+
+    planar.numPlanes = layout.numPlanes;
+    planar.chromaShiftX = layout.chromaShiftX;
+    planar.chromaShiftY = layout.chromaShiftY;
+    for (int i = 0; i < layout.numPlanes; ++i) {
+        const int shift_x = (i == 0) ? 0 : layout.chromaShiftX;
+        const int shift_y = (i == 0) ? 0 : layout.chromaShiftY;
+        const int width = -((-image->width) >> shift_x);
+        const int height = -((-image->height) >> shift_y);
+        const int type = (i == 0) ? layout.type : CV_8UC1;
+        const int pixelBytes = (type == CV_8UC3) ? 3 : 1;
+        if (image->planes[i] == nullptr || image->strides[i] < width * pixelBytes)
+            return VSTAB_ERROR_INVALID_ARGUMENT;
+        planar.planes[i] = cv::Mat(height, width, type, image->planes[i], size_t(image->strides[i]));
+    }
+    return VSTAB_OK;
+}
+
+void Fill(const TransformParam& t, cv::Size size, vstab_transform* transform)
+{
+    if (transform == nullptr)
+        return;
+    transform->dx = t.dx;
+    transform->dy = t.dy;
+    transform->da = t.da;
+    const auto M = Stabilizer::CropMatrix(t, size);
+    for (int i = 0; i < 6; ++i)
+        transform->matrix[i] = M(i / 3, i % 3);
+}
+
+// Runs f, turning an exception into VSTAB_ERROR_INTERNAL.
+template<typename F>
+int Guarded(vstab_stabilizer* stabilizer, F f)
+{
+    try {
+        f();
+        return VSTAB_OK;
+    }
+    catch (const std::exception& ex) {
+        stabilizer->lastError = ex.what();
+    }
+    catch (...) {
+        stabilizer->lastError = "unknown exception";
+    }
+    return VSTAB_ERROR_INTERNAL;
+}
+
+} // namespace
+
+int vstab_version(void)
+{
+    return VSTAB_VERSION_MAJOR << 16 | VSTAB_VERSION_MINOR;
+}
+
+void vstab_default_options(vstab_options* options)
+{
+    if (options == nullptr)
+        return;
+    const StabilizerOptions defaults;
+    memset(options, 0, sizeof(*options));
+    options->struct_size = sizeof(*options);
+    options->analysis_height = defaults.analysisHeight;
+    options->max_corners = defaults.tracking.maxCorners;
+    options->detect_every_frame = !defaults.tracking.persistent;
+    options->ransac_threshold = defaults.estimation.threshold;
+    options->telemetry_path = nullptr;
+}
+
+vstab_stabilizer* vstab_create(const vstab_options* options)
+{
+    // a caller built against an older header passes a shorter struct, the rest keeps the defaults
+    vstab_options given;
+    vstab_default_options(&given);
+    if (options != nullptr) {
+        if (options->struct_size < offsetof(vstab_options, analysis_height))
+            return nullptr;
+        memcpy(&given, options, std::min(options->struct_size, sizeof(given)));
+    }
+
+    StabilizerOptions stabilizerOptions;
+    stabilizerOptions.analysisHeight = given.analysis_height;
+    stabilizerOptions.tracking.maxCorners = given.max_corners;
+    stabilizerOptions.tracking.persistent = !given.detect_every_frame;
+    stabilizerOptions.estimation.threshold = given.ransac_threshold;
+    if (given.telemetry_path != nullptr)
+        stabilizerOptions.telemetryPath = given.telemetry_path;
+
+    try {
+        std::unique_ptr<vstab_stabilizer> stabilizer(new vstab_stabilizer);
+        stabilizer->stabilizer.reset(new Stabilizer(stabilizerOptions));
+        return stabilizer.release();
+    }
+    catch (...) {
+        return nullptr;
+    }
+}
+
+void vstab_destroy(vstab_stabilizer* stabilizer)
+{
+    delete stabilizer;
+}
+
+int vstab_process(vstab_stabilizer* stabilizer, const vstab_image* in, const vstab_image* out,
+    vstab_transform* transform)
+{
+    if (stabilizer == nullptr || in == nullptr || out == nullptr)
+        return VSTAB_ERROR_INVALID_ARGUMENT;
+    if (out->format != in->format || out->width != in->width || out->height != in->height)
+        return VSTAB_ERROR_INVALID_ARGUMENT;
+
+    PlanarImage cur, result;
+    int ret = Wrap(in, cur);
+    if (ret == VSTAB_OK)
+        ret = Wrap(out, result);
+    if (ret != VSTAB_OK)
+        return ret;
+
+    return Guarded(stabilizer, [&] {
+        auto& impl = *stabilizer->stabilizer;
+        if (in->format == VSTAB_PIXEL_FORMAT_BGR24) {
+            const cv::Mat& frame = cur.planes[0];
+            impl(frame, result.planes[0]);
+        }
+        else
+            impl(cur, result);
+        Fill(impl.LastTransform(), cur.planes[0].size(), transform);
+    });
+}
+
+int vstab_estimate(vstab_stabilizer* stabilizer, const vstab_image* in, vstab_transform* transform)
+{
+    if (stabilizer == nullptr || transform == nullptr)
+        return VSTAB_ERROR_INVALID_ARGUMENT;
+
+    PlanarImage cur;
+    const int ret = Wrap(in, cur);
+    if (ret != VSTAB_OK)
+        return ret;
+
+    return Guarded(stabilizer, [&] {
+        auto& impl = *stabilizer->stabilizer;
+        TransformParam t(0, 0, 0);
+        cv::Matx23d M;
+        if (in->format == VSTAB_PIXEL_FORMAT_BGR24)
+            impl.Transform(cur.planes[0], t, M);
+        else
+            impl.Transform(cur, t, M);
+        Fill(t, cur.planes[0].size(), transform);
+    });
+}
+
+const char* vstab_last_error(const vstab_stabilizer* stabilizer)
+{
+    return stabilizer ? stabilizer->lastError.c_str() : "";
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+/*
+Public API of the video_stabilization library, for embedding the stabilizer in capture or transcode pipelines.
+It is plain C, so that the shared library keeps a stable ABI; C++ callers can use the vstab::Stabilizer wrapper
+at the end. Frames are passed as raw planes with strides and are never copied: the stabilized frame is written
+into buffers owned by the caller, or only the transformation is returned so that the caller warps the frame.
+
+    vstab_options options;
+    vstab_default_options(&options);
+    options.analysis_height = 360;
+    vstab_stabilizer* stabilizer = vstab_create(&options);
+    for (each frame)
+        vstab_process(stabilizer, &frame, &out, NULL);
+    vstab_destroy(stabilizer);
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32) && defined(VSTAB_SHARED)
+#ifdef VSTAB_BUILDING
+#define VSTAB_API __declspec(dllexport)
+#else
+#define VSTAB_API __declspec(dllimport)
+#endif
+#elif defined(__GNUC__) && defined(VSTAB_BUILDING)
+#define VSTAB_API __attribute__((visibility("default")))
+#else
+#define VSTAB_API
+#endif
+
+#define VSTAB_VERSION_MAJOR 1
+#define VSTAB_VERSION_MINOR 0
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Return codes. */
+enum
+{
+    VSTAB_OK = 0,
+    VSTAB_ERROR_INVALID_ARGUMENT = -1, /* null pointer, bad size or stride, formats or sizes that don't match */
+    VSTAB_ERROR_UNSUPPORTED_FORMAT = -2,
+    VSTAB_ERROR_INTERNAL = -3,         /* see vstab_last_error() */
+};
+
+/* Layouts of the frames; the YUV formats have a plane per component, chroma subsampled as named. */
+typedef enum vstab_pixel_format
+{
+    VSTAB_PIXEL_FORMAT_GRAY8 = 0,
+    VSTAB_PIXEL_FORMAT_YUV420P = 1,
+    VSTAB_PIXEL_FORMAT_YUV422P = 2,
+    VSTAB_PIXEL_FORMAT_YUV444P = 3,
+    VSTAB_PIXEL_FORMAT_BGR24 = 4, /* packed, a single plane */
+} vstab_pixel_format;
+
+/* A frame in memory owned by the caller. Only the planes of the format are read; strides are in bytes. */
+typedef struct vstab_image
+{
+    vstab_pixel_format format;
+    int width;
+    int height;
+    uint8_t* planes[3];
+    int strides[3];
+} vstab_image;
+
+typedef struct vstab_options
+{
+    size_t struct_size;         /* sizeof(vstab_options), set by vstab_default_options() */
+    int analysis_height;        /* motion is estimated on a grey proxy no taller than this, 0 for full size */
+    int max_corners;            /* features tracked per frame */
+    int detect_every_frame;     /* detect the features from scratch on every frame instead of tracking them */
+    double ransac_threshold;    /* inlier distance of the motion estimation, in analysis pixels */
+    const char* telemetry_path; /* per-frame motion records are written there if not NULL, see TelemetryDump */
+} vstab_options;
+
+typedef struct vstab_stabilizer vstab_stabilizer;
+
+/* Transformation of the previous frame: the rigid motion that moves it onto the smoothed trajectory, and the
+   matrix that applies it including the crop of the stabilisation border. The matrix maps coordinates of the
+   previous frame to the output, as for OpenCV's warpAffine(prev, out, matrix, size) with bilinear
+   interpolation and a black border. */
+typedef struct vstab_transform
+{
+    double dx;
+    double dy;
+    double da; /* radians */
+    double matrix[6]; /* 2x3, row major */
+} vstab_transform;
+
+VSTAB_API int vstab_version(void); /* VSTAB_VERSION_MAJOR << 16 | VSTAB_VERSION_MINOR */
+
+VSTAB_API void vstab_default_options(vstab_options* options);
+
+/* NULL options are the defaults. Returns NULL on failure. */
+VSTAB_API vstab_stabilizer* vstab_create(const vstab_options* options);
+VSTAB_API void vstab_destroy(vstab_stabilizer* stabilizer);
+
+/* Stabilizes a frame into out, which has the format and the size of in. The stabilizer outputs the previous
+   frame, warped (the first call copies in), and keeps referencing the planes of in until the next call, so the
+   caller must not overwrite them before. transform, if not NULL, receives the transformation that was applied,
+   with dx, dy and da 0 for the first frame. */
+VSTAB_API int vstab_process(vstab_stabilizer* stabilizer, const vstab_image* in, const vstab_image* out,
+    vstab_transform* transform);
+
+/* Only estimates the transformation of the frame passed on the previous call, which the caller then warps
+   itself; the planes of in are referenced until the next call as with vstab_process(). dx, dy and da are 0 for
+   the first frame. A stabilizer is used either with vstab_process() or with vstab_estimate(). */
+VSTAB_API int vstab_estimate(vstab_stabilizer* stabilizer, const vstab_image* in, vstab_transform* transform);
+
+/* Message of the last VSTAB_ERROR_INTERNAL of the stabilizer, "" if none. */
+VSTAB_API const char* vstab_last_error(const vstab_stabilizer* stabilizer);
+
+#ifdef __cplusplus
+}
+
+#include <stdexcept>
+#include <utility>
+
+namespace vstab {
+
+// Owns a vstab_stabilizer; header-only, so that nothing C++ crosses the library boundary.
+class Stabilizer
+{
+public:
+    explicit Stabilizer(const vstab_options* options = nullptr)
+        : m_stabilizer(vstab_create(options))
+    {
+        if (m_stabilizer == nullptr)
+            throw std::runtime_error("vstab_create failed");
+    }
+    ~Stabilizer() { vstab_destroy(m_stabilizer); }
+
+    Stabilizer(Stabilizer&& other) noexcept : m_stabilizer(std::exchange(other.m_stabilizer, nullptr)) {}
+    Stabilizer& operator=(Stabilizer&& other) noexcept
+    {
+        std::swap(m_stabilizer, other.m_stabilizer);
+        return *this;
+    }
+    Stabilizer(const Stabilizer&) = delete;
+    Stabilizer& operator=(const Stabilizer&) = delete;
+
+    // The return codes of vstab_process() and vstab_estimate().
+    int Process(const vstab_image& in, const vstab_image& out, vstab_transform* transform = nullptr)
+    {
+        return vstab_process(m_stabilizer, &in, &out, transform);
+    }
+    int Estimate(const vstab_image& in, vstab_transform& transform)
+    {
+        return vstab_estimate(m_stabilizer, &in, &transform);
+    }
+    const char* LastError() const { return vstab_last_error(m_stabilizer); }
+
+    vstab_stabilizer* get() const { return m_stabilizer; }
+
+private:
+    vstab_stabilizer* m_stabilizer;
+};
+
+} // namespace vstab
+#endif
@@ -0,0 +1,113 @@
+#include "Telemetry.h"
+
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+
+TelemetrySink::TelemetrySink(const std::string& path, size_t capacity)
+    : m_ring(capacity ? capacity : 1)
+{
+    m_file = fopen(path.c_str(), "wb");
+    if (m_file == nullptr) {
+        fprintf(stderr, "Could not open telemetry file '%s'\n", path.c_str());
+        return;
+    }
+
+    TelemetryFileHeader header{};
+    memcpy(header.magic, TELEMETRY_MAGIC, sizeof(header.magic));
+    header.version = TELEMETRY_VERSION;
+    header.record_size = sizeof(MotionRecord);
+    fwrite(&header, sizeof(header), 1, m_file);
+
+    m_writer = std::thread(&TelemetrySink::Run, this);
+}
+
+TelemetrySink::~TelemetrySink()
+{
+    if (m_file == nullptr)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_one();
+    m_writer.join();
+
+    fclose(m_file);
+
+    if (m_dropped > 0)
+        fprintf(stderr, "Telemetry: %zu records dropped\n", size_t(m_dropped));
+}
+
+void TelemetrySink::Push(const MotionRecord& record)
+{
+    if (m_file == nullptr)
+        return;
+
+    const size_t head = m_head.load(std::memory_order_relaxed);
+    if (head - m_tail.load(std::memory_order_acquire) == m_ring.size()) {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    m_ring[head % m_ring.size()] = record;
+    m_head.store(head + 1, std::memory_order_release);
+}
+
+void TelemetrySink::Run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        const bool stopping = m_stop;
+        lock.unlock();
+        WritePending();
+        lock.lock();
+        if (stopping)
+            break;
+        m_wake.wait_for(lock, std::chrono::milliseconds(50), [this] { return m_stop; });
+    }
+}
+
+void TelemetrySink::WritePending()
+{
+    const size_t tail = m_tail.load(std::memory_order_relaxed);
+    const size_t head = m_head.load(std::memory_order_acquire);
+    if (head == tail)
+        return;
+
+    // at most two contiguous runs because of the wrap-around
+    const size_t size = m_ring.size();
+    const size_t begin = tail % size;
+    const size_t count = head - tail;
+    const size_t first = std::min(count, size - begin);
+    fwrite(&m_ring[begin], sizeof(MotionRecord), first, m_file);
+    if (first < count)
+        fwrite(&m_ring[0], sizeof(MotionRecord), count - first, m_file);
+
+    m_tail.store(head, std::memory_order_release);
+}
+
+bool LoadTelemetry(const std::string& path, std::vector<MotionRecord>& records)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        fprintf(stderr, "Could not open telemetry file '%s'\n", path.c_str());
+        return false;
+    }
+
+    TelemetryFileHeader header{};
+    const bool ok = fread(&header, sizeof(header), 1, file) == 1
+        && memcmp(header.magic, TELEMETRY_MAGIC, sizeof(header.magic)) == 0
+        && header.version == TELEMETRY_VERSION
+        && header.record_size == sizeof(MotionRecord);
+    if (ok) {
+        records.clear();
+        MotionRecord record;
+        while (fread(&record, sizeof(record), 1, file) == 1)
+            records.push_back(record);
+    }
+    fclose(file);
+    if (!ok)
+        fprintf(stderr, "'%s' is not a supported telemetry file\n", path.c_str());
+    return ok;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Motion of one frame. A telemetry file is a TelemetryFileHeader followed by these records.
+struct MotionRecord
+{
+    int32_t frame;
+    int32_t tracked; // number of point pairs the transformation was estimated from
+    double dx, dy, da, ds; // previous to current frame transformation, ds the log of its scale
+    double x, y, a, s; // trajectory
+    double smoothed_x, smoothed_y, smoothed_a, smoothed_s; // smoothed trajectory
+    double new_dx, new_dy, new_da, new_ds; // new previous to current frame transformation
+};
+
+struct TelemetryFileHeader
+{
+    char magic[4]; // "VSTM"
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+};
+
+const char TELEMETRY_MAGIC[4] = { 'V', 'S', 'T', 'M' };
+const uint32_t TELEMETRY_VERSION = 2;
+
+// Reads all the records of a telemetry file written by TelemetrySink.
+bool LoadTelemetry(const std::string& path, std::vector<MotionRecord>& records);
+
+// Writes motion records to a binary file from a background thread. Push() only copies the record
+// into a single-producer ring buffer, so nothing is formatted or written on the frame path;
+// records are dropped, and counted, if the writer can't keep up.
+class TelemetrySink
+{
+public:
+    explicit TelemetrySink(const std::string& path, size_t capacity = 4096);
+    ~TelemetrySink();
+
+    TelemetrySink(const TelemetrySink&) = delete;
+    TelemetrySink& operator=(const TelemetrySink&) = delete;
+
+    bool IsOpen() const { return m_file != nullptr; }
+
+    // Must be called from one thread at a time.
+    void Push(const MotionRecord& record);
+
+    size_t Dropped() const { return m_dropped; }
+
+private:
+    void Run();
+    void WritePending();
+
+    FILE* m_file = nullptr;
+    std::vector<MotionRecord> m_ring;
+    std::atomic<size_t> m_head{ 0 };
+    std::atomic<size_t> m_tail{ 0 };
+    std::atomic<size_t> m_dropped{ 0 };
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    bool m_stop = false;
+    std::thread m_writer;
+};
@@ -0,0 +1,97 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+namespace {
+
+// the pool and the worker index of the current thread, if it is a pool worker
+thread_local const ThreadPool* t_pool = nullptr;
+thread_local unsigned int t_index = 0;
+
+}
+
+ThreadPool::ThreadPool(unsigned int threads)
+{
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (unsigned int i = 0; i < threads; ++i)
+        m_workers.emplace_back(new Worker);
+    for (unsigned int i = 0; i < threads; ++i)
+        m_threads.emplace_back(&ThreadPool::Run, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_wakeUp.notify_all();
+    for (auto& thread : m_threads)
+        thread.join();
+}
+
+void ThreadPool::Push(std::function<void()> task)
+{
+    const unsigned int index = (t_pool == this) ? t_index : m_next++ % m_workers.size();
+    // counted first, so that the count never drops below the number of queued tasks
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_pending;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_workers[index]->mutex);
+        m_workers[index]->tasks.push_back(std::move(task));
+    }
+    m_wakeUp.notify_one();
+}
+
+bool ThreadPool::TryPop(unsigned int index, std::function<void()>& task)
+{
+    auto& worker = *m_workers[index];
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    if (worker.tasks.empty())
+        return false;
+    task = std::move(worker.tasks.back());
+    worker.tasks.pop_back();
+    return true;
+}
+
+bool ThreadPool::TrySteal(unsigned int index, std::function<void()>& task)
+{
+    for (size_t i = 1; i < m_workers.size(); ++i) {
+        auto& victim = *m_workers[(index + i) % m_workers.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (victim.tasks.empty())
+            continue;
+        task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::Run(unsigned int index)
+{
+    t_pool = this;
+    t_index = index;
+
+    std::function<void()> task;
+    while (true) {
+        if (TryPop(index, task) || TrySteal(index, task)) {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                --m_pending;
+            }
+            task();
+            task = nullptr;
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_wakeUp.wait(lock, [this] { return m_stopping || m_pending > 0; });
+        if (m_stopping && m_pending == 0)
+            return;
+    }
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool: every worker has its own task deque, takes the newest task from it and,
+// once it runs dry, steals the oldest task of another worker. Tasks submitted from a worker go to its own
+// deque, tasks submitted from outside are dealt out round robin. The destructor runs the queued tasks.
+// A task must not block waiting for another task of the same pool.
+class ThreadPool
+{
+public:
+    // 0 threads means one per core
+    explicit ThreadPool(unsigned int threads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // The future rethrows an exception thrown by the task.
+    template<typename F>
+    auto Submit(F task) -> std::future<decltype(task())>
+    {
+        auto packaged = std::make_shared<std::packaged_task<decltype(task())()>>(std::move(task));
+        auto result = packaged->get_future();
+        Push([packaged] { (*packaged)(); });
+        return result;
+    }
+
+    unsigned int size() const { return unsigned(m_threads.size()); }
+
+private:
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    void Push(std::function<void()> task);
+    bool TryPop(unsigned int index, std::function<void()>& task);
+    bool TrySteal(unsigned int index, std::function<void()>& task);
+    void Run(unsigned int index);
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::vector<std::thread> m_threads;
+    std::atomic<unsigned int> m_next{ 0 };
+
+    std::mutex m_mutex;
+    std::condition_variable m_wakeUp;
+    size_t m_pending = 0;
+    bool m_stopping = false;
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+struct TransformParam
+{
+    TransformParam() = default;
+    TransformParam(double _dx, double _dy, double _da, double _ds = 0) {
+        dx = _dx;
+        dy = _dy;
+        da = _da;
+        ds = _ds;
+    }
+
+    double dx;
+    double dy;
+    double da; // angle
+    double ds = 0; // log of the scale, 0 unless the motion model is a similarity
+};
+
+
+struct Trajectory
+{
+    Trajectory() = default;
+    Trajectory(double _x, double _y, double _a, double _s) {
+        x = _x;
+        y = _y;
+        a = _a;
+        s = _s;
+    }
+    // "+"
+    friend Trajectory operator+(const Trajectory &c1, const Trajectory  &c2) {
+        return Trajectory(c1.x + c2.x, c1.y + c2.y, c1.a + c2.a, c1.s + c2.s);
+    }
+    //"-"
+    friend Trajectory operator-(const Trajectory &c1, const Trajectory  &c2) {
+        return Trajectory(c1.x - c2.x, c1.y - c2.y, c1.a - c2.a, c1.s - c2.s);
+    }
+    //"*"
+    friend Trajectory operator*(const Trajectory &c1, const Trajectory  &c2) {
+        return Trajectory(c1.x*c2.x, c1.y*c2.y, c1.a*c2.a, c1.s*c2.s);
+    }
+    //"/"
+    friend Trajectory operator/(const Trajectory &c1, const Trajectory  &c2) {
+        return Trajectory(c1.x / c2.x, c1.y / c2.y, c1.a / c2.a, c1.s / c2.s);
+    }
+    //"="
+    Trajectory operator =(const Trajectory &rx) {
+        x = rx.x;
+        y = rx.y;
+        a = rx.a;
+        s = rx.s;
+        return Trajectory(x, y, a, s);
+    }
+
+    double x;
+    double y;
+    double a; // angle
+    double s; // log of the scale
+};
@@ -4,6 +4,8 @@
 
 extern "C"
 {
+#include <libavutil/parseutils.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/timestamp.h>
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
@@ -11,8 +13,26 @@ extern "C"
 
 #include <opencv2/opencv.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <future>
+#include <map>
+#include <mutex>
+#include <thread>
 #include <vector>
 
+#include "AsyncIO.h"
+#include "BoundedQueue.h"
+#include "CodecOptions.h"
+#include "MatPool.h"
+#include "Metrics.h"
+#include "PlanarImage.h"
+#include "ThreadPool.h"
 #include "makeguard.h"
 
 struct AVFrameDeleter
@@ -22,229 +42,797 @@ struct AVFrameDeleter
 
 typedef std::unique_ptr<AVFrame, AVFrameDeleter> AVFramePtr;
 
-void ReportError(int ret)
+struct AVPacketDeleter
 {
-    char errBuf[AV_ERROR_MAX_STRING_SIZE]{};
-    fprintf(stderr, "Error occurred: %s\n", av_make_error_string(errBuf, AV_ERROR_MAX_STRING_SIZE, ret));
-}
+    void operator()(AVPacket *packet) const { av_packet_free(&packet); };
+};
 
+typedef std::unique_ptr<AVPacket, AVPacketDeleter> AVPacketPtr;
 
-int TransformVideo(const char *in_filename, const char *out_filename, std::function<void(cv::Mat&)>  callback)
+// Hands out objects that are reused once the pool holds the last reference to them, so that
+// the steady state of the pipeline doesn't allocate. Acquire() has to be called from a single thread.
+template<typename T, typename Deleter>
+class RecyclingPool
 {
-    AVFormatContext *input_format_context = NULL, *output_format_context = NULL;
+public:
+    // allocate creates a new object, recycle prepares an unreferenced one for reuse and may refuse it
+    RecyclingPool(std::function<T*()> allocate, std::function<bool(T*)> recycle)
+        : m_allocate(std::move(allocate)), m_recycle(std::move(recycle))
+    {
+    }
 
-    int ret;
-    int stream_index = 0;
+    std::shared_ptr<T> Acquire()
+    {
+        ++m_acquisitions;
+        for (const auto& object : m_objects) {
+            if (object.use_count() == 1 && m_recycle(object.get()))
+                return object;
+        }
+        std::shared_ptr<T> object(m_allocate(), Deleter());
+        if (object) {
+            m_objects.push_back(object);
+            ++m_allocations;
+        }
+        return object;
+    }
 
-    AVDictionary* opts = NULL;
+    size_t acquisitions() const { return m_acquisitions; }
+    size_t allocations() const { return m_allocations; }
 
+private:
+    std::function<T*()> m_allocate;
+    std::function<bool(T*)> m_recycle;
+    std::vector<std::shared_ptr<T>> m_objects;
+    size_t m_acquisitions = 0;
+    size_t m_allocations = 0;
+};
 
-    if ((ret = avformat_open_input(&input_format_context, in_filename, NULL, NULL)) < 0) {
-        fprintf(stderr, "Could not open input file '%s'", in_filename);
-        return 1;
-    }
+typedef RecyclingPool<AVFrame, AVFrameDeleter> AVFramePool;
+typedef RecyclingPool<AVPacket, AVPacketDeleter> AVPacketPool;
 
-    auto input_format_context_guard = MakeGuard(&input_format_context, avformat_close_input);
+// Unit of work passed between the pipeline stages: either a packet (a video packet to decode
+// or a packet of a stream-copied stream) or a video frame in one of its representations.
+struct PipelineItem
+{
+    std::shared_ptr<AVPacket> packet;
+    std::shared_ptr<AVFrame> frame;
+    cv::Mat image;
+    cv::Mat proxy;
+    int64_t pts = AV_NOPTS_VALUE;
+    int64_t pkt_dts = AV_NOPTS_VALUE;
+    std::future<void> estimation; // pairwise estimation ending at this frame, if any
+};
 
+// Number of tasks a run has in flight on a thread pool, so that it can wait for them before its state
+// goes away; a shared pool doesn't finish them on destruction as a pool of the run's own does.
+class PendingTasks
+{
+public:
+    void Add()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_count;
+    }
 
-    if ((ret = avformat_find_stream_info(input_format_context, NULL)) < 0) {
-        fprintf(stderr, "Failed to retrieve input stream information");
-        return 1;
+    void Done()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (--m_count == 0)
+            m_none.notify_all();
     }
 
-    avformat_alloc_output_context2(&output_format_context, NULL, NULL, out_filename);
-    if (!output_format_context) {
-        fprintf(stderr, "Could not create output context\n");
-        ret = AVERROR_UNKNOWN;
-        return 1;
+    void Wait()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_none.wait(lock, [this] { return m_count == 0; });
     }
 
-    auto output_format_context_guard = MakeGuard(output_format_context, avformat_free_context);
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_none;
+    size_t m_count = 0;
+};
 
-    const auto number_of_streams = input_format_context->nb_streams;
-    std::vector<int> streams_list(number_of_streams);
+// Arrival times of the video packets by pts, for the end-to-end latency of the frames.
+class LatencyTracker
+{
+public:
+    void Arrived(int64_t pts)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_arrivals[pts] = std::chrono::steady_clock::now();
+        // packets whose frames never leave, e.g. undecodable ones, are forgotten eventually
+        if (m_arrivals.size() > MAX_PENDING)
+            m_arrivals.erase(m_arrivals.begin());
+    }
 
+    // false if the arrival of pts is unknown
+    bool Left(int64_t pts, std::chrono::nanoseconds& latency)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const auto arrival = m_arrivals.find(pts);
+        if (arrival == m_arrivals.end())
+            return false;
+        latency = std::chrono::steady_clock::now() - arrival->second;
+        m_arrivals.erase(arrival);
+        return true;
+    }
 
-    int videoStreamNumber = -1;
-    AVStream* videoStream = nullptr;
-    AVStream* outputVideoStream = nullptr;
+private:
+    static const size_t MAX_PENDING = 1024;
 
-    for (int i = 0; i < input_format_context->nb_streams; i++) {
-        AVStream *out_stream;
-        AVStream *in_stream = input_format_context->streams[i];
-        AVCodecParameters *in_codecpar = in_stream->codecpar;
+    std::mutex m_mutex;
+    std::map<int64_t, std::chrono::steady_clock::time_point> m_arrivals;
+};
 
-        const bool isVideoStream = in_codecpar->codec_type == AVMEDIA_TYPE_VIDEO;
-        if (isVideoStream)
-        {
-            videoStreamNumber = i;
-            videoStream = in_stream;
-        }
-        else if (in_codecpar->codec_type != AVMEDIA_TYPE_AUDIO &&
-            in_codecpar->codec_type != AVMEDIA_TYPE_SUBTITLE) {
-            streams_list[i] = -1;
-            continue;
-        }
-        streams_list[i] = stream_index++;
-        out_stream = avformat_new_stream(output_format_context, NULL);
-        if (!out_stream) {
-            fprintf(stderr, "Failed allocating output stream\n");
-            ret = AVERROR_UNKNOWN;
-            return 1;
-        }
-        ret = avcodec_parameters_copy(out_stream->codecpar, in_codecpar);
-        if (ret < 0) {
-            fprintf(stderr, "Failed to copy codec parameters\n");
-            return 1;
-        }
+void ReportError(int ret)
+{
+    char errBuf[AV_ERROR_MAX_STRING_SIZE]{};
+    fprintf(stderr, "Error occurred: %s\n", av_make_error_string(errBuf, AV_ERROR_MAX_STRING_SIZE, ret));
+}
 
-        if (isVideoStream)
-        {
-            outputVideoStream = out_stream;
-        }
+// Grey or YUV with every component in its own 8-bit plane, e.g. yuv420p, yuvj422p, yuv444p.
+static bool IsPlanar8Bit(AVPixelFormat pix_fmt)
+{
+    const auto desc = av_pix_fmt_desc_get(pix_fmt);
+    if (desc == nullptr || (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL)))
+        return false;
+    if (desc->nb_components != 1 && desc->nb_components != 3)
+        return false;
+    for (int i = 0; i < desc->nb_components; ++i) {
+        if (desc->comp[i].plane != i || desc->comp[i].depth != 8 || desc->comp[i].step != 1)
+            return false;
     }
-    // https://ffmpeg.org/doxygen/trunk/group__lavf__misc.html#gae2645941f2dc779c307eb6314fd39f10
-    av_dump_format(output_format_context, 0, out_filename, 1);
+    return true;
+}
 
-    // unless it's a no file (we'll talk later about that) write to the disk (FLAG_WRITE)
-    // but basically it's a way to save the file to a buffer so you can store it
-    // wherever you want.
-    if (!(output_format_context->oformat->flags & AVFMT_NOFILE)) {
-        ret = avio_open(&output_format_context->pb, out_filename, AVIO_FLAG_WRITE);
-        if (ret < 0) {
-            fprintf(stderr, "Could not open output file '%s'", out_filename);
-            return 1;
-        }
-    }
+static_assert(CodecThreadFrame == FF_THREAD_FRAME && CodecThreadSlice == FF_THREAD_SLICE, "threading modes differ");
 
+static void SetThreading(AVCodecContext* codecContext, int threads, int threadType, bool lowDelay)
+{
+    codecContext->thread_count = threads;
+    // frame threading holds back a frame per thread
+    if (threadType == CodecThreadAuto && lowDelay)
+        threadType = CodecThreadSlice;
+    if (threadType != CodecThreadAuto)
+        codecContext->thread_type = threadType;
+}
 
-    // input video context
+// Opens a decoder for the stream with the threading of options, returns nullptr on failure.
+static AVCodecContext* OpenDecoder(const AVStream* stream, const TransformVideoOptions& options)
+{
     auto videoCodecContext = avcodec_alloc_context3(nullptr);
     if (!videoCodecContext)
-        return 1;
+        return nullptr;
 
     auto videoCodecContextGuard = MakeGuard(&videoCodecContext, avcodec_free_context);
 
-    if (avcodec_parameters_to_context(videoCodecContext, videoStream->codecpar) < 0)
-        return 1;
+    if (avcodec_parameters_to_context(videoCodecContext, stream->codecpar) < 0)
+        return nullptr;
 
     auto videoCodec = avcodec_find_decoder(videoCodecContext->codec_id);
     if (videoCodec == nullptr)
     {
         fprintf(stderr, "No such codec found");
-        return 1;  // Codec not found
+        return nullptr;  // Codec not found
     }
 
+    SetThreading(videoCodecContext, options.decoderThreads, options.decoderThreadType, options.live);
+    if (options.live)
+        videoCodecContext->flags |= AV_CODEC_FLAG_LOW_DELAY;
+
     // Open codec
     if (avcodec_open2(videoCodecContext, videoCodec, nullptr) < 0)
     {
         fprintf(stderr, "Error on codec opening");
-        return 1;  // Could not open codec
+        return nullptr;  // Could not open codec
     }
 
+    videoCodecContextGuard.release();
+    return videoCodecContext;
+}
+
+// The encoder named by name, either an encoder ("libx264") or a codec ("h264"), or the encoder of codec_id
+// if name is empty.
+static const AVCodec* FindEncoder(const std::string& name, AVCodecID codec_id)
+{
+    if (name.empty())
+        return avcodec_find_encoder(codec_id);
+    if (const auto encoder = avcodec_find_encoder_by_name(name.c_str()))
+        return encoder;
+    const auto descriptor = avcodec_descriptor_get_by_name(name.c_str());
+    return descriptor ? avcodec_find_encoder(descriptor->id) : nullptr;
+}
 
+// avformat_open_input, through AsyncInput if options ask for it and in_filename is a local file.
+static int OpenInput(AVFormatContext** input_format_context, const char* in_filename, AVDictionary** input_opts,
+    const TransformVideoOptions& options, std::unique_ptr<AsyncInput>& asyncInput)
+{
+    if (options.ioBufferSize > 0 || options.mapInput)
+        asyncInput = AsyncInput::Open(in_filename, options.ioBufferSize, options.mapInput, options.metrics);
+    if (asyncInput) {
+        *input_format_context = avformat_alloc_context();
+        if (!*input_format_context)
+            return AVERROR(ENOMEM);
+        (*input_format_context)->pb = asyncInput->Context();
+    }
+    return avformat_open_input(input_format_context, in_filename, NULL, input_opts);
+}
+
+// MP4 with faststart moves the index by reading back what was written, past a write-behind buffer.
+static bool ReadsBackOutput(const CodecOptionList& muxerOptions)
+{
+    for (const auto& option : muxerOptions) {
+        if (option.first == "movflags" && option.second.find("faststart") != std::string::npos)
+            return true;
+    }
+    return false;
+}
+
+static bool SupportsPixelFormat(const AVCodec* encoder, AVPixelFormat pix_fmt)
+{
+    if (encoder->pix_fmts == nullptr)
+        return true; // unknown, the encoder will tell
+    for (auto supported = encoder->pix_fmts; *supported != AV_PIX_FMT_NONE; ++supported) {
+        if (*supported == pix_fmt)
+            return true;
+    }
+    return false;
+}
+
+// Wraps the planes of the frame without copying.
+static PlanarImage WrapFrame(AVFrame* frame)
+{
+    const auto desc = av_pix_fmt_desc_get(AVPixelFormat(frame->format));
+
+    PlanarImage image;
+    image.numPlanes = desc->nb_components;
+    image.chromaShiftX = desc->log2_chroma_w;
+    image.chromaShiftY = desc->log2_chroma_h;
+    for (int i = 0; i < image.numPlanes; ++i) {
+        const int shift_x = (i == 0) ? 0 : image.chromaShiftX;
+        const int shift_y = (i == 0) ? 0 : image.chromaShiftY;
+        const int width = -((-frame->width) >> shift_x);
+        const int height = -((-frame->height) >> shift_y);
+        image.planes[i] = cv::Mat(height, width, CV_8UC1, frame->data[i], frame->linesize[i]);
+    }
+    return image;
+}
+
+
+// One encoded output of a run: its muxer and encoder, and the queues and the frame pool of the stages that scale
+// the stabilized frames to its size and encode them.
+struct OutputBranch
+{
+    OutputBranch(size_t queueCapacity, const std::string& suffix)
+        : stabilizedQueue(queueCapacity), outputQueue(queueCapacity)
+        , stabilizedName("stabilized" + suffix), outputName("output" + suffix), framesName("output frames" + suffix)
+        , convertName("convert back" + suffix), encodeName("encode" + suffix)
+    {
+    }
+
+    ~OutputBranch()
+    {
+        if (format_context) {
+            // the pb of an AsyncOutput is its own; one opened by avio_open is still open after a failure
+            if (!asyncOutput && !(format_context->oformat->flags & AVFMT_NOFILE))
+                avio_closep(&format_context->pb);
+            avformat_free_context(format_context);
+        }
+        avcodec_free_context(&enc_ctx);
+    }
+
+    OutputBranch(const OutputBranch&) = delete;
+    OutputBranch& operator=(const OutputBranch&) = delete;
+
+    std::unique_ptr<AsyncOutput> asyncOutput;
+    AVFormatContext* format_context = nullptr;
+    AVStream* videoStream = nullptr;
+    const AVCodec* encoder = nullptr;
+    AVCodecContext* enc_ctx = nullptr;
+
+    BoundedQueue<PipelineItem> stabilizedQueue;
+    BoundedQueue<PipelineItem> outputQueue;
+    std::unique_ptr<AVFramePool> framePool;
+    std::chrono::nanoseconds convertWallTime{ 0 };
+    std::chrono::nanoseconds encodeWallTime{ 0 };
+
+    // of its queues, pool and stages in the stats, numbered when there are several outputs
+    const std::string stabilizedName;
+    const std::string outputName;
+    const std::string framesName;
+    const std::string convertName;
+    const std::string encodeName;
+};
+
+// Sets up the output of rendition: the muxer, with the streams of streams_list (the video one and the copied ones),
+// and the encoder of the video scaled to the rendition's size; nothing is written yet, see StartOutput(). Prints
+// what failed and returns false.
+static bool OpenOutput(OutputBranch& output, const Rendition& rendition, AVFormatContext* input_format_context,
+    const std::vector<int>& streams_list, int videoStreamNumber, const AVCodecContext* videoCodecContext,
+    const TransformVideoOptions& options)
+{
+    const char* out_filename = rendition.filename.c_str();
+    int ret = 0;
+
+    avformat_alloc_output_context2(&output.format_context, NULL,
+        options.outputFormat.empty() ? NULL : options.outputFormat.c_str(), out_filename);
+    auto output_format_context = output.format_context;
+    if (!output_format_context) {
+        fprintf(stderr, "Could not create output context\n");
+        return false;
+    }
+
+    for (unsigned int i = 0; i < input_format_context->nb_streams; i++) {
+        if (streams_list[i] < 0)
+            continue;
+        AVStream *out_stream = avformat_new_stream(output_format_context, NULL);
+        if (!out_stream) {
+            fprintf(stderr, "Failed allocating output stream\n");
+            return false;
+        }
+        ret = avcodec_parameters_copy(out_stream->codecpar, input_format_context->streams[i]->codecpar);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to copy codec parameters\n");
+            return false;
+        }
+        if (int(i) == videoStreamNumber)
+            output.videoStream = out_stream;
+    }
+    auto outputVideoStream = output.videoStream;
 
     // output
-/* in this example, we choose transcoding to same codec */
-    auto encoder = avcodec_find_encoder(videoCodecContext->codec_id);
+    // the same codec as the input unless another encoder was chosen
+    auto encoder = FindEncoder(options.encoder, videoCodecContext->codec_id);
     if (!encoder) {
-        av_log(NULL, AV_LOG_FATAL, "Necessary encoder not found\n");
-        return 1;
+        if (options.encoder.empty())
+            av_log(NULL, AV_LOG_FATAL, "Necessary encoder not found\n");
+        else
+            av_log(NULL, AV_LOG_FATAL, "Encoder %s not found\n", options.encoder.c_str());
+        return false;
     }
-    auto enc_ctx = avcodec_alloc_context3(encoder);
+    output.encoder = encoder;
+    output.enc_ctx = avcodec_alloc_context3(encoder);
+    auto enc_ctx = output.enc_ctx;
     if (!enc_ctx) {
         av_log(NULL, AV_LOG_FATAL, "Failed to allocate the encoder context\n");
-        return 1;
+        return false;
     }
 
-    /* In this example, we transcode to same properties (picture size,
-     * sample rate etc.). These properties can be changed for output
-     * streams easily using filters */
-     // if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
-    enc_ctx->height = videoCodecContext->height;
-    enc_ctx->width = videoCodecContext->width;
+    // the input size unless the rendition scales it; a size left at 0 keeps the aspect ratio, rounded to even
+    int width = rendition.width;
+    int height = rendition.height;
+    if (width <= 0 && height <= 0) {
+        width = videoCodecContext->width;
+        height = videoCodecContext->height;
+    }
+    else if (width <= 0)
+        width = std::max(2, int(av_rescale(videoCodecContext->width, height, videoCodecContext->height)) & ~1);
+    else if (height <= 0)
+        height = std::max(2, int(av_rescale(videoCodecContext->height, width, videoCodecContext->width)) & ~1);
+    enc_ctx->height = height;
+    enc_ctx->width = width;
     enc_ctx->sample_aspect_ratio = videoCodecContext->sample_aspect_ratio;
+    if (width != videoCodecContext->width || height != videoCodecContext->height) {
+        // the display aspect ratio stays that of the input
+        const AVRational sar = videoCodecContext->sample_aspect_ratio.num > 0
+            ? videoCodecContext->sample_aspect_ratio : AVRational{ 1, 1 };
+        av_reduce(&enc_ctx->sample_aspect_ratio.num, &enc_ctx->sample_aspect_ratio.den,
+            int64_t(sar.num) * videoCodecContext->width * height, int64_t(sar.den) * videoCodecContext->height * width,
+            INT_MAX);
+    }
 
-    /* take first format from list of supported formats */
-    enc_ctx->pix_fmt = (encoder->pix_fmts != nullptr)? encoder->pix_fmts[0] : videoCodecContext->pix_fmt;
+    if (!options.pixelFormat.empty()) {
+        enc_ctx->pix_fmt = av_get_pix_fmt(options.pixelFormat.c_str());
+        if (enc_ctx->pix_fmt == AV_PIX_FMT_NONE || !SupportsPixelFormat(encoder, enc_ctx->pix_fmt)) {
+            av_log(NULL, AV_LOG_FATAL, "The %s encoder doesn't support pixel format %s\n",
+                encoder->name, options.pixelFormat.c_str());
+            return false;
+        }
+    }
+    /* keep the decoder format if the encoder supports it, otherwise take first format from list of supported formats */
+    else if (SupportsPixelFormat(encoder, videoCodecContext->pix_fmt))
+        enc_ctx->pix_fmt = videoCodecContext->pix_fmt;
+    else
+        enc_ctx->pix_fmt = encoder->pix_fmts[0];
     /* video time_base can be set to whatever is handy and supported by encoder */
     //enc_ctx->time_base = av_inv_q(m_videoCodecContext->framerate);
-    enc_ctx->time_base = videoStream->time_base;
+    enc_ctx->time_base = input_format_context->streams[videoStreamNumber]->time_base;
 
-    if (output_format_context->oformat->flags & AVFMT_GLOBALHEADER)
+    // spliced packets carry their parameter sets, the container keeps those of the input
+    if ((output_format_context->oformat->flags & AVFMT_GLOBALHEADER) && !(options.segment && options.segment->spliced))
         enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-    /* Third parameter can be used to pass settings to encoder */
-    ret = avcodec_open2(enc_ctx, encoder, NULL);
+    SetThreading(enc_ctx, options.encoderThreads, options.encoderThreadType, options.live);
+
+    // what the encoder doesn't consume is left in the dictionary; the rendition's options come last and win
+    AVDictionary* encoderOptions = MakeDictionary(options.encoderOptions);
+    auto encoderOptionsGuard = MakeGuard(&encoderOptions, av_dict_free);
+    for (const auto& option : rendition.encoderOptions)
+        av_dict_set(&encoderOptions, option.first.c_str(), option.second.c_str(), 0);
+    if (options.live) {
+        // every frame is output as soon as it is encoded
+        enc_ctx->max_b_frames = 0;
+        enc_ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+        SetDefaultOption(&encoderOptions, &encoder->priv_class, "tune", "zerolatency");
+    }
+    ret = avcodec_open2(enc_ctx, encoder, &encoderOptions);
     if (ret < 0) {
         av_log(NULL, AV_LOG_ERROR, "Cannot open video encoder for stream #%u\n", videoStreamNumber);
         ReportError(ret);
-        return 1;
+        return false;
     }
+    ReportUnusedOptions(encoderOptions, encoder->name);
     ret = avcodec_parameters_from_context(outputVideoStream->codecpar, enc_ctx);
     if (ret < 0) {
         av_log(NULL, AV_LOG_ERROR, "Failed to copy encoder parameters to output stream #%u\n", videoStreamNumber);
-        return 1;
+        return false;
     }
     outputVideoStream->time_base = enc_ctx->time_base;
 
+    if (options.encoderCallback)
+        options.encoderCallback(outputVideoStream->codecpar);
+
+    // output frames are reused once the encoder has released their buffers
+    output.framePool.reset(new AVFramePool(
+        [enc_ctx]() -> AVFrame* {
+            AVFramePtr frame(av_frame_alloc());
+            frame->format = enc_ctx->pix_fmt;
+            frame->width = enc_ctx->width;
+            frame->height = enc_ctx->height;
+            if (av_frame_get_buffer(frame.get(), 16) < 0)
+                return nullptr;
+            return frame.release();
+        },
+        [](AVFrame* frame) { return av_frame_is_writable(frame) != 0; }));
+    return true;
+}
+
+// Opens the file of an output set up by OpenOutput() and writes its header. Prints what failed and returns false.
+static bool StartOutput(OutputBranch& output, const char* out_filename, const TransformVideoOptions& options)
+{
+    const auto output_format_context = output.format_context;
+    int ret = 0;
+
+    // https://ffmpeg.org/doxygen/trunk/group__lavf__misc.html#gae2645941f2dc779c307eb6314fd39f10
+    av_dump_format(output_format_context, 0, out_filename, 1);
+
+    // unless it's a no file (we'll talk later about that) write to the disk (FLAG_WRITE)
+    // but basically it's a way to save the file to a buffer so you can store it
+    // wherever you want.
+    if (!(output_format_context->oformat->flags & AVFMT_NOFILE)) {
+        if (options.ioBufferSize > 0 && !ReadsBackOutput(options.muxerOptions))
+            output.asyncOutput = AsyncOutput::Open(out_filename, options.ioBufferSize, options.metrics);
+        if (output.asyncOutput)
+            output_format_context->pb = output.asyncOutput->Context();
+        else
+            ret = avio_open(&output_format_context->pb, out_filename, AVIO_FLAG_WRITE);
+        if (ret < 0) {
+            fprintf(stderr, "Could not open output file '%s'", out_filename);
+            return false;
+        }
+    }
 
-    //if (fragmented_mp4_options) {
-    //    // https://developer.mozilla.org/en-US/docs/Web/API/Media_Source_Extensions_API/Transcoding_assets_for_MSE
-    //    av_dict_set(&opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
-    //}
+    AVDictionary* opts = MakeDictionary(options.muxerOptions);
+    auto opts_guard = MakeGuard(&opts, av_dict_free);
+    if (options.live) {
+        // a pipe can't be seeked back to write the moov, so MP4 is fragmented, on every frame if the muxer can
+        // https://developer.mozilla.org/en-US/docs/Web/API/Media_Source_Extensions_API/Transcoding_assets_for_MSE
+        const auto muxerClass = &output_format_context->oformat->priv_class;
+        if (!SetDefaultOption(&opts, muxerClass, "movflags", "frag_every_frame+empty_moov+default_base_moof"))
+            SetDefaultOption(&opts, muxerClass, "movflags", "frag_keyframe+empty_moov+default_base_moof");
+        output_format_context->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+    }
     // https://ffmpeg.org/doxygen/trunk/group__lavf__encoding.html#ga18b7b10bb5b94c4842de18166bc677cb
     ret = avformat_write_header(output_format_context, &opts);
     if (ret < 0) {
         fprintf(stderr, "Error occurred when opening output file\n");
+        return false;
+    }
+    ReportUnusedOptions(opts, output_format_context->oformat->name);
+    return true;
+}
+
+// Closes an output whose run never started and removes its local file, which holds no more than a header.
+static void DiscardOutput(OutputBranch& output, const char* out_filename)
+{
+    const auto output_format_context = output.format_context;
+    // a file that couldn't be opened may be someone else's
+    const bool opened = output.asyncOutput || output_format_context->pb;
+    if (output.asyncOutput)
+        output.asyncOutput->Close();
+    else if (!(output_format_context->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&output_format_context->pb);
+    const char* local = LocalPath(out_filename);
+    if (opened && local)
+        remove(local);
+}
+
+
+int TransformVideo(const char *in_filename, const char *out_filename, std::function<void(cv::Mat&)>  callback,
+    const TransformVideoOptions& options)
+{
+    Rendition rendition;
+    rendition.filename = out_filename;
+    return TransformVideo(in_filename, std::vector<Rendition>{ rendition }, std::move(callback), options);
+}
+
+int TransformVideo(const char *in_filename, const std::vector<Rendition>& renditions,
+    std::function<void(cv::Mat&)> callback, const TransformVideoOptions& options)
+{
+    if (renditions.empty() || (options.segment && renditions.size() > 1)) {
+        fprintf(stderr, "Expected %s output\n", options.segment ? "a single" : "an");
+        return 1;
+    }
+
+    AVFormatContext *input_format_context = NULL;
+
+    int ret;
+    int stream_index = 0;
+
+    AVDictionary* input_opts = MakeDictionary(options.demuxerOptions);
+    auto input_opts_guard = MakeGuard(&input_opts, av_dict_free);
+    // hand out the packets as soon as they are read
+    if (options.live)
+        av_dict_set(&input_opts, "fflags", "nobuffer", AV_DICT_DONT_OVERWRITE);
+
+    // the context doesn't own a custom AVIOContext, it has to outlive it
+    std::unique_ptr<AsyncInput> asyncInput;
+    if ((ret = OpenInput(&input_format_context, in_filename, &input_opts, options, asyncInput)) < 0) {
+        fprintf(stderr, "Could not open input file '%s'", in_filename);
         return 1;
     }
 
-    AVFramePtr videoFrame(av_frame_alloc());
+    auto input_format_context_guard = MakeGuard(&input_format_context, avformat_close_input);
+    ReportUnusedOptions(input_opts, input_format_context->iformat->name);
 
-    AVFramePtr videoFrameOut(av_frame_alloc());
-    videoFrameOut->format = videoCodecContext->pix_fmt;
-    videoFrameOut->width = videoCodecContext->width;
-    videoFrameOut->height = videoCodecContext->height;
-    av_frame_get_buffer(videoFrameOut.get(), 16);
 
-    while (true) {
-        AVPacket packet;
+    if ((ret = avformat_find_stream_info(input_format_context, NULL)) < 0) {
+        fprintf(stderr, "Failed to retrieve input stream information");
+        return 1;
+    }
 
-        ret = av_read_frame(input_format_context, &packet);
-        if (ret < 0)
-            break;
-        const auto in_stream = input_format_context->streams[packet.stream_index];
-        if (packet.stream_index >= number_of_streams || streams_list[packet.stream_index] < 0) {
-            av_packet_unref(&packet);
-            continue;
-        }
-        packet.stream_index = streams_list[packet.stream_index];
-        const auto out_stream = output_format_context->streams[packet.stream_index];
+    const auto number_of_streams = input_format_context->nb_streams;
+    // the output stream of every input stream, the same in every output; -1 for the streams dropped
+    std::vector<int> streams_list(number_of_streams);
 
-        if (packet.stream_index == videoStreamNumber)
-        {
-            const int ret = avcodec_send_packet(videoCodecContext, &packet);
-            if (ret < 0)
-                return false;
 
-            while (avcodec_receive_frame(videoCodecContext, videoFrame.get()) == 0)
-            {
-                // transformation
+    int videoStreamNumber = -1;
+    AVStream* videoStream = nullptr;
 
-                AVPacket avEncodedPacket;
+    for (int i = 0; i < input_format_context->nb_streams; i++) {
+        AVStream *in_stream = input_format_context->streams[i];
+        AVCodecParameters *in_codecpar = in_stream->codecpar;
 
-                av_init_packet(&avEncodedPacket);
-                avEncodedPacket.data = NULL;
-                avEncodedPacket.size = 0;
+        const bool isVideoStream = in_codecpar->codec_type == AVMEDIA_TYPE_VIDEO;
+        if (isVideoStream)
+        {
+            videoStreamNumber = i;
+            videoStream = in_stream;
+        }
+        else if (options.segment || (in_codecpar->codec_type != AVMEDIA_TYPE_AUDIO &&
+            in_codecpar->codec_type != AVMEDIA_TYPE_SUBTITLE)) {
+            streams_list[i] = -1;
+            continue;
+        }
+        streams_list[i] = stream_index++;
+    }
+    if (!videoStream) {
+        fprintf(stderr, "No video stream found\n");
+        return 1;
+    }
+    // in segment mode the output context only tells how to set up the encoder
+    const bool writeOutput = !options.segment;
 
 
-                cv::Mat img(videoFrame->height, videoFrame->width, CV_8UC3);// , pFrameRGB->data[0]); //dst->data[0]);
+    // input video context
+    auto videoCodecContext = OpenDecoder(videoStream, options);
+    if (!videoCodecContext)
+        return 1;
 
-                int stride = img.step[0];
+    auto videoCodecContextGuard = MakeGuard(&videoCodecContext, avcodec_free_context);
 
+    // every rendition has a muxer and an encoder of its own, fed by stages of its own; all the encoders are set up
+    // before any file is written, and the files started are removed if another one can't be
+    std::vector<std::unique_ptr<OutputBranch>> outputs;
+    for (size_t i = 0; i < renditions.size(); ++i) {
+        const std::string suffix = (renditions.size() > 1) ? " " + std::to_string(i + 1) : std::string();
+        outputs.emplace_back(new OutputBranch(options.queueCapacity, suffix));
+        if (!OpenOutput(*outputs.back(), renditions[i], input_format_context, streams_list, videoStreamNumber,
+            videoCodecContext, options))
+            return 1;
+    }
+    for (size_t i = 0; writeOutput && i < outputs.size(); ++i) {
+        if (!StartOutput(*outputs[i], renditions[i].filename.c_str(), options)) {
+            for (size_t j = 0; j <= i; ++j)
+                DiscardOutput(*outputs[j], renditions[j].filename.c_str());
+            return 1;
+        }
+    }
 
-                auto img_convert_ctx = sws_getCachedContext(
-                    NULL,
+    if (options.segment && options.segment->seekPts != INT64_MIN) {
+        ret = av_seek_frame(input_format_context, videoStreamNumber, options.segment->seekPts, AVSEEK_FLAG_BACKWARD);
+        if (ret < 0) {
+            fprintf(stderr, "Could not seek to the segment start\n");
+            ReportError(ret);
+            return 1;
+        }
+    }
+
+    // the planar callback writes frames in the decoder format, which every encoder has to take as it is
+    const bool nativeYuv = options.planarCallback && IsPlanar8Bit(videoCodecContext->pix_fmt)
+        && std::all_of(outputs.begin(), outputs.end(), [&](const std::unique_ptr<OutputBranch>& output) {
+            return output->enc_ctx->pix_fmt == videoCodecContext->pix_fmt; });
+    if (options.planarCallback && !nativeYuv)
+        fprintf(stderr, "Pixel format %s can't be processed natively, converting to BGR24\n",
+            av_get_pix_fmt_name(videoCodecContext->pix_fmt));
+
+    // Pipeline: demux -> decode -> colour conversion -> stabilization -> colour conversion -> encode + mux.
+    // Every stage runs on its own thread; the stages are connected with bounded queues.
+    // Packets of the stream-copied streams travel in-band with the video, so the output keeps the input interleave.
+    // With several renditions the stabilized frames and the copied packets are handed to each of them, and the
+    // last two stages, which also scale the frames to the rendition's size, run once per rendition.
+    BoundedQueue<PipelineItem> packetQueue(options.queueCapacity);
+    BoundedQueue<PipelineItem> decodedQueue(options.queueCapacity);
+    BoundedQueue<PipelineItem> imageQueue(options.queueCapacity);
+    BoundedQueue<PipelineItem> estimatedQueue(std::max<size_t>(options.estimationWindow, 1));
+
+    std::atomic<bool> failed{ false };
+    std::exception_ptr stageException;
+    std::mutex stageExceptionMutex;
+
+    auto fail = [&] {
+        failed = true;
+        packetQueue.abort();
+        decodedQueue.abort();
+        imageQueue.abort();
+        estimatedQueue.abort();
+        for (auto& output : outputs) {
+            output->stabilizedQueue.abort();
+            output->outputQueue.abort();
+        }
+    };
+
+    // wall time of every stage thread, the stages are numbered in pipeline order; the outputs keep theirs
+    enum { Demux, Decode, ConvertToImage, Estimate, Stabilize, StageCount };
+    std::chrono::nanoseconds stageWallTime[StageCount]{};
+    // time the stabilize stage waited for the estimations, and the time the pool spent on them
+    std::chrono::nanoseconds estimationWaitTime{ 0 };
+    std::atomic<int64_t> estimationBusyNs{ 0 };
+
+    auto runStage = [&](auto stage, std::chrono::nanoseconds& wallTime) {
+        return std::thread([&, stage] {
+            const auto start = std::chrono::steady_clock::now();
+            try {
+                stage();
+            }
+            catch (...) {
+                {
+                    std::lock_guard<std::mutex> lock(stageExceptionMutex);
+                    if (!stageException)
+                        stageException = std::current_exception();
+                }
+                fail();
+            }
+            wallTime = std::chrono::steady_clock::now() - start;
+        });
+    };
+
+    // the pools are used by a single stage each
+    AVPacketPool packetPool(av_packet_alloc, [](AVPacket* packet) { av_packet_unref(packet); return true; });
+    AVFramePool decodedFramePool(av_frame_alloc, [](AVFrame* frame) { av_frame_unref(frame); return true; });
+    // frames the planar callback writes, reused once every encoder has released their buffers
+    AVFramePool stabilizedFramePool(
+        [&]() -> AVFrame* {
+            AVFramePtr frame(av_frame_alloc());
+            frame->format = videoCodecContext->pix_fmt;
+            frame->width = videoCodecContext->width;
+            frame->height = videoCodecContext->height;
+            if (av_frame_get_buffer(frame.get(), 16) < 0)
+                return nullptr;
+            return frame.release();
+        },
+        [](AVFrame* frame) { return av_frame_is_writable(frame) != 0; });
+    MatPool imagePool;
+    MatPool proxyPool;
+
+    const bool trackLatency = options.metrics || options.latencyCallback;
+    LatencyTracker latencyTracker;
+
+    auto demux = [&] {
+        while (true) {
+            auto packet = packetPool.Acquire();
+            int ret;
+            {
+                ScopedTimer timer(options.metrics, Stage::ReadFrame);
+                ret = av_read_frame(input_format_context, packet.get());
+            }
+            if (ret < 0)
+                break;
+            if (packet->stream_index >= number_of_streams || streams_list[packet->stream_index] < 0)
+                continue;
+            if (trackLatency && packet->stream_index == videoStreamNumber && packet->pts != AV_NOPTS_VALUE)
+                latencyTracker.Arrived(packet->pts);
+            PipelineItem item;
+            item.packet = std::move(packet);
+            if (!packetQueue.push(std::move(item)))
+                return;
+        }
+        packetQueue.close();
+    };
+
+    auto decode = [&] {
+        bool segmentEnd = false;
+        auto receiveFrames = [&] {
+            while (true) {
+                auto frame = decodedFramePool.Acquire();
+                {
+                    ScopedTimer timer(options.metrics, Stage::Decode);
+                    if (avcodec_receive_frame(videoCodecContext, frame.get()) != 0)
+                        return true;
+                }
+                if (options.metrics)
+                    options.metrics->Add(Counter::FramesDecoded);
+                if (options.segment && frame->pts != AV_NOPTS_VALUE && frame->pts >= options.segment->endPts) {
+                    segmentEnd = true;
+                    return false;
+                }
+                PipelineItem item;
+                item.frame = std::move(frame);
+                if (!decodedQueue.push(std::move(item)))
+                    return false;
+            }
+        };
+
+        PipelineItem item;
+        while (packetQueue.pop(item)) {
+            if (item.packet->stream_index != videoStreamNumber) {
+                if (!decodedQueue.push(std::move(item)))
+                    return;
+                continue;
+            }
+            int ret;
+            {
+                ScopedTimer timer(options.metrics, Stage::Decode);
+                ret = avcodec_send_packet(videoCodecContext, item.packet.get());
+            }
+            if (ret < 0) {
+                ReportError(ret);
+                continue;
+            }
+            if (!receiveFrames()) {
+                // the rest of the stream belongs to the next segment
+                if (segmentEnd) {
+                    packetQueue.abort();
+                    decodedQueue.close();
+                }
+                return;
+            }
+        }
+        if (failed)
+            return;
+
+        // drain the decoder
+        avcodec_send_packet(videoCodecContext, nullptr);
+        if (receiveFrames())
+            decodedQueue.close();
+    };
+
+    const bool useProxy = options.proxyCallback && options.proxyHeight > 0 && options.proxyHeight < videoCodecContext->height;
+    const int proxyWidth = useProxy
+        ? std::max(1, int(av_rescale(videoCodecContext->width, options.proxyHeight, videoCodecContext->height))) : 0;
+
+    auto convertToImage = [&] {
+        SwsContext* img_convert_ctx = nullptr;
+        auto img_convert_ctx_guard = MakeGuard(&img_convert_ctx, [](SwsContext** ctx) { sws_freeContext(*ctx); });
+        SwsContext* proxy_convert_ctx = nullptr;
+        auto proxy_convert_ctx_guard = MakeGuard(&proxy_convert_ctx, [](SwsContext** ctx) { sws_freeContext(*ctx); });
+
+        PipelineItem item;
+        while (decodedQueue.pop(item)) {
+            if (item.frame && !nativeYuv) {
+                ScopedTimer timer(options.metrics, Stage::Convert);
+                img_convert_ctx = sws_getCachedContext(
+                    img_convert_ctx,
                     videoCodecContext->width,
                     videoCodecContext->height,
                     videoCodecContext->pix_fmt,
@@ -252,118 +840,607 @@ int TransformVideo(const char *in_filename, const char *out_filename, std::funct
                     videoCodecContext->height,
                     AV_PIX_FMT_BGR24,
                     SWS_FAST_BILINEAR, NULL, NULL, NULL);
-                sws_scale(img_convert_ctx, videoFrame->data, videoFrame->linesize, 0, videoCodecContext->height, //pFrameRGB->data, pFrameRGB->linesize);
-                    //(uint8_t*)
-                    &img.data, //&videoFrame->width);
-                    &stride);
-
 
-                callback(img);
+                item.image = imagePool.Acquire(videoCodecContext->height, videoCodecContext->width, CV_8UC3);
+                int stride = item.image.step[0];
+                sws_scale(img_convert_ctx, item.frame->data, item.frame->linesize, 0, videoCodecContext->height,
+                    &item.image.data, &stride);
+
+                if (useProxy) {
+                    proxy_convert_ctx = sws_getCachedContext(
+                        proxy_convert_ctx,
+                        videoCodecContext->width,
+                        videoCodecContext->height,
+                        videoCodecContext->pix_fmt,
+                        proxyWidth,
+                        options.proxyHeight,
+                        AV_PIX_FMT_GRAY8,
+                        SWS_AREA, NULL, NULL, NULL);
+
+                    item.proxy = proxyPool.Acquire(options.proxyHeight, proxyWidth, CV_8UC1);
+                    int proxyStride = item.proxy.step[0];
+                    sws_scale(proxy_convert_ctx, item.frame->data, item.frame->linesize, 0, videoCodecContext->height,
+                        &item.proxy.data, &proxyStride);
+                }
 
+                item.pts = item.frame->pts;
+                item.pkt_dts = item.frame->pkt_dts;
+                item.frame.reset();
+            }
+            if (!imageQueue.push(std::move(item)))
+                return;
+        }
+        if (!failed)
+            imageQueue.close();
+    };
+
+    // the pool of the estimate stage, shared or only made when it is used
+    std::unique_ptr<ThreadPool> ownEstimationPool;
+    ThreadPool* estimationPool = options.estimationPool;
+    if (options.pairCallback && !estimationPool) {
+        ownEstimationPool.reset(new ThreadPool(options.estimationThreads));
+        estimationPool = ownEstimationPool.get();
+    }
+    PendingTasks pendingEstimations;
+    const cv::Size frameSize(videoCodecContext->width, videoCodecContext->height);
+
+    auto estimate = [&] {
+        // what the callbacks get for the previous frame, the captures keep its buffers from being reused
+        cv::Mat prevAnalysis;
+        std::shared_ptr<AVFrame> prevFrame;
+        int64_t index = 0;
+
+        PipelineItem item;
+        while (imageQueue.pop(item)) {
+            if (item.frame || !item.image.empty()) {
+                std::shared_ptr<AVFrame> frame = item.frame;
+                cv::Mat analysis;
+                if (!item.proxy.empty())
+                    analysis = item.proxy;
+                else if (!item.image.empty())
+                    analysis = item.image;
+                else
+                    analysis = WrapFrame(frame.get()).planes[0];
+
+                if (index > 0) {
+                    pendingEstimations.Add();
+                    item.estimation = estimationPool->Submit([&options, &estimationBusyNs, &pendingEstimations,
+                        frameSize, index, prevAnalysis, prevFrame, analysis, frame] {
+                        auto done = MakeGuard(&pendingEstimations, [](PendingTasks* pending) { pending->Done(); });
+                        const auto start = std::chrono::steady_clock::now();
+                        options.pairCallback(prevAnalysis, analysis, frameSize, index);
+                        estimationBusyNs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start).count();
+                    });
+                }
+                prevAnalysis = analysis;
+                prevFrame = std::move(frame);
+                ++index;
+            }
+            if (!estimatedQueue.push(std::move(item)))
+                return;
+        }
+        if (!failed)
+            estimatedQueue.close();
+    };
+
+    auto& stabilizeInput = options.pairCallback ? estimatedQueue : imageQueue;
+
+    auto stabilize = [&] {
+        // items waiting for the estimations of the following frames, lookaheadFrames of them frames
+        std::deque<PipelineItem> lookaheadItems;
+        size_t lookaheadFrames = 0;
+
+        auto process = [&](PipelineItem& item) {
+            // packets of the copied streams only pass through
+            if (!item.packet) {
+                ScopedTimer timer(options.metrics, Stage::Stabilize);
+                if (!item.proxy.empty()) {
+                    options.proxyCallback(item.image, item.proxy);
+                    item.proxy.release();
+                }
+                else if (!item.image.empty())
+                    callback(item.image);
+                else if (item.frame) {
+                    auto videoFrameOut = stabilizedFramePool.Acquire();
+                    if (!videoFrameOut) {
+                        fprintf(stderr, "Could not allocate output frame\n");
+                        fail();
+                        return false;
+                    }
+                    videoFrameOut->pts = item.frame->pts;
+                    videoFrameOut->pkt_dts = item.frame->pkt_dts;
 
-                auto reverse_convert_ctx = sws_getCachedContext(
-                    NULL,
-                    videoCodecContext->width,
-                    videoCodecContext->height,
-                    AV_PIX_FMT_BGR24,
-                    videoCodecContext->width,
-                    videoCodecContext->height,
-                    videoCodecContext->pix_fmt,
-                    SWS_FAST_BILINEAR, NULL, NULL, NULL);
+                    // the stabilizer keeps the decoded frame alive as the previous one through owner
+                    auto cur = WrapFrame(item.frame.get());
+                    cur.owner = item.frame;
+                    auto out = WrapFrame(videoFrameOut.get());
+                    options.planarCallback(cur, out);
 
-                sws_scale(reverse_convert_ctx,
-                    &img.data,
-                    &stride,
-                    //&videoFrame->width,
-                    0, videoCodecContext->height, //pFrameRGB->data, pFrameRGB->linesize);
-                    //(uint8_t*)
-                    videoFrameOut->data, videoFrameOut->linesize
-                );
+                    item.frame = std::move(videoFrameOut);
+                }
+            }
 
+            // the other outputs share the stabilized frame, or the copied packet, which none of them modifies
+            for (size_t i = 0; i + 1 < outputs.size(); ++i) {
+                PipelineItem shared;
+                shared.packet = item.packet;
+                shared.frame = item.frame;
+                shared.image = item.image;
+                shared.pts = item.pts;
+                shared.pkt_dts = item.pkt_dts;
+                if (!outputs[i]->stabilizedQueue.push(std::move(shared)))
+                    return false;
+            }
+            return outputs.back()->stabilizedQueue.push(std::move(item));
+        };
+
+        PipelineItem item;
+        while (stabilizeInput.pop(item)) {
+            // rethrows what the estimation threw
+            if (item.estimation.valid()) {
+                const auto start = std::chrono::steady_clock::now();
+                item.estimation.get();
+                estimationWaitTime += std::chrono::steady_clock::now() - start;
+            }
 
+            if (!item.packet)
+                ++lookaheadFrames;
+            lookaheadItems.push_back(std::move(item));
+            while (!lookaheadItems.empty() && (lookaheadItems.front().packet || lookaheadFrames > options.lookahead)) {
+                PipelineItem next = std::move(lookaheadItems.front());
+                lookaheadItems.pop_front();
+                if (!next.packet)
+                    --lookaheadFrames;
+                if (!process(next))
+                    return;
+            }
+        }
+        if (failed)
+            return;
 
-                videoFrameOut->pts = videoFrame->pts;
-                videoFrameOut->pkt_dts = videoFrame->pkt_dts;
+        // the last frames have nothing more to wait for
+        for (auto& next : lookaheadItems) {
+            if (!process(next))
+                return;
+        }
+        for (auto& output : outputs)
+            output->stabilizedQueue.close();
+    };
+
+    // scales the stabilized frames of one output to its size and pixel format
+    auto convertToFrame = [&](OutputBranch& output) {
+        const auto enc_ctx = output.enc_ctx;
+        SwsContext* reverse_convert_ctx = nullptr;
+        auto reverse_convert_ctx_guard = MakeGuard(&reverse_convert_ctx, [](SwsContext** ctx) { sws_freeContext(*ctx); });
+
+        PipelineItem item;
+        while (output.stabilizedQueue.pop(item)) {
+            // a planar frame the encoder takes as it is passes through
+            const bool scaleFrame = item.frame && !item.packet
+                && (item.frame->width != enc_ctx->width || item.frame->height != enc_ctx->height);
+            if (!item.image.empty() || scaleFrame) {
+                auto videoFrameOut = output.framePool->Acquire();
+                if (!videoFrameOut) {
+                    fprintf(stderr, "Could not allocate output frame\n");
+                    fail();
+                    return;
+                }
 
+                ScopedTimer timer(options.metrics, Stage::ConvertBack);
+                if (!item.image.empty()) {
+                    reverse_convert_ctx = sws_getCachedContext(
+                        reverse_convert_ctx,
+                        item.image.cols,
+                        item.image.rows,
+                        AV_PIX_FMT_BGR24,
+                        enc_ctx->width,
+                        enc_ctx->height,
+                        enc_ctx->pix_fmt,
+                        (item.image.cols == enc_ctx->width && item.image.rows == enc_ctx->height) ? SWS_FAST_BILINEAR : SWS_AREA,
+                        NULL, NULL, NULL);
+
+                    int stride = item.image.step[0];
+                    sws_scale(reverse_convert_ctx, &item.image.data, &stride, 0, item.image.rows,
+                        videoFrameOut->data, videoFrameOut->linesize);
+
+                    videoFrameOut->pts = item.pts;
+                    videoFrameOut->pkt_dts = item.pkt_dts;
+                }
+                else {
+                    // downscaling a ladder rendition, area averaging keeps the detail without aliasing
+                    reverse_convert_ctx = sws_getCachedContext(
+                        reverse_convert_ctx,
+                        item.frame->width,
+                        item.frame->height,
+                        AVPixelFormat(item.frame->format),
+                        enc_ctx->width,
+                        enc_ctx->height,
+                        enc_ctx->pix_fmt,
+                        SWS_AREA, NULL, NULL, NULL);
+
+                    sws_scale(reverse_convert_ctx, item.frame->data, item.frame->linesize, 0, item.frame->height,
+                        videoFrameOut->data, videoFrameOut->linesize);
+
+                    videoFrameOut->pts = item.frame->pts;
+                    videoFrameOut->pkt_dts = item.frame->pkt_dts;
+                }
 
-                auto ret = avcodec_send_frame(enc_ctx, videoFrameOut.get());
-                if (ret >= 0)
+                item.frame = std::move(videoFrameOut);
+                item.image.release();
+            }
+            if (!output.outputQueue.push(std::move(item)))
+                return;
+        }
+        if (!failed)
+            output.outputQueue.close();
+    };
+
+    // the end-to-end latency is that of the first output
+    auto encodeAndMux = [&](OutputBranch& output, bool tracksLatency) {
+        const auto enc_ctx = output.enc_ctx;
+        const auto output_format_context = output.format_context;
+        const auto outputVideoStream = output.videoStream;
+        AVPacketPtr avEncodedPacket(av_packet_alloc());
+        AVPacketPtr copiedPacket(av_packet_alloc());
+
+        auto receivePacket = [&] {
+            ScopedTimer timer(options.metrics, Stage::Encode);
+            return avcodec_receive_packet(enc_ctx, avEncodedPacket.get()) == 0;
+        };
+        auto sendFrame = [&](const AVFrame* frame) {
+            ScopedTimer timer(options.metrics, Stage::Encode);
+            return avcodec_send_frame(enc_ctx, frame) >= 0;
+        };
+
+        auto writeEncodedPackets = [&] {
+            while (receivePacket())
+            {
+                // the encoder works in the time base of the input stream, so this is the pts of the packet read
+                const int64_t inputPts = avEncodedPacket->pts;
+                if (avEncodedPacket->pts != AV_NOPTS_VALUE)
+                    avEncodedPacket->pts = av_rescale_q(avEncodedPacket->pts, enc_ctx->time_base, outputVideoStream->time_base);
+                if (avEncodedPacket->dts != AV_NOPTS_VALUE)
+                    avEncodedPacket->dts = av_rescale_q(avEncodedPacket->dts, enc_ctx->time_base, outputVideoStream->time_base);
+                avEncodedPacket->stream_index = outputVideoStream->index;
+
+                // outContainer is "mp4"
                 {
-                    while (!(ret = avcodec_receive_packet(enc_ctx, &avEncodedPacket)))
-                        //if (!ret)
-                    {
-                        if (avEncodedPacket.pts != AV_NOPTS_VALUE)
-                            avEncodedPacket.pts = av_rescale_q(avEncodedPacket.pts, enc_ctx->time_base, outputVideoStream->time_base);
-                        if (avEncodedPacket.dts != AV_NOPTS_VALUE)
-                            avEncodedPacket.dts = av_rescale_q(avEncodedPacket.dts, enc_ctx->time_base, outputVideoStream->time_base);
-
-                        // outContainer is "mp4"
-                        av_write_frame(output_format_context, &avEncodedPacket);
-
-                        //av_free_packet(&encodedPacket);
-                    }
+                    ScopedTimer timer(options.metrics, Stage::Mux);
+                    if (options.packetCallback)
+                        options.packetCallback(avEncodedPacket.get());
+                    else
+                        av_write_frame(output_format_context, avEncodedPacket.get());
+                }
+                av_packet_unref(avEncodedPacket.get());
+
+                std::chrono::nanoseconds latency;
+                if (tracksLatency && inputPts != AV_NOPTS_VALUE && latencyTracker.Left(inputPts, latency)) {
+                    if (options.metrics)
+                        options.metrics->Record(Stage::EndToEnd, latency);
+                    if (options.latencyCallback)
+                        options.latencyCallback(inputPts, std::chrono::duration<double>(latency).count());
                 }
+            }
+        };
+
+        PipelineItem item;
+        while (output.outputQueue.pop(item)) {
+            if (item.packet) {
+                /* copy packet */
+                // the packet read may go to several outputs, each one rescales and writes a reference of its own
+                if (av_packet_ref(copiedPacket.get(), item.packet.get()) < 0) {
+                    fprintf(stderr, "Error muxing packet\n");
+                    fail();
+                    return;
+                }
+                AVPacket* packet = copiedPacket.get();
+                const auto in_stream = input_format_context->streams[packet->stream_index];
+                packet->stream_index = streams_list[packet->stream_index];
+                const auto out_stream = output_format_context->streams[packet->stream_index];
+
+                packet->pts = av_rescale_q_rnd(packet->pts, in_stream->time_base, out_stream->time_base, AVRounding(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+                packet->dts = av_rescale_q_rnd(packet->dts, in_stream->time_base, out_stream->time_base, AVRounding(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+                packet->duration = av_rescale_q(packet->duration, in_stream->time_base, out_stream->time_base);
+                // https://ffmpeg.org/doxygen/trunk/structAVPacket.html#ab5793d8195cf4789dfb3913b7a693903
+                packet->pos = -1;
+
+                //https://ffmpeg.org/doxygen/trunk/group__lavf__encoding.html#ga37352ed2c63493c38219d935e71db6c1
+                int ret;
+                {
+                    ScopedTimer timer(options.metrics, Stage::Mux);
+                    ret = av_interleaved_write_frame(output_format_context, packet);
+                }
+                av_packet_unref(packet);
+                if (ret < 0) {
+                    fprintf(stderr, "Error muxing packet\n");
+                    fail();
+                    return;
+                }
+                continue;
+            }
 
+            // the frames before the segment start were only decoded to warm up the callback
+            if (options.segment && item.frame->pts != AV_NOPTS_VALUE && item.frame->pts < options.segment->startPts)
+                continue;
 
+            if (sendFrame(item.frame.get())) {
+                if (options.metrics)
+                    options.metrics->Add(Counter::FramesEncoded);
+                writeEncodedPackets();
             }
         }
-        else
+        if (failed)
+            return;
+
+        // flush encoder
+        if (output.encoder->capabilities & AV_CODEC_CAP_DELAY)
         {
-            /* copy packet */
-            packet.pts = av_rescale_q_rnd(packet.pts, in_stream->time_base, out_stream->time_base, AVRounding(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
-            packet.dts = av_rescale_q_rnd(packet.dts, in_stream->time_base, out_stream->time_base, AVRounding(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
-            packet.duration = av_rescale_q(packet.duration, in_stream->time_base, out_stream->time_base);
-            // https://ffmpeg.org/doxygen/trunk/structAVPacket.html#ab5793d8195cf4789dfb3913b7a693903
-            packet.pos = -1;
-
-            //https://ffmpeg.org/doxygen/trunk/group__lavf__encoding.html#ga37352ed2c63493c38219d935e71db6c1
-            ret = av_interleaved_write_frame(output_format_context, &packet);
-            if (ret < 0) {
-                fprintf(stderr, "Error muxing packet\n");
-                break;
+            if (sendFrame(nullptr))
+                writeEncodedPackets();
+        }
+    };
+
+    auto queueFill = [&] {
+        std::vector<QueueFill> fill{
+            { "packets", packetQueue.size(), packetQueue.capacity() },
+            { "decoded", decodedQueue.size(), decodedQueue.capacity() },
+            { "images", imageQueue.size(), imageQueue.capacity() },
+            { "estimated", estimatedQueue.size(), estimatedQueue.capacity() },
+        };
+        for (const auto& output : outputs) {
+            fill.push_back({ output->stabilizedName.c_str(), output->stabilizedQueue.size(), output->stabilizedQueue.capacity() });
+            fill.push_back({ output->outputName.c_str(), output->outputQueue.size(), output->outputQueue.capacity() });
+        }
+        // in bytes
+        if (asyncInput)
+            fill.push_back({ "read-ahead", asyncInput->Buffered(), asyncInput->Capacity() });
+        for (const auto& output : outputs) {
+            if (output->asyncOutput)
+                fill.push_back({ "write-behind", output->asyncOutput->Buffered(), output->asyncOutput->Capacity() });
+        }
+        return fill;
+    };
+
+    std::mutex monitorMutex;
+    std::condition_variable monitorCondition;
+    bool pipelineDone = false;
+    std::thread monitor;
+    if (options.queueStatsCallback) {
+        monitor = std::thread([&] {
+            std::unique_lock<std::mutex> lock(monitorMutex);
+            while (!monitorCondition.wait_for(lock, std::chrono::milliseconds(options.statsIntervalMs),
+                [&] { return pipelineDone; })) {
+                lock.unlock();
+                options.queueStatsCallback(queueFill());
+                lock.lock();
             }
+        });
+    }
+
+    std::vector<std::thread> stages;
+    stages.push_back(runStage(demux, stageWallTime[Demux]));
+    stages.push_back(runStage(decode, stageWallTime[Decode]));
+    stages.push_back(runStage(convertToImage, stageWallTime[ConvertToImage]));
+    if (options.pairCallback)
+        stages.push_back(runStage(estimate, stageWallTime[Estimate]));
+    stages.push_back(runStage(stabilize, stageWallTime[Stabilize]));
+    for (auto& output : outputs) {
+        OutputBranch* branch = output.get();
+        const bool tracksLatency = trackLatency && branch == outputs.front().get();
+        stages.push_back(runStage([&, branch] { convertToFrame(*branch); }, branch->convertWallTime));
+        stages.push_back(runStage([&, branch, tracksLatency] { encodeAndMux(*branch, tracksLatency); },
+            branch->encodeWallTime));
+    }
+    for (auto& stage : stages)
+        stage.join();
+    // after a failure estimations may still be queued, and they reference this run
+    pendingEstimations.Wait();
+
+    if (monitor.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(monitorMutex);
+            pipelineDone = true;
         }
-        av_packet_unref(&packet);
+        monitorCondition.notify_one();
+        monitor.join();
     }
 
-    // flush encoder
-    if (videoCodec->capabilities & AV_CODEC_CAP_DELAY)
-    {
-        AVPacket avEncodedPacket;
+    if (options.poolStatsCallback) {
+        std::vector<PoolStats> pools{
+            { "packets", packetPool.acquisitions(), packetPool.allocations() },
+            { "decoded frames", decodedFramePool.acquisitions(), decodedFramePool.allocations() },
+            { "images", imagePool.acquisitions(), imagePool.allocations() },
+            { "proxies", proxyPool.acquisitions(), proxyPool.allocations() },
+            { "stabilized frames", stabilizedFramePool.acquisitions(), stabilizedFramePool.allocations() },
+        };
+        for (const auto& output : outputs)
+            pools.push_back({ output->framesName.c_str(), output->framePool->acquisitions(), output->framePool->allocations() });
+        options.poolStatsCallback(pools);
+    }
 
-        av_init_packet(&avEncodedPacket);
-        avEncodedPacket.data = NULL;
-        avEncodedPacket.size = 0;
+    if (options.stageTimesCallback) {
+        // every queue has a single producer and a single consumer stage
+        auto stageTime = [&](const char* name, std::chrono::nanoseconds wallTime, std::chrono::nanoseconds waiting) {
+            const std::chrono::duration<double> wall = wallTime;
+            const std::chrono::duration<double> waited = waiting;
+            return StageTime{ name, std::max(0., (wall - waited).count()), waited.count() };
+        };
+        std::vector<StageTime> times{
+            stageTime("demux", stageWallTime[Demux], packetQueue.pushWaitTime()),
+            stageTime("decode", stageWallTime[Decode], packetQueue.popWaitTime() + decodedQueue.pushWaitTime()),
+            stageTime("convert", stageWallTime[ConvertToImage], decodedQueue.popWaitTime() + imageQueue.pushWaitTime()),
+        };
+        if (options.pairCallback) {
+            times.push_back(stageTime("estimate", stageWallTime[Estimate],
+                imageQueue.popWaitTime() + estimatedQueue.pushWaitTime()));
+            times.push_back({ "estimation pool", estimationBusyNs * 1e-9, 0 });
+        }
+        std::chrono::nanoseconds stabilizedPushWaitTime{ 0 };
+        for (const auto& output : outputs)
+            stabilizedPushWaitTime += output->stabilizedQueue.pushWaitTime();
+        times.push_back(stageTime("stabilize", stageWallTime[Stabilize],
+            stabilizeInput.popWaitTime() + stabilizedPushWaitTime + estimationWaitTime));
+        for (const auto& output : outputs) {
+            times.push_back(stageTime(output->convertName.c_str(), output->convertWallTime,
+                output->stabilizedQueue.popWaitTime() + output->outputQueue.pushWaitTime()));
+            times.push_back(stageTime(output->encodeName.c_str(), output->encodeWallTime, output->outputQueue.popWaitTime()));
+        }
+        options.stageTimesCallback(times);
+    }
 
-        while ((ret = avcodec_send_frame(enc_ctx, nullptr)) >= 0)
-        {
-            //auto ret = avcodec_send_frame(enc_ctx, nullptr);
-            //if (ret >= 0)
-            {
-                //ret = avcodec_receive_packet(enc_ctx, &avEncodedPacket);
-                //if (!ret)
-                while (!(ret = avcodec_receive_packet(enc_ctx, &avEncodedPacket)))
-                {
-                    if (avEncodedPacket.pts != AV_NOPTS_VALUE)
-                        avEncodedPacket.pts = av_rescale_q(avEncodedPacket.pts, enc_ctx->time_base, outputVideoStream->time_base);
-                    if (avEncodedPacket.dts != AV_NOPTS_VALUE)
-                        avEncodedPacket.dts = av_rescale_q(avEncodedPacket.dts, enc_ctx->time_base, outputVideoStream->time_base);
+    for (size_t i = 0; i < outputs.size(); ++i) {
+        auto& output = *outputs[i];
+        //https://ffmpeg.org/doxygen/trunk/group__lavf__encoding.html#ga7f14007e7dc8f481f054b21614dfec13
+        if (writeOutput)
+            av_write_trailer(output.format_context);
 
-                    // outContainer is "mp4"
-                    av_write_frame(output_format_context, &avEncodedPacket);
+        if (output.asyncOutput) {
+            if (!output.asyncOutput->Close()) {
+                fprintf(stderr, "Error writing output file '%s'\n", renditions[i].filename.c_str());
+                failed = true;
+            }
+        }
+        else if (writeOutput && !(output.format_context->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&output.format_context->pb);
+    }
+
+    if (stageException)
+        std::rethrow_exception(stageException);
+
+    return failed ? 1 : 0;
+}
+
+int AnalyzeVideo(const char *in_filename, std::function<void(const PlanarImage&)> callback,
+    const TransformVideoOptions& options)
+{
+    AVFormatContext *input_format_context = NULL;
+
+    std::unique_ptr<AsyncInput> asyncInput;
+    if (OpenInput(&input_format_context, in_filename, NULL, options, asyncInput) < 0) {
+        fprintf(stderr, "Could not open input file '%s'", in_filename);
+        return 1;
+    }
+
+    auto input_format_context_guard = MakeGuard(&input_format_context, avformat_close_input);
+
+    if (avformat_find_stream_info(input_format_context, NULL) < 0) {
+        fprintf(stderr, "Failed to retrieve input stream information");
+        return 1;
+    }
+
+    // the stream TransformVideo picks, the last video one
+    int videoStreamNumber = -1;
+    for (unsigned int i = 0; i < input_format_context->nb_streams; i++) {
+        if (input_format_context->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+            videoStreamNumber = i;
+    }
+    if (videoStreamNumber < 0) {
+        fprintf(stderr, "No video stream found\n");
+        return 1;
+    }
 
-                    //av_free_packet(&encodedPacket);
+    auto videoCodecContext = OpenDecoder(input_format_context->streams[videoStreamNumber], options);
+    if (!videoCodecContext)
+        return 1;
+
+    auto videoCodecContextGuard = MakeGuard(&videoCodecContext, avcodec_free_context);
+
+    // demux and decode on a worker thread, so that decoding overlaps the analysis
+    BoundedQueue<std::shared_ptr<AVFrame>> frameQueue(options.queueCapacity);
+    AVFramePool decodedFramePool(av_frame_alloc, [](AVFrame* frame) { av_frame_unref(frame); return true; });
+
+    std::thread decoder([&] {
+        AVPacketPtr packet(av_packet_alloc());
+
+        auto receiveFrames = [&] {
+            while (true) {
+                auto frame = decodedFramePool.Acquire();
+                {
+                    ScopedTimer timer(options.metrics, Stage::Decode);
+                    if (avcodec_receive_frame(videoCodecContext, frame.get()) != 0)
+                        return true;
                 }
+                if (options.metrics)
+                    options.metrics->Add(Counter::FramesDecoded);
+                if (!frameQueue.push(std::move(frame)))
+                    return false;
             }
-
+        };
+
+        auto readFrame = [&] {
+            ScopedTimer timer(options.metrics, Stage::ReadFrame);
+            return av_read_frame(input_format_context, packet.get()) >= 0;
+        };
+        auto sendPacket = [&] {
+            ScopedTimer timer(options.metrics, Stage::Decode);
+            return avcodec_send_packet(videoCodecContext, packet.get());
+        };
+
+        while (readFrame()) {
+            const bool isVideoPacket = packet->stream_index == videoStreamNumber;
+            const int ret = isVideoPacket ? sendPacket() : 0;
+            av_packet_unref(packet.get());
+            if (ret < 0)
+                ReportError(ret);
+            else if (isVideoPacket && !receiveFrames())
+                return;
         }
-    }
 
-    //https://ffmpeg.org/doxygen/trunk/group__lavf__encoding.html#ga7f14007e7dc8f481f054b21614dfec13
-    av_write_trailer(output_format_context);
+        // drain the decoder
+        avcodec_send_packet(videoCodecContext, nullptr);
+        if (receiveFrames())
+            frameQueue.close();
+    });
+
+    SwsContext* grey_convert_ctx = nullptr;
+    auto grey_convert_ctx_guard = MakeGuard(&grey_convert_ctx, [](SwsContext** ctx) { sws_freeContext(*ctx); });
+    MatPool greyPool;
+
+    try {
+        std::shared_ptr<AVFrame> frame;
+        while (frameQueue.pop(frame)) {
+            PlanarImage image;
+            if (IsPlanar8Bit(AVPixelFormat(frame->format))) {
+                // the luma plane is the grey image, no conversion needed
+                image = WrapFrame(frame.get());
+                image.owner = frame;
+            }
+            else {
+                ScopedTimer timer(options.metrics, Stage::Convert);
+                grey_convert_ctx = sws_getCachedContext(
+                    grey_convert_ctx,
+                    frame->width,
+                    frame->height,
+                    AVPixelFormat(frame->format),
+                    frame->width,
+                    frame->height,
+                    AV_PIX_FMT_GRAY8,
+                    SWS_FAST_BILINEAR, NULL, NULL, NULL);
 
-    if (output_format_context && !(output_format_context->oformat->flags & AVFMT_NOFILE))
-        avio_closep(&output_format_context->pb);
+                image.numPlanes = 1;
+                image.planes[0] = greyPool.Acquire(frame->height, frame->width, CV_8UC1);
+                int stride = image.planes[0].step[0];
+                sws_scale(grey_convert_ctx, frame->data, frame->linesize, 0, frame->height,
+                    &image.planes[0].data, &stride);
+            }
+            frame.reset();
 
+            ScopedTimer timer(options.metrics, Stage::Stabilize);
+            callback(image);
+        }
+    }
+    catch (...) {
+        frameQueue.abort();
+        decoder.join();
+        throw;
+    }
+
+    decoder.join();
     return 0;
 }
+
+bool ParseTime(const char* text, int64_t& time)
+{
+    return av_parse_time(&time, text, 1) >= 0;
+}
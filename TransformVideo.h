@@ -1,11 +1,206 @@
 #pragma once
 
+#include <cstdint>
 #include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace cv {
-    
+
 class Mat;
+template<typename T> class Size_;
+typedef Size_<int> Size;
 
 }
 
-int TransformVideo(const char *in_filename, const char *out_filename, std::function<void(cv::Mat&)>  callback);
+struct AVCodecParameters;
+struct AVPacket;
+struct PlanarImage;
+class Metrics;
+class ThreadPool;
+
+struct QueueFill
+{
+    const char* name;
+    size_t size;
+    size_t capacity;
+};
+
+struct PoolStats
+{
+    const char* name;
+    size_t acquisitions;
+    size_t allocations; // stays constant once the pipeline has warmed up
+};
+
+// Time a pipeline stage spent over the whole run. busy excludes the time the stage was blocked on its
+// queues, or waiting for the pairwise estimations, which is counted in waiting.
+struct StageTime
+{
+    const char* name;
+    double busySeconds;
+    double waitingSeconds;
+};
+
+// Threading modes of a libavcodec decoder or encoder (the values of FF_THREAD_FRAME and FF_THREAD_SLICE).
+enum CodecThreadType
+{
+    CodecThreadAuto = 0, // whatever the codec supports
+    CodecThreadFrame = 1,
+    CodecThreadSlice = 2,
+};
+
+// key=value options of a codec or a muxer, as given to ffmpeg on the command line, e.g. { "preset", "fast" }.
+typedef std::vector<std::pair<std::string, std::string>> CodecOptionList;
+
+// A piece of the video stream processed on its own, timestamps are in the stream time base.
+struct VideoSegment
+{
+    int64_t seekPts;  // decoding starts at the keyframe at or before this, INT64_MIN for the start of the stream
+    int64_t startPts; // frames before this only feed the callback, so that the stabilizer is warmed up
+    int64_t endPts;   // decoding stops at the first frame at or after this, INT64_MAX for the end of the stream
+    // The packets replace part of the input stream rather than a whole one, see TransformVideoRange(): the encoder
+    // repeats its parameter sets on every keyframe instead of putting them into a global header.
+    bool spliced = false;
+};
+
+// One output of an encoding ladder: the file, the size the stabilized video is scaled to, and the encoder options
+// of this output on top of the shared ones. A width or height of 0 keeps the aspect ratio, both 0 the input size.
+struct Rendition
+{
+    std::string filename;
+    int width = 0;
+    int height = 0;
+    CodecOptionList encoderOptions;
+};
+
+struct TransformVideoOptions
+{
+    // Capacity of each queue between the pipeline stages, in items.
+    size_t queueCapacity = 8;
+
+    // Called from a monitor thread every statsIntervalMs with the fill level of each queue.
+    std::function<void(const std::vector<QueueFill>&)> queueStatsCallback;
+    int statsIntervalMs = 1000;
+
+    // Called at the end of the run with the usage of the frame and packet pools.
+    std::function<void(const std::vector<PoolStats>&)> poolStatsCallback;
+
+    // Called at the end of the run with the time of every pipeline stage. The estimations run on the pool are
+    // reported as one more stage, "estimation pool", whose busy time is summed over its threads.
+    std::function<void(const std::vector<StageTime>&)> stageTimesCallback;
+
+    // If set, every call of the pipeline steps (reading, decoding, colour conversion, the callback, encoding,
+    // muxing) is timed into its latency histogram and the decoded and encoded frames are counted.
+    Metrics* metrics = nullptr;
+
+    // If set and both the decoder and the encoder work in the same 8-bit planar YUV format,
+    // frames are handed over as planes referencing the decoded AVFrame and the result is written
+    // straight into the encoder frame, skipping the BGR24 round trip. Otherwise the cv::Mat callback is used.
+    std::function<void(const PlanarImage&, PlanarImage&)> planarCallback;
+
+    // If set, a grey proxy proxyHeight pixels tall is scaled straight from the decoded frame (only its
+    // luma is read for YUV input) and passed along with the BGR image, so no full-size grey frame is made.
+    std::function<void(cv::Mat&, const cv::Mat&)> proxyCallback;
+    int proxyHeight = 0;
+
+    // Parallel pairwise estimation: if set, a stage between the colour conversion and the callbacks runs
+    // pairCallback(prev, cur, frameSize, index) on a work-stealing pool of estimationThreads threads (0 for one
+    // per core) for every pair of consecutive frames, up to estimationWindow pairs at once. prev and cur are
+    // what the callbacks get for frames index - 1 and index: the grey proxy, the BGR image or, in the native
+    // planar path, the luma plane. The callbacks of a frame run once its pair is done, in frame order.
+    std::function<void(const cv::Mat&, const cv::Mat&, cv::Size, int64_t)> pairCallback;
+    unsigned int estimationThreads = 0;
+    size_t estimationWindow = 16;
+    // If set, the estimations run on this pool, e.g. one shared by several runs, instead of a pool of their own.
+    ThreadPool* estimationPool = nullptr;
+    // The callbacks of a frame only run once the pairs of the next lookahead frames are estimated too, so that
+    // the smoothing can look ahead (see StabilizerOptions::lookahead); delays the output by as many frames.
+    size_t lookahead = 0;
+
+    // Live mode, for a stream read from a pipe and written to one: the demuxer doesn't buffer, the decoder and
+    // the encoder are set up for low delay (slice threading unless a mode is given, no B-frames, tune=zerolatency
+    // if the encoder has it), MP4 output is fragmented on every frame and every packet is flushed once written.
+    bool live = false;
+    // Output container, e.g. "mpegts" or "mp4"; needed when out_filename doesn't tell, like "pipe:1".
+    std::string outputFormat;
+    // If set, called with the time from reading every video packet to writing the encoded frame with the same
+    // pts, which is also recorded into the EndToEnd histogram of metrics.
+    std::function<void(int64_t pts, double seconds)> latencyCallback;
+
+    // Codec threads, 0 for one per core, and the threading modes they may use (a CodecThreadType combination).
+    int decoderThreads = 0;
+    int decoderThreadType = CodecThreadAuto;
+    int encoderThreads = 0;
+    int encoderThreadType = CodecThreadAuto;
+
+    // Encoder by name, e.g. "libx264", or by codec, e.g. "hevc"; by default the encoder of the input codec.
+    std::string encoder;
+    // Encoder pixel format, e.g. "yuv420p"; by default the decoder's if the encoder supports it, else its first one.
+    std::string pixelFormat;
+    // Passed to avcodec_open2 (e.g. preset, crf, g), to avformat_write_header (e.g. movflags) and to
+    // avformat_open_input (e.g. probesize); options nobody recognized are reported.
+    CodecOptionList encoderOptions;
+    CodecOptionList muxerOptions;
+    CodecOptionList demuxerOptions;
+
+    // Asynchronous I/O: if not 0, a local input file is read ahead by a thread of its own into a ring buffer of
+    // this many bytes, and a local output file is written behind through another one, so that waiting for the disk
+    // or a network share overlaps decoding and encoding (see AsyncIO.h). URLs and pipes keep FFmpeg's own I/O, and
+    // so does MP4 output with movflags=+faststart, which reads back what was written.
+    size_t ioBufferSize = 0;
+    // A local input file is memory mapped instead, if it can be.
+    bool mapInput = false;
+
+    // Segment mode, used by TransformVideoSegmented(): only this part of the video stream is processed and
+    // the other streams are dropped. The encoder is set up for the container of out_filename, but nothing
+    // is written there: encoderCallback gets the encoder parameters once and packetCallback every encoded
+    // packet, with timestamps in the input video stream time base.
+    const VideoSegment* segment = nullptr;
+    std::function<void(const AVCodecParameters*)> encoderCallback;
+    std::function<void(AVPacket*)> packetCallback;
+};
+
+int TransformVideo(const char *in_filename, const char *out_filename, std::function<void(cv::Mat&)>  callback,
+    const TransformVideoOptions& options = {});
+
+// Transforms the video once and encodes it into every rendition concurrently, each scaled and encoded on threads of
+// its own; the audio and subtitle streams are copied into every file. The encoder, pixel format, muxer and output
+// format of options are those of all the renditions. Segment mode takes a single rendition.
+int TransformVideo(const char *in_filename, const std::vector<Rendition>& renditions,
+    std::function<void(cv::Mat&)> callback, const TransformVideoOptions& options = {});
+
+// Decode-only pass for motion analysis: every decoded frame of the video stream is handed to callback,
+// nothing is converted to BGR or encoded. For planar YUV input the image references the decoded frame
+// (its luma plane is the grey image) and stays valid as long as the PlanarImage is held; other formats
+// are converted to a single grey plane.
+int AnalyzeVideo(const char *in_filename, std::function<void(const PlanarImage&)> callback,
+    const TransformVideoOptions& options = {});
+
+// Sets up the processing of one segment with its own state, e.g. a new Stabilizer: fills in callback
+// and the callbacks of options, and returns the object that has to be kept alive while the segment runs.
+typedef std::function<std::shared_ptr<void>(std::function<void(cv::Mat&)>& callback, TransformVideoOptions& options)>
+    SegmentSetup;
+
+// Splits the video at keyframes into up to numSegments segments which are transformed in parallel, each with
+// its own decoder, callbacks and encoder; decoding of a segment starts overlapFrames frames early so that the
+// stabilizer state carries across the boundaries. The encoded segments are concatenated into out_filename and
+// the audio and subtitle streams are copied once. The stats callbacks of options are not used. The codecs left at
+// one thread per core get their share of the cores per segment, and all the segments estimate their pairs on
+// options.estimationPool, or on one pool they share.
+int TransformVideoSegmented(const char *in_filename, const char *out_filename, int numSegments, int overlapFrames,
+    const SegmentSetup& setup, const TransformVideoOptions& options = {});
+
+// Transforms only the part of the video between startTime and endTime (in AV_TIME_BASE units from the start of the
+// file, 0 and INT64_MAX for the ends), widened to whole GOPs: decoding starts at the keyframe at or before startTime,
+// warmed up from overlapFrames frames earlier, and stops at the first keyframe at or after endTime. The GOPs
+// outside are stream-copied along with the audio and subtitle streams, so only the range is decoded and encoded.
+// The encoder has to be one of the input codec, in the input pixel format. Open-GOP input may show artefacts in the
+// few frames that precede the range in presentation order but follow its first keyframe in decoding order.
+int TransformVideoRange(const char *in_filename, const char *out_filename, int64_t startTime, int64_t endTime,
+    int overlapFrames, const SegmentSetup& setup, const TransformVideoOptions& options = {});
+
+// Parses a time as ffmpeg does, "[-][HH:]MM:SS[.m...]" or "S+[.m...]", into AV_TIME_BASE units.
+bool ParseTime(const char* text, int64_t& time);
@@ -0,0 +1,726 @@
+#include "TransformVideo.h"
+
+#include <stdint.h>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+#include <libavutil/pixdesc.h>
+}
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "CodecOptions.h"
+#include "ThreadPool.h"
+#include "makeguard.h"
+
+namespace {
+
+// Encoded packets of a segment, kept in an anonymous temporary file until the segments are concatenated.
+class PacketSpool
+{
+public:
+    PacketSpool() : m_file(tmpfile()) {}
+    ~PacketSpool() { if (m_file) fclose(m_file); }
+
+    PacketSpool(const PacketSpool&) = delete;
+    PacketSpool& operator=(const PacketSpool&) = delete;
+
+    bool IsOpen() const { return m_file != nullptr; }
+
+    bool Write(const AVPacket* packet)
+    {
+        const Record record{ packet->pts, packet->dts, packet->duration, packet->size, packet->flags };
+        return fwrite(&record, sizeof(record), 1, m_file) == 1
+            && fwrite(packet->data, 1, packet->size, m_file) == size_t(packet->size);
+    }
+
+    void Rewind() { rewind(m_file); }
+
+    // false at the end of the spool
+    bool Read(AVPacket* packet)
+    {
+        Record record;
+        if (fread(&record, sizeof(record), 1, m_file) != 1 || av_new_packet(packet, record.size) < 0)
+            return false;
+        packet->pts = record.pts;
+        packet->dts = record.dts;
+        packet->duration = record.duration;
+        packet->flags = record.flags;
+        return fread(packet->data, 1, record.size, m_file) == size_t(record.size);
+    }
+
+private:
+    struct Record
+    {
+        int64_t pts;
+        int64_t dts;
+        int64_t duration;
+        int32_t size;
+        int32_t flags;
+    };
+
+    FILE* m_file;
+};
+
+struct SegmentJob
+{
+    VideoSegment segment;
+    PacketSpool spool;
+    AVCodecParameters* codecpar = nullptr;
+    int result = 1;
+};
+
+// Keyframe timestamps of the video stream and the timestamp range it covers, found by reading
+// through the packets without decoding them.
+bool ScanKeyframes(const char* in_filename, int videoStreamNumber,
+    std::vector<int64_t>& keyframes, int64_t& firstPts, int64_t& lastPts)
+{
+    AVFormatContext *input_format_context = NULL;
+    if (avformat_open_input(&input_format_context, in_filename, NULL, NULL) < 0)
+        return false;
+
+    auto input_format_context_guard = MakeGuard(&input_format_context, avformat_close_input);
+
+    firstPts = INT64_MAX;
+    lastPts = INT64_MIN;
+    AVPacket* packet = av_packet_alloc();
+    auto packet_guard = MakeGuard(&packet, av_packet_free);
+    while (av_read_frame(input_format_context, packet) >= 0) {
+        if (packet->stream_index == videoStreamNumber) {
+            const int64_t pts = (packet->pts != AV_NOPTS_VALUE) ? packet->pts : packet->dts;
+            if (pts != AV_NOPTS_VALUE) {
+                if (packet->flags & AV_PKT_FLAG_KEY)
+                    keyframes.push_back(pts);
+                firstPts = std::min(firstPts, pts);
+                lastPts = std::max(lastPts, pts);
+            }
+        }
+        av_packet_unref(packet);
+    }
+    std::sort(keyframes.begin(), keyframes.end());
+    return !keyframes.empty();
+}
+
+// Keyframes that delimit the GOPs overlapping [startPts, endPts): the last one at or before startPts (the first
+// one read if there is none) and the first one at or after endPts, INT64_MAX at the end of the stream. Only the
+// packets from a keyframe before startPts up to that one are read.
+bool FindRangeKeyframes(const char* in_filename, int videoStreamNumber, int64_t startPts, int64_t endPts,
+    int64_t& rangeStart, int64_t& rangeEnd)
+{
+    AVFormatContext *input_format_context = NULL;
+    if (avformat_open_input(&input_format_context, in_filename, NULL, NULL) < 0)
+        return false;
+
+    auto input_format_context_guard = MakeGuard(&input_format_context, avformat_close_input);
+
+    // if the seek fails the packets are read from the start
+    if (startPts != INT64_MIN)
+        av_seek_frame(input_format_context, videoStreamNumber, startPts, AVSEEK_FLAG_BACKWARD);
+
+    rangeStart = INT64_MIN;
+    rangeEnd = INT64_MAX;
+    int64_t firstKeyframe = INT64_MIN;
+    AVPacket* packet = av_packet_alloc();
+    auto packet_guard = MakeGuard(&packet, av_packet_free);
+    while (av_read_frame(input_format_context, packet) >= 0) {
+        const int64_t pts = (packet->pts != AV_NOPTS_VALUE) ? packet->pts : packet->dts;
+        const bool keyframe = packet->stream_index == videoStreamNumber && pts != AV_NOPTS_VALUE
+            && (packet->flags & AV_PKT_FLAG_KEY);
+        av_packet_unref(packet);
+        if (!keyframe)
+            continue;
+        if (firstKeyframe == INT64_MIN)
+            firstKeyframe = pts;
+        if (pts >= endPts && pts > firstKeyframe) {
+            rangeEnd = pts;
+            break;
+        }
+        if (pts <= startPts)
+            rangeStart = pts;
+    }
+    if (rangeStart == INT64_MIN)
+        rangeStart = firstKeyframe;
+    return firstKeyframe != INT64_MIN;
+}
+
+// Replaces the payload of packet, keeping its timestamps and flags.
+bool ReplaceData(AVPacket* packet, const std::vector<uint8_t>& data)
+{
+    AVPacket* replaced = av_packet_alloc();
+    auto replaced_guard = MakeGuard(&replaced, av_packet_free);
+    if (!replaced || av_new_packet(replaced, int(data.size())) < 0 || av_packet_copy_props(replaced, packet) < 0)
+        return false;
+    memcpy(replaced->data, data.data(), data.size());
+    av_packet_unref(packet);
+    av_packet_move_ref(packet, replaced);
+    return true;
+}
+
+// Makes the packets of an encoder opened without a global header fit into the input video stream, whose
+// extradata the output keeps. H.264 and HEVC in MP4 or Matroska prefix every NAL unit with its length and keep
+// the parameter sets in the extradata (avcC, hvcC): the encoded Annex B packets get the same prefixes, and the
+// parameter sets of the input are put back in front of the first copied keyframe after the range, which would
+// otherwise be decoded with those of the encoder. Annex B extradata is put back as is; other codecs are left alone.
+class ParameterSetSplicer
+{
+public:
+    explicit ParameterSetSplicer(const AVCodecParameters* input)
+    {
+        const uint8_t* data = input->extradata;
+        const size_t size = size_t(std::max(input->extradata_size, 0));
+        if ((input->codec_id != AV_CODEC_ID_H264 && input->codec_id != AV_CODEC_ID_HEVC) || size < 4)
+            return;
+        if (data[0] != 1) {
+            if (StartCode(data, size, 0))
+                m_parameterSets.assign(data, data + size);
+            return;
+        }
+
+        // the NAL units of the avcC or hvcC arrays, each with a 16-bit length
+        size_t pos;
+        auto readNals = [&](size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                if (pos + 2 > size)
+                    return false;
+                const size_t length = size_t(data[pos]) << 8 | data[pos + 1];
+                pos += 2;
+                if (pos + length > size)
+                    return false;
+                AppendNal(data + pos, length, m_parameterSets);
+                pos += length;
+            }
+            return true;
+        };
+        bool ok;
+        if (input->codec_id == AV_CODEC_ID_H264) {
+            // sequence then picture parameter sets
+            ok = size > 6;
+            m_lengthSize = ok ? (data[4] & 3) + 1 : 0;
+            pos = 6;
+            ok = ok && readNals(data[5] & 0x1f) && pos < size;
+            if (ok) {
+                const size_t count = data[pos++];
+                ok = readNals(count);
+            }
+        }
+        else {
+            m_lengthSize = size > 21 ? (data[21] & 3) + 1 : 0;
+            ok = size > 22;
+            const size_t arrays = ok ? data[22] : 0;
+            pos = 23;
+            for (size_t i = 0; ok && i < arrays; ++i) {
+                ok = pos + 3 <= size;
+                if (ok) {
+                    const size_t count = size_t(data[pos + 1]) << 8 | data[pos + 2];
+                    pos += 3;
+                    ok = readNals(count);
+                }
+            }
+        }
+        if (!ok) {
+            fprintf(stderr, "Could not parse the parameter sets of the input, the copied GOPs may not decode\n");
+            m_parameterSets.clear();
+        }
+    }
+
+    // false if the packet couldn't be rewritten
+    bool AdaptEncoded(AVPacket* packet) const
+    {
+        if (m_lengthSize == 0)
+            return true;
+        const uint8_t* data = packet->data;
+        const size_t size = size_t(packet->size);
+        size_t start = NextStartCode(data, size, 0);
+        if (start == size)
+            return true; // already length prefixed
+
+        std::vector<uint8_t> rewritten;
+        rewritten.reserve(size + 16);
+        while (start < size) {
+            const size_t nal = start + 3;
+            const size_t next = NextStartCode(data, size, nal);
+            // the zeros before the next start code, or the leading zero of a 4-byte one
+            size_t end = next;
+            while (end > nal && data[end - 1] == 0)
+                --end;
+            AppendNal(data + nal, end - nal, rewritten);
+            start = next;
+        }
+        return ReplaceData(packet, rewritten);
+    }
+
+    // Puts the input's parameter sets in front of a copied keyframe.
+    bool RestoreInput(AVPacket* packet) const
+    {
+        if (m_parameterSets.empty())
+            return true;
+        std::vector<uint8_t> restored(m_parameterSets);
+        restored.insert(restored.end(), packet->data, packet->data + packet->size);
+        return ReplaceData(packet, restored);
+    }
+
+private:
+    static bool StartCode(const uint8_t* data, size_t size, size_t pos)
+    {
+        return pos + 3 <= size && data[pos] == 0 && data[pos + 1] == 0 && data[pos + 2] == 1;
+    }
+
+    static size_t NextStartCode(const uint8_t* data, size_t size, size_t pos)
+    {
+        for (; pos + 3 <= size; ++pos) {
+            if (StartCode(data, size, pos))
+                return pos;
+        }
+        return size;
+    }
+
+    // with a length prefix of the input's size, or a start code for Annex B
+    void AppendNal(const uint8_t* nal, size_t length, std::vector<uint8_t>& out) const
+    {
+        if (m_lengthSize == 0) {
+            const uint8_t startCode[] = { 0, 0, 0, 1 };
+            out.insert(out.end(), startCode, startCode + sizeof(startCode));
+        }
+        for (int shift = 8 * (m_lengthSize - 1); shift >= 0; shift -= 8)
+            out.push_back(uint8_t(length >> shift));
+        out.insert(out.end(), nal, nal + length);
+    }
+
+    int m_lengthSize = 0; // of the NAL unit length prefixes, 0 for Annex B
+    std::vector<uint8_t> m_parameterSets; // of the input, in the format of its packets
+};
+
+// Writes out_filename from the video packets readVideo() hands out, with timestamps in the input video stream
+// time base, merged in dts order with the audio and subtitle packets of the input and with the input video
+// packets keepVideo() accepts (and may rewrite). The video stream gets videoCodecpar.
+int MuxWithCopiedStreams(AVFormatContext* input_format_context, int videoStreamNumber,
+    const AVCodecParameters* videoCodecpar, const char* out_filename, const CodecOptionList& muxerOptions,
+    const std::function<bool(AVPacket*)>& readVideo, const std::function<bool(AVPacket*)>& keepVideo)
+{
+    AVFormatContext *output_format_context = NULL;
+    avformat_alloc_output_context2(&output_format_context, NULL, NULL, out_filename);
+    if (!output_format_context) {
+        fprintf(stderr, "Could not create output context\n");
+        return 1;
+    }
+
+    auto output_format_context_guard = MakeGuard(output_format_context, avformat_free_context);
+
+    const AVStream* videoStream = input_format_context->streams[videoStreamNumber];
+    const auto number_of_streams = input_format_context->nb_streams;
+    std::vector<int> streams_list(number_of_streams, -1);
+    int stream_index = 0;
+    for (unsigned int i = 0; i < number_of_streams; i++) {
+        const AVCodecParameters *in_codecpar = input_format_context->streams[i]->codecpar;
+        if (int(i) != videoStreamNumber && in_codecpar->codec_type != AVMEDIA_TYPE_AUDIO &&
+            in_codecpar->codec_type != AVMEDIA_TYPE_SUBTITLE)
+            continue;
+        AVStream *out_stream = avformat_new_stream(output_format_context, NULL);
+        if (!out_stream) {
+            fprintf(stderr, "Failed allocating output stream\n");
+            return 1;
+        }
+        if (avcodec_parameters_copy(out_stream->codecpar, (int(i) == videoStreamNumber) ? videoCodecpar : in_codecpar) < 0) {
+            fprintf(stderr, "Failed to copy codec parameters\n");
+            return 1;
+        }
+        out_stream->codecpar->codec_tag = 0;
+        out_stream->time_base = input_format_context->streams[i]->time_base;
+        streams_list[i] = stream_index++;
+    }
+
+    av_dump_format(output_format_context, 0, out_filename, 1);
+
+    if (!(output_format_context->oformat->flags & AVFMT_NOFILE)) {
+        if (avio_open(&output_format_context->pb, out_filename, AVIO_FLAG_WRITE) < 0) {
+            fprintf(stderr, "Could not open output file '%s'", out_filename);
+            return 1;
+        }
+    }
+
+    AVDictionary* opts = MakeDictionary(muxerOptions);
+    auto opts_guard = MakeGuard(&opts, av_dict_free);
+    if (avformat_write_header(output_format_context, &opts) < 0) {
+        fprintf(stderr, "Error occurred when opening output file\n");
+        return 1;
+    }
+    ReportUnusedOptions(opts, output_format_context->oformat->name);
+
+    AVPacket* videoPacket = av_packet_alloc();
+    auto videoPacket_guard = MakeGuard(&videoPacket, av_packet_free);
+    AVPacket* copiedPacket = av_packet_alloc();
+    auto copiedPacket_guard = MakeGuard(&copiedPacket, av_packet_free);
+
+    auto nextVideo = [&] {
+        if (!readVideo(videoPacket))
+            return false;
+        videoPacket->stream_index = videoStreamNumber;
+        return true;
+    };
+    // reads the next packet of a stream-copied stream
+    auto readCopied = [&] {
+        while (av_read_frame(input_format_context, copiedPacket) >= 0) {
+            if (streams_list[copiedPacket->stream_index] >= 0
+                && (copiedPacket->stream_index != videoStreamNumber || keepVideo(copiedPacket)))
+                return true;
+            av_packet_unref(copiedPacket);
+        }
+        return false;
+    };
+
+    int64_t lastVideoDts = INT64_MIN;
+    auto writePacket = [&](AVPacket* packet) {
+        // encoder delays are equal across the segments and close to the input's, this only guards against
+        // rounding and against the delay of a spliced range reaching back into the copied packets before it
+        if (packet->stream_index == videoStreamNumber && packet->dts != AV_NOPTS_VALUE) {
+            if (lastVideoDts != INT64_MIN && packet->dts <= lastVideoDts)
+                packet->dts = lastVideoDts + 1;
+            if (packet->pts != AV_NOPTS_VALUE && packet->pts < packet->dts)
+                packet->pts = packet->dts;
+            lastVideoDts = packet->dts;
+        }
+
+        const auto in_stream = input_format_context->streams[packet->stream_index];
+        packet->stream_index = streams_list[packet->stream_index];
+        const auto out_stream = output_format_context->streams[packet->stream_index];
+
+        packet->pts = av_rescale_q_rnd(packet->pts, in_stream->time_base, out_stream->time_base, AVRounding(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+        packet->dts = av_rescale_q_rnd(packet->dts, in_stream->time_base, out_stream->time_base, AVRounding(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+        packet->duration = av_rescale_q(packet->duration, in_stream->time_base, out_stream->time_base);
+        packet->pos = -1;
+
+        return av_interleaved_write_frame(output_format_context, packet) >= 0;
+    };
+
+    // merge the video with the copied streams in dts order
+    bool haveVideo = nextVideo();
+    bool haveCopied = readCopied();
+    bool failed = false;
+    while (!failed && (haveVideo || haveCopied)) {
+        const bool takeVideo = haveVideo && (!haveCopied
+            || videoPacket->dts == AV_NOPTS_VALUE || copiedPacket->dts == AV_NOPTS_VALUE
+            || av_compare_ts(videoPacket->dts, videoStream->time_base,
+                copiedPacket->dts, input_format_context->streams[copiedPacket->stream_index]->time_base) <= 0);
+        if (takeVideo) {
+            failed = !writePacket(videoPacket);
+            haveVideo = nextVideo();
+        }
+        else {
+            failed = !writePacket(copiedPacket);
+            haveCopied = readCopied();
+        }
+    }
+    if (failed)
+        fprintf(stderr, "Error muxing packet\n");
+
+    av_write_trailer(output_format_context);
+
+    if (!(output_format_context->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&output_format_context->pb);
+
+    return failed ? 1 : 0;
+}
+
+}
+
+
+int TransformVideoSegmented(const char *in_filename, const char *out_filename, int numSegments, int overlapFrames,
+    const SegmentSetup& setup, const TransformVideoOptions& options)
+{
+    AVFormatContext *input_format_context = NULL;
+
+    if (avformat_open_input(&input_format_context, in_filename, NULL, NULL) < 0) {
+        fprintf(stderr, "Could not open input file '%s'", in_filename);
+        return 1;
+    }
+
+    auto input_format_context_guard = MakeGuard(&input_format_context, avformat_close_input);
+
+    if (avformat_find_stream_info(input_format_context, NULL) < 0) {
+        fprintf(stderr, "Failed to retrieve input stream information");
+        return 1;
+    }
+
+    // the stream TransformVideo picks, the last video one
+    int videoStreamNumber = -1;
+    for (unsigned int i = 0; i < input_format_context->nb_streams; i++) {
+        if (input_format_context->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+            videoStreamNumber = i;
+    }
+    if (videoStreamNumber < 0) {
+        fprintf(stderr, "No video stream found\n");
+        return 1;
+    }
+    const AVStream* videoStream = input_format_context->streams[videoStreamNumber];
+
+    std::vector<int64_t> keyframes;
+    int64_t firstPts, lastPts;
+    if (!ScanKeyframes(in_filename, videoStreamNumber, keyframes, firstPts, lastPts)) {
+        fprintf(stderr, "No keyframes found\n");
+        return 1;
+    }
+
+    // segment boundaries: the keyframes closest after evenly spaced points of the timeline
+    std::vector<int64_t> boundaries;
+    for (int i = 1; i < numSegments; ++i) {
+        const int64_t target = firstPts + av_rescale(lastPts - firstPts, i, numSegments);
+        const auto keyframe = std::lower_bound(keyframes.begin(), keyframes.end(), target);
+        if (keyframe != keyframes.end() && *keyframe > firstPts && (boundaries.empty() || *keyframe > boundaries.back()))
+            boundaries.push_back(*keyframe);
+    }
+
+    const AVRational frameRate = videoStream->avg_frame_rate.num > 0 ? videoStream->avg_frame_rate : videoStream->r_frame_rate;
+    const int64_t overlap = frameRate.num > 0
+        ? av_rescale_q(overlapFrames, av_inv_q(frameRate), videoStream->time_base) : 0;
+
+    std::vector<std::unique_ptr<SegmentJob>> jobs;
+    for (size_t i = 0; i <= boundaries.size(); ++i) {
+        std::unique_ptr<SegmentJob> job(new SegmentJob);
+        job->segment.startPts = (i == 0) ? INT64_MIN : boundaries[i - 1];
+        job->segment.endPts = (i == boundaries.size()) ? INT64_MAX : boundaries[i];
+        job->segment.seekPts = INT64_MIN;
+        if (i > 0) {
+            // the last keyframe at least overlapFrames before the start
+            const auto keyframe = std::upper_bound(keyframes.begin(), keyframes.end(), job->segment.startPts - overlap);
+            job->segment.seekPts = (keyframe == keyframes.begin()) ? keyframes.front() : *(keyframe - 1);
+        }
+        if (!job->spool.IsOpen()) {
+            fprintf(stderr, "Could not create a temporary file\n");
+            return 1;
+        }
+        jobs.push_back(std::move(job));
+    }
+
+    auto codecpar_guard = MakeGuard(&jobs, [](std::vector<std::unique_ptr<SegmentJob>>* jobs) {
+        for (auto& job : *jobs)
+            avcodec_parameters_free(&job->codecpar);
+    });
+
+    fprintf(stderr, "Processing %zu segments\n", jobs.size());
+
+    // Every segment runs the whole TransformVideo pipeline on its own, on its share of the cores: the codecs
+    // left at one thread per core get as many as the cores over the segments, and the pairs of all the segments
+    // are estimated on one pool.
+    const int coresPerSegment = std::max(1, int(std::thread::hardware_concurrency()) / int(jobs.size()));
+    std::unique_ptr<ThreadPool> estimationPool;
+    std::once_flag estimationPoolOnce;
+    std::exception_ptr segmentException;
+    std::mutex segmentExceptionMutex;
+    std::vector<std::thread> workers;
+    for (auto& job : jobs) {
+        workers.emplace_back([&, job = job.get()] {
+            try {
+                TransformVideoOptions segmentOptions = options;
+                segmentOptions.queueStatsCallback = nullptr;
+                segmentOptions.poolStatsCallback = nullptr;
+                segmentOptions.stageTimesCallback = nullptr;
+                segmentOptions.segment = &job->segment;
+                if (segmentOptions.decoderThreads == 0)
+                    segmentOptions.decoderThreads = coresPerSegment;
+                if (segmentOptions.encoderThreads == 0)
+                    segmentOptions.encoderThreads = coresPerSegment;
+                segmentOptions.encoderCallback = [job](const AVCodecParameters* codecpar) {
+                    job->codecpar = avcodec_parameters_alloc();
+                    if (job->codecpar)
+                        avcodec_parameters_copy(job->codecpar, codecpar);
+                };
+                bool spoolFailed = false;
+                segmentOptions.packetCallback = [job, &spoolFailed](AVPacket* packet) {
+                    if (!spoolFailed && !job->spool.Write(packet)) {
+                        fprintf(stderr, "Error writing a temporary file\n");
+                        spoolFailed = true;
+                    }
+                };
+
+                std::function<void(cv::Mat&)> callback;
+                const auto state = setup(callback, segmentOptions);
+                if (segmentOptions.pairCallback && !segmentOptions.estimationPool) {
+                    std::call_once(estimationPoolOnce, [&] {
+                        estimationPool.reset(new ThreadPool(options.estimationThreads));
+                    });
+                    segmentOptions.estimationPool = estimationPool.get();
+                }
+                job->result = TransformVideo(in_filename, out_filename, callback, segmentOptions);
+                if (spoolFailed)
+                    job->result = 1;
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(segmentExceptionMutex);
+                if (!segmentException)
+                    segmentException = std::current_exception();
+            }
+        });
+    }
+    for (auto& worker : workers)
+        worker.join();
+
+    if (segmentException)
+        std::rethrow_exception(segmentException);
+    for (const auto& job : jobs) {
+        if (job->result != 0 || !job->codecpar)
+            return 1;
+    }
+
+    // concatenate the segments, the other streams are copied from the input
+    size_t currentJob = 0;
+    jobs[0]->spool.Rewind();
+    // reads the next video packet of the segments in order, false once they are exhausted
+    auto readVideo = [&](AVPacket* packet) {
+        while (currentJob < jobs.size()) {
+            if (jobs[currentJob]->spool.Read(packet))
+                return true;
+            av_packet_unref(packet);
+            if (++currentJob < jobs.size())
+                jobs[currentJob]->spool.Rewind();
+        }
+        return false;
+    };
+    return MuxWithCopiedStreams(input_format_context, videoStreamNumber, jobs[0]->codecpar, out_filename,
+        options.muxerOptions, readVideo, [](AVPacket*) { return false; });
+}
+
+
+int TransformVideoRange(const char *in_filename, const char *out_filename, int64_t startTime, int64_t endTime,
+    int overlapFrames, const SegmentSetup& setup, const TransformVideoOptions& options)
+{
+    AVFormatContext *input_format_context = NULL;
+
+    if (avformat_open_input(&input_format_context, in_filename, NULL, NULL) < 0) {
+        fprintf(stderr, "Could not open input file '%s'", in_filename);
+        return 1;
+    }
+
+    auto input_format_context_guard = MakeGuard(&input_format_context, avformat_close_input);
+
+    if (avformat_find_stream_info(input_format_context, NULL) < 0) {
+        fprintf(stderr, "Failed to retrieve input stream information");
+        return 1;
+    }
+
+    // the stream TransformVideo picks, the last video one
+    int videoStreamNumber = -1;
+    for (unsigned int i = 0; i < input_format_context->nb_streams; i++) {
+        if (input_format_context->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+            videoStreamNumber = i;
+    }
+    if (videoStreamNumber < 0) {
+        fprintf(stderr, "No video stream found\n");
+        return 1;
+    }
+    const AVStream* videoStream = input_format_context->streams[videoStreamNumber];
+    const AVCodecParameters* videoCodecpar = videoStream->codecpar;
+
+    // the encoded GOPs are spliced between copied ones, so they have to be in the same format
+    const AVCodec* encoder = avcodec_find_encoder(videoCodecpar->codec_id);
+    if (!options.encoder.empty()) {
+        encoder = avcodec_find_encoder_by_name(options.encoder.c_str());
+        const auto descriptor = encoder ? nullptr : avcodec_descriptor_get_by_name(options.encoder.c_str());
+        if (descriptor)
+            encoder = avcodec_find_encoder(descriptor->id);
+    }
+    if (!encoder || encoder->id != videoCodecpar->codec_id) {
+        fprintf(stderr, "A range is re-encoded with the codec of the input, %s\n", avcodec_get_name(videoCodecpar->codec_id));
+        return 1;
+    }
+    if (!options.pixelFormat.empty() && av_get_pix_fmt(options.pixelFormat.c_str()) != videoCodecpar->format) {
+        fprintf(stderr, "A range is re-encoded in the pixel format of the input\n");
+        return 1;
+    }
+
+    // the times count from the start of the file
+    const int64_t origin = (input_format_context->start_time != AV_NOPTS_VALUE) ? input_format_context->start_time : 0;
+    const int64_t startPts = (startTime > 0)
+        ? av_rescale_q(origin + startTime, av_get_time_base_q(), videoStream->time_base) : INT64_MIN;
+    const int64_t endPts = (endTime != INT64_MAX)
+        ? av_rescale_q(origin + endTime, av_get_time_base_q(), videoStream->time_base) : INT64_MAX;
+    if (endPts <= startPts) {
+        fprintf(stderr, "The range ends before it starts\n");
+        return 1;
+    }
+
+    // whole GOPs are re-encoded, from the keyframe at or before the start to the one at or after the end
+    int64_t rangeStart, rangeEnd;
+    if (!FindRangeKeyframes(in_filename, videoStreamNumber, startPts, endPts, rangeStart, rangeEnd)) {
+        fprintf(stderr, "No keyframes found\n");
+        return 1;
+    }
+
+    const AVRational frameRate = videoStream->avg_frame_rate.num > 0 ? videoStream->avg_frame_rate : videoStream->r_frame_rate;
+    const int64_t overlap = frameRate.num > 0
+        ? av_rescale_q(overlapFrames, av_inv_q(frameRate), videoStream->time_base) : 0;
+
+    VideoSegment segment;
+    segment.seekPts = (startPts != INT64_MIN) ? rangeStart - overlap : INT64_MIN;
+    segment.startPts = rangeStart;
+    segment.endPts = rangeEnd;
+    segment.spliced = true;
+
+    const int64_t streamStart = (videoStream->start_time != AV_NOPTS_VALUE) ? videoStream->start_time : 0;
+    auto seconds = [&](int64_t pts) { return (pts - streamStart) * av_q2d(videoStream->time_base); };
+    if (rangeEnd != INT64_MAX)
+        fprintf(stderr, "Re-encoding from %.3f s to %.3f s, copying the rest\n", seconds(rangeStart), seconds(rangeEnd));
+    else
+        fprintf(stderr, "Re-encoding from %.3f s to the end, copying the rest\n", seconds(rangeStart));
+
+    PacketSpool spool;
+    if (!spool.IsOpen()) {
+        fprintf(stderr, "Could not create a temporary file\n");
+        return 1;
+    }
+
+    TransformVideoOptions rangeOptions = options;
+    rangeOptions.segment = &segment;
+    rangeOptions.encoderCallback = nullptr;
+    bool spoolFailed = false;
+    rangeOptions.packetCallback = [&spool, &spoolFailed](AVPacket* packet) {
+        if (!spoolFailed && !spool.Write(packet)) {
+            fprintf(stderr, "Error writing a temporary file\n");
+            spoolFailed = true;
+        }
+    };
+
+    {
+        std::function<void(cv::Mat&)> callback;
+        const auto state = setup(callback, rangeOptions);
+        if (TransformVideo(in_filename, out_filename, callback, rangeOptions) != 0 || spoolFailed)
+            return 1;
+    }
+
+    // the video stream keeps the parameters of the input, the encoded packets replace the range
+    const ParameterSetSplicer splicer(videoCodecpar);
+    spool.Rewind();
+    auto readVideo = [&](AVPacket* packet) {
+        if (!spool.Read(packet))
+            return false;
+        if (!splicer.AdaptEncoded(packet))
+            fprintf(stderr, "Could not rewrite an encoded packet\n");
+        return true;
+    };
+    bool resumed = false;
+    auto keepVideo = [&](AVPacket* packet) {
+        const int64_t pts = (packet->pts != AV_NOPTS_VALUE) ? packet->pts : packet->dts;
+        if (pts == AV_NOPTS_VALUE)
+            return true;
+        if (pts >= rangeStart && pts < rangeEnd)
+            return false;
+        if (pts >= rangeEnd && !resumed && (packet->flags & AV_PKT_FLAG_KEY)) {
+            // the keyframe the rest of the stream starts with
+            resumed = true;
+            if (!splicer.RestoreInput(packet))
+                fprintf(stderr, "Could not restore the parameter sets of the input\n");
+        }
+        return true;
+    };
+    return MuxWithCopiedStreams(input_format_context, videoStreamNumber, videoCodecpar, out_filename,
+        options.muxerOptions, readVideo, keepVideo);
+}
@@ -0,0 +1,648 @@
+// Benchmarks the whole stabilization pipeline on synthetic clips with known camera shake: a textured scene
+// is filmed by a camera that pans slowly and jitters by a random rigid motion on every frame. Each clip is
+// encoded, run through TransformVideo with a Stabilizer of each motion model asked for and compared with the injected
+// motion. Prints CSV, one metric per line, so that the output of two builds can be joined and compared.
+// The heap allocations made on every thread once the stabilizer is warmed up are counted, so that a steady state
+// that allocates shows up.
+
+#include "Stabilizer.h"
+#include "TransformVideo.h"
+#include "makeguard.h"
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+}
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+
+
+// operator new is replaced, and cv::Mat data goes through CountingMatAllocator, to count the allocations made on any
+// thread while g_countAllocations is set, see AllocationCounter, and how many of them are still live, wherever they
+// are freed; every block starts with a header that tells whether it was counted.
+static std::atomic<bool> g_countAllocations{ false };
+static std::atomic<int64_t> g_allocations{ 0 };
+static std::atomic<int64_t> g_liveAllocations{ 0 };
+static const size_t ALLOCATION_HEADER = alignof(std::max_align_t);
+
+void* operator new(size_t size)
+{
+    char* block = static_cast<char*>(malloc(size + ALLOCATION_HEADER));
+    if (!block)
+        throw std::bad_alloc();
+    const bool counted = g_countAllocations;
+    *reinterpret_cast<bool*>(block) = counted;
+    if (counted) {
+        ++g_allocations;
+        ++g_liveAllocations;
+    }
+    return block + ALLOCATION_HEADER;
+}
+
+void operator delete(void* pointer) noexcept
+{
+    if (!pointer)
+        return;
+    char* block = static_cast<char*>(pointer) - ALLOCATION_HEADER;
+    if (*reinterpret_cast<bool*>(block))
+        --g_liveAllocations;
+    free(block);
+}
+
+void operator delete(void* pointer, size_t) noexcept
+{
+    operator delete(pointer);
+}
+
+
+namespace {
+
+// OpenCV's default allocator, counting the data of the cv::Mats it allocates, which cv::fastMalloc takes from the
+// heap without operator new. The blocks it counted are marked in allocatorFlags_, which the default allocator
+// leaves alone.
+class CountingMatAllocator : public cv::MatAllocator
+{
+public:
+    CountingMatAllocator() : m_allocator(cv::Mat::getStdAllocator()) {}
+
+    cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step, cv::AccessFlag flags,
+        cv::UMatUsageFlags usageFlags) const override
+    {
+        cv::UMatData* u = m_allocator->allocate(dims, sizes, type, data, step, flags, usageFlags);
+        if (!u)
+            return nullptr;
+        u->currAllocator = this;
+        u->allocatorFlags_ = (!data && g_countAllocations) ? 1 : 0;
+        if (u->allocatorFlags_) {
+            ++g_allocations;
+            ++g_liveAllocations;
+        }
+        return u;
+    }
+
+    bool allocate(cv::UMatData* u, cv::AccessFlag accessFlags, cv::UMatUsageFlags usageFlags) const override
+    {
+        return m_allocator->allocate(u, accessFlags, usageFlags);
+    }
+
+    void deallocate(cv::UMatData* u) const override
+    {
+        if (!u)
+            return;
+        if (u->allocatorFlags_)
+            --g_liveAllocations;
+        u->currAllocator = m_allocator;
+        m_allocator->deallocate(u);
+    }
+
+private:
+    cv::MatAllocator* const m_allocator;
+};
+
+struct ShakeOptions
+{
+    int frames = 150;
+    int fps = 30;
+    double jitter = 8; // pixels, uniform in [-jitter, jitter] on each axis
+    double rotationJitter = 0.5; // degrees
+    double scaleJitter = 0; // percent, the zoom is uniform in [1 - scaleJitter, 1 + scaleJitter] percent
+    double panAmplitude = 0.05; // of the frame width, a slow sine over panPeriod frames
+    int panPeriod = 90;
+    uint64_t seed = 12345;
+};
+
+// Static scene with corners for the feature tracker: filled rectangles and circles on smooth shading.
+cv::Mat MakeScene(cv::Size size, cv::RNG& rng)
+{
+    cv::Mat coarse(size.height / 32 + 2, size.width / 32 + 2, CV_8UC3);
+    rng.fill(coarse, cv::RNG::UNIFORM, 0, 256);
+    cv::Mat scene;
+    resize(coarse, scene, size, 0, 0, cv::INTER_CUBIC);
+
+    const int shapes = size.area() / 3000;
+    for (int i = 0; i < shapes; ++i) {
+        const cv::Point centre(rng.uniform(0, size.width), rng.uniform(0, size.height));
+        const int extent = rng.uniform(4, 40);
+        const cv::Scalar colour(rng.uniform(0, 256), rng.uniform(0, 256), rng.uniform(0, 256));
+        if (i % 3 == 0)
+            circle(scene, centre, extent, colour, cv::FILLED, cv::LINE_AA);
+        else
+            rectangle(scene, cv::Rect(centre.x, centre.y, extent, rng.uniform(4, 40)), colour, cv::FILLED);
+    }
+    return scene;
+}
+
+// Maps scene coordinates to frame coordinates: the camera looks at the scene centre moved by (x, y),
+// rotated by a around the frame centre.
+cv::Matx33d CameraMatrix(cv::Size scene, cv::Size frame, double x, double y, double a, double zoom)
+{
+    const double c = zoom * cos(a);
+    const double s = zoom * sin(a);
+    const double cx = scene.width / 2. + x;
+    const double cy = scene.height / 2. + y;
+    return cv::Matx33d(
+        c, -s, frame.width / 2. - (c * cx - s * cy),
+        s, c, frame.height / 2. - (s * cx + c * cy),
+        0, 0, 1);
+}
+
+// Encodes frameCount frames made by render(index, frame) with the default video codec of the container,
+// at a high bit rate so that the coding noise hardly disturbs the tracking.
+bool WriteClip(const std::string& path, cv::Size size, int frameCount, int fps,
+    const std::function<void(int, cv::Mat&)>& render)
+{
+    AVFormatContext* format_context = nullptr;
+    avformat_alloc_output_context2(&format_context, NULL, NULL, path.c_str());
+    if (!format_context) {
+        fprintf(stderr, "Could not create output context for '%s'\n", path.c_str());
+        return false;
+    }
+    auto format_context_guard = MakeGuard(format_context, avformat_free_context);
+
+    auto encoder = avcodec_find_encoder(format_context->oformat->video_codec);
+    if (!encoder)
+        encoder = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+    if (!encoder) {
+        fprintf(stderr, "No video encoder found for '%s'\n", path.c_str());
+        return false;
+    }
+    auto enc_ctx = avcodec_alloc_context3(encoder);
+    if (!enc_ctx)
+        return false;
+    auto enc_ctx_guard = MakeGuard(&enc_ctx, avcodec_free_context);
+
+    enc_ctx->width = size.width;
+    enc_ctx->height = size.height;
+    enc_ctx->time_base = AVRational{ 1, fps };
+    enc_ctx->framerate = AVRational{ fps, 1 };
+    enc_ctx->gop_size = fps;
+    enc_ctx->bit_rate = int64_t(size.area()) * fps / 2;
+    enc_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+    if (encoder->pix_fmts != nullptr) {
+        auto pix_fmt = encoder->pix_fmts;
+        while (*pix_fmt != AV_PIX_FMT_NONE && *pix_fmt != AV_PIX_FMT_YUV420P)
+            ++pix_fmt;
+        if (*pix_fmt == AV_PIX_FMT_NONE)
+            enc_ctx->pix_fmt = encoder->pix_fmts[0];
+    }
+    if (format_context->oformat->flags & AVFMT_GLOBALHEADER)
+        enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if (avcodec_open2(enc_ctx, encoder, NULL) < 0) {
+        fprintf(stderr, "Cannot open the %s encoder\n", encoder->name);
+        return false;
+    }
+
+    AVStream* stream = avformat_new_stream(format_context, NULL);
+    if (!stream || avcodec_parameters_from_context(stream->codecpar, enc_ctx) < 0)
+        return false;
+    stream->time_base = enc_ctx->time_base;
+
+    if (!(format_context->oformat->flags & AVFMT_NOFILE)
+        && avio_open(&format_context->pb, path.c_str(), AVIO_FLAG_WRITE) < 0) {
+        fprintf(stderr, "Could not open output file '%s'\n", path.c_str());
+        return false;
+    }
+    auto pb_guard = MakeGuard(&format_context->pb, avio_closep);
+
+    if (avformat_write_header(format_context, NULL) < 0) {
+        fprintf(stderr, "Could not write the header of '%s'\n", path.c_str());
+        return false;
+    }
+
+    AVFrame* frame = av_frame_alloc();
+    auto frame_guard = MakeGuard(&frame, av_frame_free);
+    AVPacket* packet = av_packet_alloc();
+    auto packet_guard = MakeGuard(&packet, av_packet_free);
+    frame->format = enc_ctx->pix_fmt;
+    frame->width = size.width;
+    frame->height = size.height;
+    if (av_frame_get_buffer(frame, 16) < 0)
+        return false;
+
+    SwsContext* convert_ctx = sws_getContext(size.width, size.height, AV_PIX_FMT_BGR24,
+        size.width, size.height, enc_ctx->pix_fmt, SWS_BICUBIC, NULL, NULL, NULL);
+    auto convert_ctx_guard = MakeGuard(&convert_ctx, [](SwsContext** ctx) { sws_freeContext(*ctx); });
+
+    auto writePackets = [&] {
+        while (avcodec_receive_packet(enc_ctx, packet) == 0) {
+            av_packet_rescale_ts(packet, enc_ctx->time_base, stream->time_base);
+            packet->stream_index = stream->index;
+            if (av_interleaved_write_frame(format_context, packet) < 0)
+                return false;
+        }
+        return true;
+    };
+
+    cv::Mat image;
+    for (int i = 0; i < frameCount; ++i) {
+        render(i, image);
+        if (av_frame_make_writable(frame) < 0)
+            return false;
+        int stride = image.step[0];
+        sws_scale(convert_ctx, &image.data, &stride, 0, size.height, frame->data, frame->linesize);
+        frame->pts = i;
+        if (avcodec_send_frame(enc_ctx, frame) < 0 || !writePackets())
+            return false;
+    }
+    if (avcodec_send_frame(enc_ctx, nullptr) < 0 || !writePackets())
+        return false;
+
+    return av_write_trailer(format_context) == 0;
+}
+
+// Allocations made on every thread, by the pipeline, the estimation pool and OpenCV's parallel_for_ as much as by the
+// stabilizer, from the stabilizer callback of frame warmupFrames to the end of the last one. What is still live once
+// the run is over, with the stabilizer alive, is memory that grows with the length of the video.
+class AllocationCounter
+{
+public:
+    AllocationCounter(int warmupFrames, int frames) : m_warmupFrames(warmupFrames), m_lastFrame(frames) {}
+
+    // Around every stabilizer callback.
+    class Frame
+    {
+    public:
+        explicit Frame(AllocationCounter& counter) : m_counter(counter) { m_counter.BeginFrame(); }
+        ~Frame() { m_counter.EndFrame(); }
+
+    private:
+        AllocationCounter& m_counter;
+    };
+
+    // Once the run is over, with the stabilizer still alive.
+    void Finish()
+    {
+        if (g_countAllocations.exchange(false))
+            m_endAllocations = g_allocations;
+        m_endLive = g_liveAllocations;
+    }
+
+    int SteadyFrames() const { return std::max(0, m_frames - m_warmupFrames); }
+    double PerFrame() const { return double(m_endAllocations - m_startAllocations) / SteadyFrames(); }
+    // allocations made in the steady state and not freed yet
+    int64_t LiveGrowth() const { return m_endLive - m_startLive; }
+
+private:
+    void BeginFrame()
+    {
+        if (m_frames == m_warmupFrames) {
+            m_startAllocations = g_allocations;
+            m_startLive = g_liveAllocations;
+            m_endAllocations = m_startAllocations;
+            g_countAllocations = true;
+        }
+    }
+
+    void EndFrame()
+    {
+        if (++m_frames == m_lastFrame && g_countAllocations.exchange(false))
+            m_endAllocations = g_allocations;
+    }
+
+    const int m_warmupFrames;
+    const int m_lastFrame;
+    int m_frames = 0;
+    int64_t m_startAllocations = 0, m_startLive = 0;
+    int64_t m_endAllocations = 0, m_endLive = 0;
+};
+
+struct ErrorStats
+{
+    double sumSquares = 0;
+    double max = 0;
+    int count = 0;
+
+    void Add(double error)
+    {
+        sumSquares += error * error;
+        max = std::max(max, fabs(error));
+        ++count;
+    }
+    double Rms() const { return count ? sqrt(sumSquares / count) : 0; }
+};
+
+void PrintMetric(cv::Size size, int frames, MotionModel model, const std::string& metric, double value)
+{
+    printf("%d,%d,%d,%s,%s,%.6g\n", size.width, size.height, frames, MotionModelName(model), metric.c_str(), value);
+}
+
+std::string MetricName(const char* stage, const char* suffix)
+{
+    std::string name = stage;
+    std::replace(name.begin(), name.end(), ' ', '_');
+    return name + suffix;
+}
+
+bool ParseSizes(const char* list, std::vector<cv::Size>& sizes)
+{
+    sizes.clear();
+    for (const char* p = list; *p; ) {
+        int width = 0, height = 0, length = 0;
+        if (sscanf(p, "%dx%d%n", &width, &height, &length) != 2 || width < 64 || height < 64)
+            return false;
+        sizes.emplace_back(width & ~1, height & ~1);
+        p += length;
+        if (*p == ',')
+            ++p;
+    }
+    return !sizes.empty();
+}
+
+bool ParseModels(const char* list, std::vector<MotionModel>& models)
+{
+    models.clear();
+    std::string names = list;
+    for (size_t begin = 0; begin <= names.size(); ) {
+        const size_t end = std::min(names.find(',', begin), names.size());
+        MotionModel model;
+        if (!ParseMotionModel(names.substr(begin, end - begin).c_str(), model))
+            return false;
+        models.push_back(model);
+        begin = end + 1;
+    }
+    return !models.empty();
+}
+
+}
+
+
+int main(int argc, char **argv)
+{
+    ShakeOptions shake;
+    StabilizerOptions stabilizerOptions;
+    bool nativeYuv = false;
+    unsigned int estimationThreads = 0;
+    bool keepFiles = false;
+    int warmupFrames = 30;
+    bool checkAllocations = false;
+    double maxAllocationsPerFrame = -1;
+    std::string workDir = ".";
+    std::vector<cv::Size> sizes{ { 640, 360 }, { 1280, 720 }, { 1920, 1080 } };
+    std::vector<MotionModel> models{ MotionModel::Rigid };
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc && ParseSizes(argv[i + 1], sizes))
+            ++i;
+        else if (strcmp(argv[i], "--motion-models") == 0 && i + 1 < argc && ParseModels(argv[i + 1], models))
+            ++i;
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+            shake.frames = std::max(2, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--jitter") == 0 && i + 1 < argc)
+            shake.jitter = atof(argv[++i]);
+        else if (strcmp(argv[i], "--scale-jitter") == 0 && i + 1 < argc)
+            shake.scaleJitter = std::min(50., std::max(0., atof(argv[++i])));
+        else if (strcmp(argv[i], "--rotation-jitter") == 0 && i + 1 < argc)
+            shake.rotationJitter = atof(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            shake.seed = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--yuv") == 0)
+            nativeYuv = true;
+        else if (strcmp(argv[i], "--analysis-height") == 0 && i + 1 < argc)
+            stabilizerOptions.analysisHeight = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--detect-every-frame") == 0)
+            stabilizerOptions.tracking.persistent = false;
+        else if (strcmp(argv[i], "--parallel-estimation") == 0)
+            stabilizerOptions.pairwiseEstimation = true;
+        else if (strcmp(argv[i], "--tiles") == 0 && i + 1 < argc) {
+            auto& tracking = stabilizerOptions.tracking;
+            if (sscanf(argv[++i], "%dx%d", &tracking.gridCols, &tracking.gridRows) != 2
+                || tracking.gridCols < 1 || tracking.gridRows < 1) {
+                fprintf(stderr, "Expected --tiles COLSxROWS, not '%s'\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            tracking.tiled = true;
+        }
+        else if (strcmp(argv[i], "--min-tile-inliers") == 0 && i + 1 < argc)
+            stabilizerOptions.tracking.minTileInlierRatio = atof(argv[++i]);
+        else if (strcmp(argv[i], "--adaptive-decimation") == 0 && i + 1 < argc)
+            stabilizerOptions.temporal.maxInterval = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--probe-threshold") == 0 && i + 1 < argc)
+            stabilizerOptions.temporal.probeThreshold = atof(argv[++i]);
+        else if (strcmp(argv[i], "--estimate-threads") == 0 && i + 1 < argc) {
+            stabilizerOptions.pairwiseEstimation = true;
+            estimationThreads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--work-dir") == 0 && i + 1 < argc)
+            workDir = argv[++i];
+        else if (strcmp(argv[i], "--keep-files") == 0)
+            keepFiles = true;
+        else if (strcmp(argv[i], "--warmup-frames") == 0 && i + 1 < argc)
+            warmupFrames = std::max(0, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--check-allocations") == 0)
+            checkAllocations = true;
+        else if (strcmp(argv[i], "--max-allocations-per-frame") == 0 && i + 1 < argc) {
+            checkAllocations = true;
+            maxAllocationsPerFrame = atof(argv[++i]);
+        }
+        else {
+            printf("Options:\n"
+                "  --sizes WxH,...       clip resolutions (default 640x360,1280x720,1920x1080)\n"
+                "  --motion-models M,... stabilize every clip with each of the motion models translation, rigid and\n"
+                "                        similarity in turn (default rigid)\n"
+                "  --frames N            frames per clip (default 150)\n"
+                "  --jitter PX           largest injected shift per frame on each axis (default 8)\n"
+                "  --rotation-jitter DEG largest injected rotation per frame (default 0.5)\n"
+                "  --scale-jitter PCT    largest injected zoom per frame, in percent (default 0, for the similarity)\n"
+                "  --seed N              seed of the scene and the shake\n"
+                "  --yuv, --analysis-height N, --detect-every-frame, --parallel-estimation, --estimate-threads N,\n"
+                "  --adaptive-decimation N, --probe-threshold PX, --tiles CxR, --min-tile-inliers R\n"
+                "                        stabilizer configuration, as for VideoStabilizer\n"
+                "  --work-dir DIR        where the clips are written (default the current directory)\n"
+                "  --keep-files          keep the synthetic and the stabilized clips\n"
+                "  --warmup-frames N     frames before the allocations count as steady state (default 30)\n"
+                "  --check-allocations   fail if any allocation made after the warm-up is alive after the run\n"
+                "  --max-allocations-per-frame N\n"
+                "                        ...or if there are more than N allocations per frame in the steady state\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // never freed, the cv::Mats of OpenCV's own statics may outlive main()
+    cv::Mat::setDefaultAllocator(new CountingMatAllocator);
+
+    const double degree = CV_PI / 180;
+    bool failed = false;
+
+    printf("width,height,frames,model,metric,value\n");
+    for (const auto& size : sizes) {
+        // the scene is big enough for the pan, the jitter and the rotated corners
+        const double panAmplitude = shake.panAmplitude * size.width;
+        // zoomed out, the frame sees that much more of the scene
+        const double minZoom = 1 - shake.scaleJitter / 100;
+        const int margin = int(ceil(panAmplitude + shake.jitter
+            + sin(shake.rotationJitter * degree) * (size.width + size.height) / 2
+            + (1 / minZoom - 1) * std::max(size.width, size.height) / 2) / minZoom) + 8;
+        const cv::Size sceneSize(size.width + 2 * margin, size.height + 2 * margin);
+
+        cv::RNG rng(shake.seed);
+        const auto scene = MakeScene(sceneSize, rng);
+
+        std::vector<cv::Matx33d> cameras;
+        for (int i = 0; i < shake.frames; ++i) {
+            const double pan = panAmplitude * sin(2 * CV_PI * i / shake.panPeriod);
+            // drawn only with a scale jitter, so that the clips without one stay those of earlier builds
+            const double zoom = shake.scaleJitter > 0 ? 1 + rng.uniform(-shake.scaleJitter, shake.scaleJitter) / 100 : 1;
+            cameras.push_back(CameraMatrix(sceneSize, size,
+                pan + rng.uniform(-shake.jitter, shake.jitter),
+                rng.uniform(-shake.jitter, shake.jitter),
+                rng.uniform(-shake.rotationJitter, shake.rotationJitter) * degree,
+                zoom));
+        }
+
+        const std::string name = workDir + "/synthetic-" + std::to_string(size.width) + "x" + std::to_string(size.height);
+        const std::string clipPath = name + ".mkv";
+
+        const bool written = WriteClip(clipPath, size, shake.frames, shake.fps, [&](int index, cv::Mat& frame) {
+            warpAffine(scene, frame, cv::Mat(cameras[index]).rowRange(0, 2), size, cv::INTER_LINEAR, cv::BORDER_REFLECT);
+        });
+        if (!written) {
+            fprintf(stderr, "Could not write the synthetic clip '%s'\n", clipPath.c_str());
+            failed = true;
+            continue;
+        }
+
+        for (const auto model : models) {
+            const std::string outputPath = name + "-stabilized-" + MotionModelName(model) + ".mkv";
+            const std::string telemetryPath = name + "-" + MotionModelName(model) + ".vstm";
+
+            std::vector<StageTime> stageTimes;
+            AllocationCounter allocations(warmupFrames, shake.frames);
+            Metrics metrics;
+            double seconds = 0;
+            int ret = 0;
+            {
+                auto options = stabilizerOptions;
+                options.model = model;
+                options.telemetryPath = telemetryPath;
+                options.metrics = &metrics;
+                Stabilizer stabilizer(options);
+
+                TransformVideoOptions videoOptions;
+                videoOptions.estimationThreads = estimationThreads;
+                videoOptions.stageTimesCallback = [&stageTimes](const std::vector<StageTime>& times) { stageTimes = times; };
+                if (options.pairwiseEstimation) {
+                    videoOptions.pairCallback = [&stabilizer](const cv::Mat& prev, const cv::Mat& cur, cv::Size frameSize, int64_t index) {
+                        stabilizer.EstimatePair(prev, cur, frameSize, index);
+                    };
+                }
+                if (nativeYuv) {
+                    videoOptions.planarCallback = [&](const PlanarImage& cur, PlanarImage& out) {
+                        AllocationCounter::Frame frame(allocations);
+                        stabilizer(cur, out);
+                    };
+                }
+                else if (options.analysisHeight > 0) {
+                    videoOptions.proxyCallback = [&](cv::Mat& cur, const cv::Mat& analysis) {
+                        AllocationCounter::Frame frame(allocations);
+                        stabilizer(cur, analysis);
+                    };
+                    videoOptions.proxyHeight = options.analysisHeight;
+                }
+
+                const auto start = std::chrono::steady_clock::now();
+                ret = TransformVideo(clipPath.c_str(), outputPath.c_str(), [&](cv::Mat& cur) {
+                    AllocationCounter::Frame frame(allocations);
+                    stabilizer(cur);
+                }, videoOptions);
+                seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                allocations.Finish();
+            }
+            // the telemetry file is complete once the stabilizer is gone
+
+            std::vector<MotionRecord> motion;
+            if (ret != 0 || !LoadTelemetry(telemetryPath, motion)) {
+                fprintf(stderr, "Stabilizing '%s' failed\n", clipPath.c_str());
+                failed = true;
+            }
+            else {
+                PrintMetric(size, shake.frames, model, "seconds", seconds);
+                PrintMetric(size, shake.frames, model, "fps", shake.frames / seconds);
+                for (const auto& stage : stageTimes) {
+                    PrintMetric(size, shake.frames, model, MetricName(stage.name, "_busy_ms_per_frame"), stage.busySeconds * 1000 / shake.frames);
+                    PrintMetric(size, shake.frames, model, MetricName(stage.name, "_waiting_ms_per_frame"), stage.waitingSeconds * 1000 / shake.frames);
+                }
+
+                // record k holds the motion from frame k - 1 to frame k
+                ErrorStats dx, dy, da, ds;
+                int minTracked = INT32_MAX;
+                for (const auto& record : motion) {
+                    if (record.frame < 1 || record.frame >= shake.frames)
+                        continue;
+                    const cv::Matx33d truth = cameras[record.frame] * cameras[record.frame - 1].inv();
+                    dx.Add(record.dx - truth(0, 2));
+                    dy.Add(record.dy - truth(1, 2));
+                    da.Add(record.da - atan2(truth(1, 0), truth(0, 0)));
+                    ds.Add(record.ds - log(std::hypot(truth(0, 0), truth(1, 0))));
+                    // the frames skipped by the temporal decimation track no points
+                    if (record.tracked > 0)
+                        minTracked = std::min(minTracked, int(record.tracked));
+                }
+                const auto& estimation = metrics.Histogram(Stage::EstimateRigid);
+                PrintMetric(size, shake.frames, model, "estimate_rigid_ms_per_frame",
+                    estimation.Count() ? estimation.SumNs() * 1e-6 / estimation.Count() : 0);
+                PrintMetric(size, shake.frames, model, "estimation_failures", double(metrics.Value(Counter::EstimationFailures)));
+                PrintMetric(size, shake.frames, model, "estimations_skipped", double(metrics.Value(Counter::EstimationsSkipped)));
+                PrintMetric(size, shake.frames, model, "tiles_dropped", double(metrics.Value(Counter::TilesDropped)));
+                PrintMetric(size, shake.frames, model, "estimated_frames", dx.count);
+                PrintMetric(size, shake.frames, model, "min_tracked", minTracked != INT32_MAX ? minTracked : 0);
+                PrintMetric(size, shake.frames, model, "dx_rms_error_px", dx.Rms());
+                PrintMetric(size, shake.frames, model, "dx_max_error_px", dx.max);
+                PrintMetric(size, shake.frames, model, "dy_rms_error_px", dy.Rms());
+                PrintMetric(size, shake.frames, model, "dy_max_error_px", dy.max);
+                PrintMetric(size, shake.frames, model, "da_rms_error_deg", da.Rms() / degree);
+                PrintMetric(size, shake.frames, model, "da_max_error_deg", da.max / degree);
+                // of the log of the scale, times 100 about the error of the zoom in percent
+                PrintMetric(size, shake.frames, model, "ds_rms_error_pct", ds.Rms() * 100);
+                PrintMetric(size, shake.frames, model, "ds_max_error_pct", ds.max * 100);
+
+                if (allocations.SteadyFrames() > 0) {
+                    PrintMetric(size, shake.frames, model, "steady_allocations_per_frame", allocations.PerFrame());
+                    PrintMetric(size, shake.frames, model, "steady_live_allocations", double(allocations.LiveGrowth()));
+                }
+                if (checkAllocations) {
+                    const int steadyFrames = allocations.SteadyFrames();
+                    if (steadyFrames < 2) {
+                        fprintf(stderr, "%d frames are too few to check the allocations after %d warm-up frames\n",
+                            shake.frames, warmupFrames);
+                        failed = true;
+                    }
+                    else if (allocations.LiveGrowth() > 0) {
+                        fprintf(stderr, "%dx%d %s: %lld of the allocations of %d frames are still alive\n",
+                            size.width, size.height, MotionModelName(model), (long long)allocations.LiveGrowth(),
+                            steadyFrames);
+                        failed = true;
+                    }
+                    else if (maxAllocationsPerFrame >= 0 && allocations.PerFrame() > maxAllocationsPerFrame) {
+                        fprintf(stderr, "%dx%d %s: %.2f allocations per frame, more than %g\n",
+                            size.width, size.height, MotionModelName(model), allocations.PerFrame(),
+                            maxAllocationsPerFrame);
+                        failed = true;
+                    }
+                }
+            }
+            fflush(stdout);
+
+            if (!keepFiles)
+                remove(outputPath.c_str());
+            remove(telemetryPath.c_str());
+        }
+
+        if (!keepFiles)
+            remove(clipPath.c_str());
+    }
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
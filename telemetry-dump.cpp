@@ -0,0 +1,44 @@
+// Dumps a binary telemetry file written by VideoStabilizer --telemetry as CSV.
+
+#include "Telemetry.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        printf("You need to pass the telemetry file name as program parameter.\n");
+        return EXIT_FAILURE;
+    }
+
+    FILE* file = fopen(argv[1], "rb");
+    if (file == nullptr) {
+        fprintf(stderr, "Could not open telemetry file '%s'\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    TelemetryFileHeader header{};
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || memcmp(header.magic, TELEMETRY_MAGIC, sizeof(header.magic)) != 0
+        || header.version != TELEMETRY_VERSION
+        || header.record_size != sizeof(MotionRecord)) {
+        fprintf(stderr, "'%s' is not a supported telemetry file\n", argv[1]);
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+
+    printf("frame,tracked,dx,dy,da,ds,x,y,a,s,smoothed_x,smoothed_y,smoothed_a,smoothed_s,new_dx,new_dy,new_da,new_ds\n");
+
+    MotionRecord r;
+    while (fread(&r, sizeof(r), 1, file) == 1) {
+        printf("%d,%d,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g\n",
+            r.frame, r.tracked, r.dx, r.dy, r.da, r.ds, r.x, r.y, r.a, r.s,
+            r.smoothed_x, r.smoothed_y, r.smoothed_a, r.smoothed_s, r.new_dx, r.new_dy, r.new_da, r.new_ds);
+    }
+
+    fclose(file);
+    return EXIT_SUCCESS;
+}
@@ -2,23 +2,602 @@
 
 #include "TransformVideo.h"
 #include "Stabilizer.h"
+#include "ThreadPool.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
 #include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 
+static void PrintQueueFill(const std::vector<QueueFill>& queues)
+{
+    for (const auto& queue : queues)
+        fprintf(stderr, "%s: %zu/%zu ", queue.name, queue.size, queue.capacity);
+    fprintf(stderr, "\n");
+}
+
+static void PrintPoolStats(const std::vector<PoolStats>& pools)
+{
+    for (const auto& pool : pools)
+        fprintf(stderr, "%s: %zu buffers allocated for %zu uses\n", pool.name, pool.allocations, pool.acquisitions);
+}
+
+static int ParseThreadType(const char* mode)
+{
+    if (strcmp(mode, "frame") == 0)
+        return CodecThreadFrame;
+    if (strcmp(mode, "slice") == 0)
+        return CodecThreadSlice;
+    return CodecThreadAuto;
+}
+
+// KEY=VALUE
+static bool AddOption(const char* option, CodecOptionList& options)
+{
+    const char* separator = strchr(option, '=');
+    if (separator == nullptr || separator == option) {
+        fprintf(stderr, "Expected KEY=VALUE, not '%s'\n", option);
+        return false;
+    }
+    options.emplace_back(std::string(option, separator), separator + 1);
+    return true;
+}
+
+// Hands the frames to the stabilizer in the form selected on the command line.
+static void ConnectStabilizer(Stabilizer& stabilizer, bool nativeYuv, int proxyHeight, bool pairwiseEstimation,
+    TransformVideoOptions& options)
+{
+    if (pairwiseEstimation) {
+        options.pairCallback = [&stabilizer](const cv::Mat& prev, const cv::Mat& cur, cv::Size frameSize, int64_t index) {
+            stabilizer.EstimatePair(prev, cur, frameSize, index);
+        };
+    }
+    if (nativeYuv)
+        options.planarCallback = std::ref(stabilizer);
+    else if (proxyHeight > 0) {
+        // the proxy is scaled by swscale straight from the decoded frame
+        options.proxyCallback = std::ref(stabilizer);
+        options.proxyHeight = proxyHeight;
+    }
+}
+
+// Everything a run takes from the command line, apart from the file names.
+struct JobSettings
+{
+    TransformVideoOptions options;
+    StabilizerOptions stabilizerOptions;
+    bool nativeYuv = false;
+    bool poolStats = false;
+    const char* analyzePath = nullptr;
+    const char* applyPath = nullptr;
+    Smoothing smoothing = Smoothing::Kalman;
+    int smoothingRadius = SMOOTHING_RADIUS;
+    int segments = 1;
+    int segmentOverlap = 2 * SMOOTHING_RADIUS;
+    // --start / --end, in AV_TIME_BASE units
+    int64_t rangeStart = 0;
+    int64_t rangeEnd = INT64_MAX;
+    std::string latencyPath;
+    std::string motionCachePath;
+    // --rendition, encoded instead of out_filename
+    std::vector<Rendition> renditions;
+};
+
+// Stabilizes one file, or only analyzes it with --analyze (out_filename is then null, as it is with renditions);
+// may throw.
+static int RunJob(const char* in_filename, const char* out_filename, JobSettings job)
+{
+    // - is stdin or stdout, as for ffmpeg
+    if (strcmp(in_filename, "-") == 0)
+        in_filename = "pipe:0";
+    if (out_filename && strcmp(out_filename, "-") == 0)
+        out_filename = "pipe:1";
+
+    TransformVideoOptions& options = job.options;
+    StabilizerOptions& stabilizerOptions = job.stabilizerOptions;
+    const bool nativeYuv = job.nativeYuv;
+    const char* analyzePath = job.analyzePath;
+    const char* applyPath = job.applyPath;
+    const int segments = job.segments;
+    const int segmentOverlap = job.segmentOverlap;
+
+    std::unique_ptr<FILE, int(*)(FILE*)> latencyFile(nullptr, fclose);
+    if (!job.latencyPath.empty()) {
+        latencyFile.reset(fopen(job.latencyPath.c_str(), "w"));
+        if (!latencyFile) {
+            fprintf(stderr, "Could not open latency file '%s'\n", job.latencyPath.c_str());
+            return EXIT_FAILURE;
+        }
+        fprintf(latencyFile.get(), "pts,latency_ms\n");
+        FILE* file = latencyFile.get();
+        options.latencyCallback = [file](int64_t pts, double seconds) {
+            fprintf(file, "%lld,%.3f\n", (long long)pts, seconds * 1e3);
+        };
+    }
+
+    auto setup = [&](std::function<void(cv::Mat&)>& callback, TransformVideoOptions& segmentOptions) {
+        auto stabilizer = std::make_shared<Stabilizer>(stabilizerOptions);
+        callback = std::ref(*stabilizer);
+        ConnectStabilizer(*stabilizer, nativeYuv, stabilizerOptions.analysisHeight,
+            stabilizerOptions.pairwiseEstimation, segmentOptions);
+        return std::shared_ptr<void>(stabilizer);
+    };
+    if (segments > 1) {
+        // every segment would write the same telemetry file
+        stabilizerOptions.telemetryPath.clear();
+        return TransformVideoSegmented(in_filename, out_filename, segments, segmentOverlap, setup, options);
+    }
+    if (job.rangeStart > 0 || job.rangeEnd != INT64_MAX)
+        return TransformVideoRange(in_filename, out_filename, job.rangeStart, job.rangeEnd, segmentOverlap, setup, options);
+
+    // the analysis pass estimates inline
+    if (analyzePath)
+        stabilizerOptions.pairwiseEstimation = false;
+
+    // keyed by the input and by everything that changes the motion estimated from it
+    std::unique_ptr<MotionCache> motionCache;
+    if (!job.motionCachePath.empty() && !applyPath) {
+        Fingerprint key;
+        if (FingerprintFile(in_filename, key)) {
+            AddAnalysisOptions(key, stabilizerOptions);
+            key.Add(nativeYuv);
+            motionCache.reset(new MotionCache);
+            if (!motionCache->Open(job.motionCachePath, key.Value()))
+                return EXIT_FAILURE;
+            fprintf(stderr, "Motion cache '%s': %zu frames cached\n", job.motionCachePath.c_str(), motionCache->Reused());
+            stabilizerOptions.motionCache = motionCache.get();
+        }
+        else
+            fprintf(stderr, "Could not read '%s' to fingerprint it, the motion cache is not used\n", in_filename);
+    }
+
+    Stabilizer stabilizer(stabilizerOptions);
+    if (analyzePath) {
+        std::vector<MotionSample> samples;
+        const int ret = AnalyzeVideo(in_filename, [&](const PlanarImage& frame) {
+            MotionSample sample;
+            if (stabilizer.Analyze(frame, sample))
+                samples.push_back(sample);
+        }, options);
+        if (ret != 0)
+            return ret;
+        return SaveMotion(analyzePath, samples) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (applyPath) {
+        std::vector<MotionSample> samples;
+        if (!LoadMotion(applyPath, samples))
+            return EXIT_FAILURE;
+        std::vector<TransformParam> motion;
+        motion.reserve(samples.size());
+        for (const auto& sample : samples)
+            motion.emplace_back(sample.dx, sample.dy, sample.da, sample.ds);
+        stabilizer.SetPlan(SmoothMotion(motion, job.smoothing, job.smoothingRadius));
+    }
+    ConnectStabilizer(stabilizer, nativeYuv, applyPath ? 0 : stabilizerOptions.analysisHeight,
+        stabilizerOptions.pairwiseEstimation && !applyPath, options);
+    if (job.poolStats) {
+        options.poolStatsCallback = [&stabilizer](const std::vector<PoolStats>& pools) {
+            PrintPoolStats(pools);
+            fprintf(stderr, "stabilizer output: %zu buffers allocated\n", stabilizer.OutputBufferAllocations());
+        };
+    }
+    if (!job.renditions.empty()) {
+        for (auto& rendition : job.renditions) {
+            if (rendition.filename == "-")
+                rendition.filename = "pipe:1";
+        }
+        return TransformVideo(in_filename, job.renditions, std::ref(stabilizer), options);
+    }
+    return TransformVideo(in_filename, out_filename, std::ref(stabilizer), options);
+}
+
+// Splits a manifest line into input and output: separated by a tab, or else by the first run of spaces.
+// Returns false for blank lines and # comments; a line without an output leaves it empty.
+static bool ParseManifestLine(std::string line, std::string& input, std::string& output)
+{
+    if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+    const size_t first = line.find_first_not_of(" \t");
+    if (first == std::string::npos || line[first] == '#')
+        return false;
+    line.erase(0, first);
+    size_t separator = line.find('\t');
+    if (separator == std::string::npos)
+        separator = line.find(' ');
+    input = line.substr(0, separator);
+    output.clear();
+    if (separator != std::string::npos) {
+        const size_t begin = line.find_first_not_of(" \t", separator);
+        const size_t end = line.find_last_not_of(" \t");
+        if (begin != std::string::npos)
+            output = line.substr(begin, end + 1 - begin);
+    }
+    return true;
+}
+
+// Runs the jobs of a manifest ("-" for stdin), up to `jobs` at a time, each with a stabilizer of its own and
+// all estimating on one pool. Prints a status line per job on stdout; fails if any job failed.
+static int RunBatch(const char* manifestPath, int jobs, const JobSettings& settings)
+{
+    std::ifstream manifestFile;
+    if (strcmp(manifestPath, "-") != 0) {
+        manifestFile.open(manifestPath);
+        if (!manifestFile) {
+            fprintf(stderr, "Could not open manifest '%s'\n", manifestPath);
+            return EXIT_FAILURE;
+        }
+    }
+    std::istream& manifest = manifestFile.is_open() ? manifestFile : std::cin;
+
+    JobSettings shared = settings;
+    // the codecs of concurrent jobs split the cores instead of taking one thread per core each
+    const int coresPerJob = std::max(1, int(std::thread::hardware_concurrency()) / jobs);
+    if (shared.options.decoderThreads == 0)
+        shared.options.decoderThreads = coresPerJob;
+    if (shared.options.encoderThreads == 0)
+        shared.options.encoderThreads = coresPerJob;
+    std::unique_ptr<ThreadPool> estimationPool;
+    if (shared.stabilizerOptions.pairwiseEstimation) {
+        estimationPool.reset(new ThreadPool(shared.options.estimationThreads));
+        shared.options.estimationPool = estimationPool.get();
+    }
+    // --telemetry and --latency name suffixes of the output file in batch mode
+    const std::string telemetrySuffix = shared.stabilizerOptions.telemetryPath;
+    const std::string latencySuffix = shared.latencyPath;
+    // and --motion-cache a suffix of the input file, whose motion it holds
+    const std::string motionCacheSuffix = shared.motionCachePath;
+
+    std::mutex mutex; // guards the manifest, stdout and the totals
+    int lineNumber = 0;
+    int succeeded = 0;
+    int failed = 0;
+    auto runner = [&] {
+        for (;;) {
+            std::string input, output;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                std::string line;
+                bool found = false;
+                while (!found && std::getline(manifest, line)) {
+                    ++lineNumber;
+                    found = ParseManifestLine(line, input, output);
+                }
+                if (!found)
+                    return;
+                if (output.empty()) {
+                    ++failed;
+                    printf("failed\t%d\t0.000\t%s\t\tno output file on manifest line %d\n",
+                        EXIT_FAILURE, input.c_str(), lineNumber);
+                    fflush(stdout);
+                    continue;
+                }
+            }
+
+            JobSettings job = shared;
+            if (!telemetrySuffix.empty())
+                job.stabilizerOptions.telemetryPath = output + telemetrySuffix;
+            if (!latencySuffix.empty())
+                job.latencyPath = output + latencySuffix;
+            if (!motionCacheSuffix.empty())
+                job.motionCachePath = input + motionCacheSuffix;
+            const auto start = std::chrono::steady_clock::now();
+            int ret;
+            std::string message;
+            try {
+                ret = RunJob(input.c_str(), output.c_str(), job);
+                if (ret != 0)
+                    message = "error " + std::to_string(ret);
+            }
+            catch (const std::exception& ex) {
+                ret = EXIT_FAILURE;
+                message = std::string("exception: ") + ex.what();
+            }
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            ++(ret == 0 ? succeeded : failed);
+            printf("%s\t%d\t%.3f\t%s\t%s\t%s\n", ret == 0 ? "ok" : "failed", ret, seconds,
+                input.c_str(), output.c_str(), message.c_str());
+            fflush(stdout);
+        }
+    };
+
+    std::vector<std::thread> runners;
+    for (int i = 0; i < jobs; ++i)
+        runners.emplace_back(runner);
+    for (auto& thread : runners)
+        thread.join();
+
+    fprintf(stderr, "%d jobs succeeded, %d failed\n", succeeded, failed);
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 int main(int argc, char **argv)
 {
-    if (argc < 3) {
+    JobSettings job;
+    TransformVideoOptions& options = job.options;
+    StabilizerOptions& stabilizerOptions = job.stabilizerOptions;
+    const char* batchPath = nullptr;
+    int jobs = 2;
+    const char* metricsJsonPath = nullptr;
+    const char* metricsPrometheusPath = nullptr;
+    int metricsInterval = 0;
+    std::vector<const char*> files;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--queue-stats") == 0)
+            options.queueStatsCallback = PrintQueueFill;
+        else if (strcmp(argv[i], "--pool-stats") == 0)
+            job.poolStats = true;
+        else if (strcmp(argv[i], "--yuv") == 0)
+            job.nativeYuv = true;
+        else if (strcmp(argv[i], "--analysis-height") == 0 && i + 1 < argc)
+            stabilizerOptions.analysisHeight = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--decimate") == 0 && i + 1 < argc)
+            stabilizerOptions.decimation = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--motion-model") == 0 && i + 1 < argc) {
+            if (!ParseMotionModel(argv[++i], stabilizerOptions.model)) {
+                fprintf(stderr, "Expected --motion-model translation, rigid or similarity, not '%s'\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--detect-every-frame") == 0)
+            stabilizerOptions.tracking.persistent = false;
+        else if (strcmp(argv[i], "--parallel-estimation") == 0)
+            stabilizerOptions.pairwiseEstimation = true;
+        else if (strcmp(argv[i], "--estimate-threads") == 0 && i + 1 < argc) {
+            stabilizerOptions.pairwiseEstimation = true;
+            options.estimationThreads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--adaptive-decimation") == 0 && i + 1 < argc)
+            stabilizerOptions.temporal.maxInterval = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--probe-threshold") == 0 && i + 1 < argc)
+            stabilizerOptions.temporal.probeThreshold = atof(argv[++i]);
+        else if (strcmp(argv[i], "--tiles") == 0 && i + 1 < argc) {
+            auto& tracking = stabilizerOptions.tracking;
+            if (sscanf(argv[++i], "%dx%d", &tracking.gridCols, &tracking.gridRows) != 2
+                || tracking.gridCols < 1 || tracking.gridRows < 1) {
+                fprintf(stderr, "Expected --tiles COLSxROWS, not '%s'\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            tracking.tiled = true;
+        }
+        else if (strcmp(argv[i], "--min-tile-inliers") == 0 && i + 1 < argc)
+            stabilizerOptions.tracking.minTileInlierRatio = atof(argv[++i]);
+        else if (strcmp(argv[i], "--min-tracked") == 0 && i + 1 < argc)
+            stabilizerOptions.tracking.minTracked = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--telemetry") == 0 && i + 1 < argc)
+            stabilizerOptions.telemetryPath = argv[++i];
+        else if (strcmp(argv[i], "--motion-cache") == 0 && i + 1 < argc)
+            job.motionCachePath = argv[++i];
+        else if (strcmp(argv[i], "--analyze") == 0 && i + 1 < argc)
+            job.analyzePath = argv[++i];
+        else if (strcmp(argv[i], "--apply") == 0 && i + 1 < argc)
+            job.applyPath = argv[++i];
+        else if (strcmp(argv[i], "--smoothing") == 0 && i + 1 < argc)
+            job.smoothing = (strcmp(argv[++i], "window") == 0) ? Smoothing::Window : Smoothing::Kalman;
+        else if (strcmp(argv[i], "--smoothing-radius") == 0 && i + 1 < argc)
+            job.smoothingRadius = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--segments") == 0 && i + 1 < argc)
+            job.segments = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--segment-overlap") == 0 && i + 1 < argc)
+            job.segmentOverlap = atoi(argv[++i]);
+        else if ((strcmp(argv[i], "--start") == 0 || strcmp(argv[i], "--end") == 0) && i + 1 < argc) {
+            int64_t& time = (strcmp(argv[i], "--start") == 0) ? job.rangeStart : job.rangeEnd;
+            if (!ParseTime(argv[++i], time) || time < 0) {
+                fprintf(stderr, "Expected a time in seconds or [HH:]MM:SS[.m], not '%s'\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--decoder-threads") == 0 && i + 1 < argc)
+            options.decoderThreads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--decoder-threading") == 0 && i + 1 < argc)
+            options.decoderThreadType = ParseThreadType(argv[++i]);
+        else if (strcmp(argv[i], "--encoder-threads") == 0 && i + 1 < argc)
+            options.encoderThreads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--encoder-threading") == 0 && i + 1 < argc)
+            options.encoderThreadType = ParseThreadType(argv[++i]);
+        else if (strcmp(argv[i], "--encoder") == 0 && i + 1 < argc)
+            options.encoder = argv[++i];
+        else if (strcmp(argv[i], "--pix-fmt") == 0 && i + 1 < argc)
+            options.pixelFormat = argv[++i];
+        else if (strcmp(argv[i], "--preset") == 0 && i + 1 < argc)
+            options.encoderOptions.emplace_back("preset", argv[++i]);
+        else if (strcmp(argv[i], "--crf") == 0 && i + 1 < argc)
+            options.encoderOptions.emplace_back("crf", argv[++i]);
+        else if (strcmp(argv[i], "--gop") == 0 && i + 1 < argc)
+            options.encoderOptions.emplace_back("g", argv[++i]);
+        else if (strcmp(argv[i], "--encoder-option") == 0 && i + 1 < argc) {
+            if (!AddOption(argv[++i], options.encoderOptions))
+                return EXIT_FAILURE;
+        }
+        else if (strcmp(argv[i], "--muxer-option") == 0 && i + 1 < argc) {
+            if (!AddOption(argv[++i], options.muxerOptions))
+                return EXIT_FAILURE;
+        }
+        else if (strcmp(argv[i], "--rendition") == 0 && i + 2 < argc) {
+            Rendition rendition;
+            if (sscanf(argv[++i], "%dx%d", &rendition.width, &rendition.height) != 2
+                || rendition.width < 0 || rendition.height < 0) {
+                fprintf(stderr, "Expected --rendition WIDTHxHEIGHT FILE, not '%s'\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            rendition.filename = argv[++i];
+            job.renditions.push_back(rendition);
+        }
+        else if (strcmp(argv[i], "--rendition-option") == 0 && i + 1 < argc) {
+            if (job.renditions.empty()) {
+                fprintf(stderr, "--rendition-option applies to the --rendition before it\n");
+                return EXIT_FAILURE;
+            }
+            if (!AddOption(argv[++i], job.renditions.back().encoderOptions))
+                return EXIT_FAILURE;
+        }
+        else if (strcmp(argv[i], "--demuxer-option") == 0 && i + 1 < argc) {
+            if (!AddOption(argv[++i], options.demuxerOptions))
+                return EXIT_FAILURE;
+        }
+        else if (strcmp(argv[i], "--io-buffer") == 0 && i + 1 < argc)
+            options.ioBufferSize = size_t(std::max(0, atoi(argv[++i]))) << 20;
+        else if (strcmp(argv[i], "--mmap-input") == 0)
+            options.mapInput = true;
+        else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc)
+            options.outputFormat = argv[++i];
+        else if (strcmp(argv[i], "--live") == 0)
+            options.live = true;
+        else if (strcmp(argv[i], "--lookahead") == 0 && i + 1 < argc) {
+            stabilizerOptions.lookahead = std::max(0, atoi(argv[++i]));
+            stabilizerOptions.pairwiseEstimation = true;
+            options.lookahead = stabilizerOptions.lookahead;
+        }
+        else if (strcmp(argv[i], "--latency") == 0 && i + 1 < argc)
+            job.latencyPath = argv[++i];
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+            batchPath = argv[++i];
+        else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc)
+            jobs = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--metrics-json") == 0 && i + 1 < argc)
+            metricsJsonPath = argv[++i];
+        else if (strcmp(argv[i], "--metrics-prometheus") == 0 && i + 1 < argc)
+            metricsPrometheusPath = argv[++i];
+        else if (strcmp(argv[i], "--metrics-interval") == 0 && i + 1 < argc)
+            metricsInterval = atoi(argv[++i]);
+        else
+            files.push_back(argv[i]);
+    }
+
+    if (files.size() < (batchPath ? 0u : (job.analyzePath || !job.renditions.empty()) ? 1u : 2u)) {
         printf("You need to pass input and output file names as program parameters.\n");
+        printf("With --analyze or --rendition only the input file is needed, with --batch none.\n");
+        printf("Options:\n"
+            "  --queue-stats         periodically print the fill level of the pipeline queues\n"
+            "  --pool-stats          print how many buffers were allocated at the end of the run\n"
+            "  --yuv                 process planar YUV frames natively instead of converting to BGR\n"
+            "  --analysis-height N   estimate motion on a grey proxy N pixels tall\n"
+            "  --decimate N          estimate motion on a grey proxy decimated by N\n"
+            "  --motion-model MODEL  translation, rigid (default) or similarity: the motion estimated, smoothed and\n"
+            "                        compensated; give the same one to --analyze and --apply\n"
+            "  --detect-every-frame  detect corners from scratch on every frame instead of tracking them\n"
+            "  --min-tracked N       detect new corners when fewer than N tracked points survive\n"
+            "  --tiles CxR           detect and track the corners of a grid of C x R tiles in parallel, each with\n"
+            "                        its share of them, and leave tiles moving on their own out of the fit\n"
+            "  --min-tile-inliers R  ...when the share of their points that are inliers falls below R (default 0.3,\n"
+            "                        0 keeps every tile)\n"
+            "  --adaptive-decimation N\n"
+            "                        estimate the motion every 1 to N frames, depending on how predictable it is,\n"
+            "                        and extrapolate it in between, for high frame rate input\n"
+            "  --probe-threshold PX  ...estimating early when a cheap probe sees the image PX analysis pixels away\n"
+            "                        from the extrapolation (default 2, 0 disables the probe)\n"
+            "  --parallel-estimation estimate the motion of several frame pairs at once, one thread per core\n"
+            "  --estimate-threads N  same with N threads\n"
+            "  --telemetry FILE      write binary per-frame motion records to FILE (see TelemetryDump)\n"
+            "  --motion-cache FILE   reuse the motion estimated by earlier runs on the same input with the same\n"
+            "                        analysis options, and resume an interrupted one, through the cache FILE\n"
+            "  --analyze FILE        only estimate the motion and save it to FILE\n"
+            "  --apply FILE          stabilize with the motion saved by --analyze, smoothed over the whole video\n"
+            "  --smoothing METHOD    kalman (default) or window, used with --apply\n"
+            "  --smoothing-radius N  frames on each side of the averaging window\n"
+            "  --segments N          split the video at keyframes into N segments processed in parallel\n"
+            "  --segment-overlap N   frames decoded before each segment (or the range) to warm up the stabilizer\n"
+            "  --start TIME          only stabilize from TIME on (seconds or [HH:]MM:SS[.m]), widened to the\n"
+            "                        keyframe before it; the GOPs outside the range are copied as they are\n"
+            "  --end TIME            ...up to TIME, widened to the next keyframe\n"
+            "  --decoder-threads N   decoder threads, 0 (default) for one per core\n"
+            "  --decoder-threading M frame, slice or auto (default)\n"
+            "  --encoder-threads N   encoder threads, 0 (default) for one per core\n"
+            "  --encoder-threading M frame, slice or auto (default)\n"
+            "  --encoder NAME        encoder (libx264) or codec (hevc), by default the input codec\n"
+            "  --pix-fmt NAME        encoder pixel format, by default the input one if the encoder supports it\n"
+            "  --preset NAME         encoder speed preset, e.g. veryfast\n"
+            "  --crf N               constant rate factor\n"
+            "  --gop N               keyframe interval\n"
+            "  --encoder-option K=V  any other encoder option, may be repeated\n"
+            "  --muxer-option K=V    muxer option, e.g. movflags=+faststart, may be repeated\n"
+            "  --rendition WxH FILE  encode the stabilized video scaled to W x H into FILE instead of the output,\n"
+            "                        may be repeated for a ladder encoded in parallel; 0 keeps the aspect ratio\n"
+            "  --rendition-option K=V\n"
+            "                        encoder option of the last --rendition only, e.g. b=3M, may be repeated\n"
+            "  --demuxer-option K=V  demuxer option, e.g. probesize=32768, may be repeated\n"
+            "  --io-buffer MB        read the input ahead and write the output behind on threads of their own,\n"
+            "                        through MB MiB ring buffers, so that file I/O overlaps the processing\n"
+            "  --mmap-input          read a local input file through a memory mapping instead\n"
+            "  --format NAME         output container, e.g. mpegts or mp4, needed when writing to stdout (-)\n"
+            "  --live                low latency: no demuxer buffering, low-delay codec settings, fragmented MP4\n"
+            "  --lookahead N         smooth over a window reaching N frames ahead, delaying the output by N frames\n"
+            "  --latency FILE        write the time from reading to writing every frame as CSV\n"
+            "  --batch FILE          run the input/output pairs listed in FILE (- for stdin), one per line,\n"
+            "                        tab or space separated; --telemetry then names a suffix of the outputs,\n"
+            "                        --motion-cache a suffix of the inputs\n"
+            "  --jobs N              videos processed at the same time in batch mode, 2 by default\n"
+            "  --metrics-json FILE   write per-stage latency percentiles and counters as JSON at the end\n"
+            "  --metrics-prometheus FILE\n"
+            "                        keep the same metrics in a Prometheus text file, rewritten on SIGUSR1\n"
+            "  --metrics-interval S  ...and every S seconds\n");
+        return EXIT_FAILURE;
+    }
+
+    if (job.segments > 1 && (job.analyzePath || job.applyPath)) {
+        fprintf(stderr, "--segments can't be combined with --analyze or --apply\n");
+        return EXIT_FAILURE;
+    }
+    if (job.segments > 1 && !job.motionCachePath.empty()) {
+        fprintf(stderr, "--motion-cache can't be combined with --segments\n");
+        return EXIT_FAILURE;
+    }
+    const bool range = job.rangeStart > 0 || job.rangeEnd != INT64_MAX;
+    if (range && (job.segments > 1 || job.analyzePath || job.applyPath || options.live)) {
+        fprintf(stderr, "--start and --end can't be combined with --segments, --analyze, --apply or --live\n");
+        return EXIT_FAILURE;
+    }
+    if (range && !job.motionCachePath.empty()) {
+        fprintf(stderr, "--motion-cache can't be combined with --start or --end\n");
+        return EXIT_FAILURE;
+    }
+    if (stabilizerOptions.temporal.maxInterval > 1 && stabilizerOptions.pairwiseEstimation) {
+        fprintf(stderr, "--adaptive-decimation applies to the inline estimation, not to --parallel-estimation or --lookahead\n");
         return EXIT_FAILURE;
     }
-    
-    const char *in_filename = argv[1];
-    const char *out_filename = argv[2];
-    
+    if (options.live && job.segments > 1) {
+        fprintf(stderr, "--live can't be combined with --segments\n");
+        return EXIT_FAILURE;
+    }
+    if (batchPath && (job.analyzePath || job.applyPath)) {
+        fprintf(stderr, "--batch can't be combined with --analyze or --apply\n");
+        return EXIT_FAILURE;
+    }
+    if (!job.renditions.empty() && (job.segments > 1 || range || job.analyzePath || batchPath)) {
+        fprintf(stderr, "--rendition can't be combined with --segments, --start, --end, --analyze or --batch\n");
+        return EXIT_FAILURE;
+    }
+
+    // the reporter is declared last, so that it is destroyed before the metrics
+    std::unique_ptr<Metrics> metrics;
+    std::unique_ptr<MetricsReporter> reporter;
+    if (metricsJsonPath || metricsPrometheusPath) {
+        metrics.reset(new Metrics);
+        options.metrics = metrics.get();
+        stabilizerOptions.metrics = metrics.get();
+        if (metricsPrometheusPath)
+            reporter.reset(new MetricsReporter(*metrics, metricsPrometheusPath, metricsInterval * 1000));
+    }
+    auto finish = [&](int ret) {
+        reporter.reset();
+        if (metricsJsonPath)
+            metrics->WriteJson(metricsJsonPath);
+        return ret;
+    };
+
     try {
-        Stabilizer stabilizer;
-        return TransformVideo(in_filename, out_filename, std::ref(stabilizer));
+        if (batchPath)
+            return finish(RunBatch(batchPath, jobs, job));
+        return finish(RunJob(files[0], (job.analyzePath || !job.renditions.empty()) ? nullptr : files[1], job));
     }
     catch (const std::exception& ex) {
         std::cerr << "Exception " << typeid(ex).name() << ": " << ex.what() << '\n';
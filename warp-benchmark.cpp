@@ -0,0 +1,129 @@
+// Compares RigidWarp with cv::warpAffine on 1080p and 4K frames: time per frame of every instruction set
+// and the largest pixel difference. Prints CSV; fails if a difference exceeds the bound.
+
+#include "RigidWarp.h"
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+
+namespace {
+
+// Smooth test picture with some texture, like a video frame rather than noise.
+cv::Mat MakeFrame(cv::Size size, int type)
+{
+    cv::Mat noise(size / 8, type);
+    cv::randu(noise, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::Mat frame;
+    resize(noise, frame, size, 0, 0, cv::INTER_CUBIC);
+    return frame;
+}
+
+// The matrix Stabilizer builds: rotation and translation, with the 20 pixel border crop scaled away.
+cv::Matx23d StabilizerMatrix(cv::Size size, double dx, double dy, double da, bool crop)
+{
+    const int crop_x = crop ? 20 : 0;
+    const int crop_y = crop_x * size.height / size.width;
+    const double sx = double(size.width) / (size.width - 2 * crop_x);
+    const double sy = double(size.height) / (size.height - 2 * crop_y);
+    const double c = cos(da);
+    const double s = sin(da);
+    return cv::Matx23d(
+        sx * c, -sx * s, sx * (dx - crop_x + 0.5) - 0.5,
+        sy * s, sy * c, sy * (dy - crop_y + 0.5) - 0.5);
+}
+
+// median of the time per call in milliseconds
+double Measure(const std::function<void()>& run, int repetitions)
+{
+    std::vector<double> times;
+    run(); // warm up
+    for (int i = 0; i < repetitions; ++i) {
+        const auto start = std::chrono::steady_clock::now();
+        run();
+        times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    std::nth_element(times.begin(), times.begin() + times.size() / 2, times.end());
+    return times[times.size() / 2];
+}
+
+}
+
+
+int main(int argc, char **argv)
+{
+    int repetitions = 20;
+    int maxDiff = 2;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--repetitions") == 0 && i + 1 < argc)
+            repetitions = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--max-diff") == 0 && i + 1 < argc)
+            maxDiff = atoi(argv[++i]);
+        else {
+            printf("Options:\n"
+                "  --repetitions N       timed runs per case, the median is reported (default 20)\n"
+                "  --max-diff N          largest pixel difference to warpAffine that passes (default 2)\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct Case
+    {
+        const char* name;
+        double dx, dy, da;
+        bool crop;
+    };
+    const Case cases[] = {
+        { "rigid", 3.7, -2.2, 0.004, true },
+        { "translation", 3.7, -2.2, 0, true },
+        { "whole-pixel-shift", 4, -2, 0, false },
+    };
+    const cv::Size sizes[] = { { 1920, 1080 }, { 3840, 2160 } };
+    const int types[] = { CV_8UC3, CV_8UC1 };
+
+    const WarpIsa best = GetWarpIsa();
+    bool passed = true;
+
+    printf("width,height,channels,case,implementation,ms,max_diff,pixels_over_1\n");
+    for (const auto& size : sizes) {
+        for (const int type : types) {
+            const auto src = MakeFrame(size, type);
+            for (const auto& c : cases) {
+                const auto M = StabilizerMatrix(size, c.dx, c.dy, c.da, c.crop);
+
+                cv::Mat reference;
+                const double referenceMs = Measure([&] { warpAffine(src, reference, M, size); }, repetitions);
+                printf("%d,%d,%d,%s,warpAffine,%.3f,0,0\n", size.width, size.height, src.channels(), c.name, referenceMs);
+
+                for (int isa = int(WarpIsa::Scalar); isa <= int(best); ++isa) {
+                    SetWarpIsa(WarpIsa(isa));
+                    cv::Mat dst;
+                    const double ms = Measure([&] { RigidWarp(src, dst, M, size); }, repetitions);
+
+                    cv::Mat diff;
+                    absdiff(dst, reference, diff);
+                    double maxVal = 0;
+                    minMaxLoc(diff.reshape(1), nullptr, &maxVal);
+                    const int diffPixels = countNonZero(diff.reshape(1) > 1);
+
+                    printf("%d,%d,%d,%s,%s,%.3f,%d,%d\n", size.width, size.height, src.channels(), c.name,
+                        WarpIsaName(WarpIsa(isa)), ms, int(maxVal), diffPixels);
+                    if (maxVal > maxDiff)
+                        passed = false;
+                }
+                SetWarpIsa(best);
+            }
+        }
+    }
+
+    if (!passed)
+        fprintf(stderr, "RigidWarp differs from warpAffine by more than %d\n", maxDiff);
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}